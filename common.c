@@ -2,6 +2,10 @@
 #include "err.h"
 #include "protconst.h"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
 void init_data_pck(uint64_t session_id, uint64_t pck_number, 
                     uint32_t data_size, char* data_pck, const char* data) {
     uint8_t pck_type = DATA_TYPE;
@@ -22,6 +26,106 @@ void init_data_pck(uint64_t session_id, uint64_t pck_number,
     memcpy(data_iter, data, be32toh(data_size));
 }
 
+size_t init_cdata_pck(uint8_t protocol_id, uint64_t session_id,
+                        uint64_t pck_number, uint32_t data_size,
+                        char* data_pck, const char* data) {
+    size_t hdr_size;
+    if (protocol_id == TCP_PROT_ID) {
+        TCP_CDATA hdr = {.pkt_type_id = CDATA_TYPE, 
+                        .pkt_nr = htobe32((uint32_t)pck_number),
+                        .data_size = htobe16((uint16_t)data_size)};
+        hdr_size = sizeof(hdr);
+        memcpy(data_pck, &hdr, hdr_size);
+    }
+    else {
+        UDP_CDATA hdr = {.pkt_type_id = CDATA_TYPE, 
+                        .conn_id = htobe16((uint16_t)session_id),
+                        .pkt_nr = htobe32((uint32_t)pck_number)};
+        hdr_size = sizeof(hdr);
+        memcpy(data_pck, &hdr, hdr_size);
+    }
+
+    memcpy(data_pck + hdr_size, data, data_size);
+    return hdr_size;
+}
+
+uint64_t expand_pkt_nr(uint32_t pkt_nr, uint64_t expected) {
+    // The signed difference picks the nearest match in either direction.
+    return expected + (int64_t)(int32_t)(pkt_nr - (uint32_t)expected);
+}
+
+void expand_udp_cdata(char* pck, ssize_t* pck_len, uint64_t session_id,
+                        uint64_t expected) {
+    if (*pck_len <= 0) {
+        return;
+    }
+
+    const UDP_CDATA* cdata = (const UDP_CDATA*)(pck + CDATA_OFFSET);
+    if (cdata->pkt_type_id != CDATA_TYPE || 
+        (size_t)*pck_len < sizeof(UDP_CDATA)) {
+        // A package with a regular header, it's usually tiny.
+        memmove(pck, pck + CDATA_OFFSET, *pck_len);
+        return;
+    }
+
+    uint16_t conn_id = be16toh(cdata->conn_id);
+    uint64_t pkt_nr = expand_pkt_nr(be32toh(cdata->pkt_nr), expected);
+    uint32_t data_size = *pck_len - sizeof(UDP_CDATA);
+
+    // The compact header lies in the last bytes of the full one,
+    // so all of its fields have to be read before writing.
+    DATA* dt = (DATA*)pck;
+    dt->pkt_type_id = DATA_TYPE;
+    // Foreign sessions are only known by their connection id.
+    dt->session_id = conn_id == (uint16_t)session_id ? session_id : conn_id;
+    dt->pkt_nr = htobe64(pkt_nr);
+    dt->data_size = htobe32(data_size);
+    *pck_len += CDATA_OFFSET;
+}
+
+size_t init_conn_pck(uint8_t protocol_id, const client_opts* opts, 
+                        uint64_t data_length, const char* first_data,
+                        uint32_t first_len, char* pck) {
+    CONN connection_data = {.pkt_type_id = CONN_TYPE, 
+                            .session_id = opts->session_id,
+                            .prot_id = protocol_id | opts->conn_flags, 
+                            .data_length = htobe64(data_length)};
+    memcpy(pck, &connection_data, sizeof(connection_data));
+    if (first_data == NULL) {
+        return sizeof(connection_data);
+    }
+    // Always a full header, the server reads it before it knows the flags.
+    init_data_pck(opts->session_id, htobe64(0), htobe32(first_len), 
+                    pck + sizeof(connection_data), first_data);
+    return sizeof(connection_data) + sizeof(DATA) - sizeof(char*) + 
+            first_len;
+}
+
+size_t init_eos_pck(uint8_t protocol_id, const client_opts* opts, 
+                    uint64_t pck_number, char* pck) {
+    if (protocol_id == TCP_PROT_ID && 
+        (opts->conn_flags & CONN_FLAG_COMPACT)) {
+        TCP_CDATA hdr = {.pkt_type_id = EOS_TYPE, 
+                        .pkt_nr = htobe32((uint32_t)pck_number),
+                        .data_size = 0};
+        memcpy(pck, &hdr, sizeof(hdr));
+        return sizeof(hdr);
+    }
+    // UDP servers pass the full header through in compact sessions too.
+    init_data_pck(opts->session_id, htobe64(pck_number), 0, pck, "");
+    pck[0] = EOS_TYPE;
+    return sizeof(DATA) - sizeof(char*);
+}
+
+void expand_tcp_cdata(const TCP_CDATA* cdata, DATA* dt, uint64_t session_id,
+                        uint64_t expected) {
+    dt->pkt_type_id = cdata->pkt_type_id == CDATA_TYPE ? DATA_TYPE : 
+                                                        cdata->pkt_type_id;
+    dt->session_id = session_id;
+    dt->pkt_nr = htobe64(expand_pkt_nr(be32toh(cdata->pkt_nr), expected));
+    dt->data_size = htobe32(be16toh(cdata->data_size));
+}
+
 void init_sockaddr(struct sockaddr_in* addr, uint16_t port) {
     addr->sin_family = AF_INET; // IPv4 protocol.
     addr->sin_addr.s_addr = htonl(INADDR_ANY); // Listening on all interfaces.
@@ -38,6 +142,102 @@ uint16_t read_port(char const *string) {
     return (uint16_t) port;
 }
 
+uint32_t read_pck_size(char const *string) {
+    char *endptr;
+    errno = 0;
+    unsigned long pck_size = strtoul(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || pck_size == 0 || 
+        pck_size > PCK_SIZE) {
+        fatal("%s is not a valid package size (1 - %d).", string, PCK_SIZE);
+    }
+    return (uint32_t) pck_size;
+}
+
+uint16_t read_stripe_count(char const *string) {
+    char *endptr;
+    errno = 0;
+    unsigned long stripe_count = strtoul(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || stripe_count == 0 || 
+        stripe_count > MAX_STRIPES) {
+        fatal("%s is not a valid number of streams (1 - %d).", string, 
+                MAX_STRIPES);
+    }
+    return (uint16_t) stripe_count;
+}
+
+uint16_t read_receiver_count(char const *string) {
+    char *endptr;
+    errno = 0;
+    unsigned long receiver_count = strtoul(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || receiver_count == 0 || 
+        receiver_count > MCAST_MAX_RECEIVERS) {
+        fatal("%s is not a valid number of receivers (1 - %d).", string, 
+                MCAST_MAX_RECEIVERS);
+    }
+    return (uint16_t) receiver_count;
+}
+
+uint32_t read_busy_poll(char const *string) {
+    char *endptr;
+    errno = 0;
+    unsigned long usecs = strtoul(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || usecs == 0 || 
+        usecs > MAX_BUSY_POLL) {
+        fatal("%s is not a valid busy poll time (1 - %d us).", string, 
+                MAX_BUSY_POLL);
+    }
+    return (uint32_t) usecs;
+}
+
+int read_cpu(char const *string) {
+    char *endptr;
+    errno = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    unsigned long cpu = strtoul(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || (long)cpu >= cpus) {
+        fatal("%s is not a valid CPU (0 - %ld).", string, cpus - 1);
+    }
+    return (int) cpu;
+}
+
+struct in_addr read_ipv4(char const *string) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, string, &addr) != 1) {
+        fatal("%s is not a valid IPv4 address.", string);
+    }
+    return addr;
+}
+
+uint64_t read_rate(char const *string) {
+    char *endptr;
+    errno = 0;
+    unsigned long long rate = strtoull(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || rate == 0) {
+        fatal("%s is not a valid rate in bytes per second.", string);
+    }
+    return (uint64_t) rate;
+}
+
+uint64_t read_budget(char const *string) {
+    char *endptr;
+    errno = 0;
+    unsigned long long budget = strtoull(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || budget == 0) {
+        fatal("%s is not a valid memory budget in bytes.", string);
+    }
+    return (uint64_t) budget;
+}
+
+uint64_t read_session_id(char const *string) {
+    char *endptr;
+    errno = 0;
+    unsigned long long session_id = strtoull(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || *string == 0) {
+        fatal("%s is not a valid session id.", string);
+    }
+    return (uint64_t) session_id;
+}
+
 ssize_t read_n_bytes(int fd, void* dsptr, size_t n) {
     ssize_t bytes_read;
     ssize_t bytes_left = n;
@@ -80,6 +280,64 @@ ssize_t write_n_bytes(int fd, void* dsptr, size_t n) {
     return n - bytes_left;
 }
 
+char* read_all(int fd, uint64_t* data_length) {
+    uint64_t buffer_size = 1024;
+    char* buffer = malloc(buffer_size * sizeof(char));
+    assert_null(buffer, -1, -1, NULL, NULL);
+    ssize_t bytes_read = 0;
+    *data_length = 0;
+    do {
+        if (buffer_size - *data_length == 0) {
+            buffer_size *= 2;
+            buffer = realloc(buffer, buffer_size * sizeof(char));
+            assert_null(buffer, -1, -1, NULL, NULL);
+        }
+        bytes_read = read(fd, buffer + *data_length, 
+                            buffer_size - *data_length);
+        if (bytes_read == -1) {
+            free(buffer);
+            return NULL;
+        }
+        *data_length += bytes_read;
+    } while (bytes_read > 0);
+
+    if (*data_length != buffer_size && *data_length > 0) {
+        buffer = realloc(buffer, *data_length);
+        assert_null(buffer, -1, -1, NULL, NULL);
+    }
+    return buffer;
+}
+
+ssize_t pread_n_bytes(int fd, void* dsptr, size_t n, off_t offset) {
+    size_t bytes_done = 0;
+    while (bytes_done < n) {
+        ssize_t bytes_read = pread(fd, (char*)dsptr + bytes_done, 
+                                    n - bytes_done, offset + bytes_done);
+        if (bytes_read < 0) {
+            return bytes_read;
+        }
+        else if (bytes_read == 0) {
+            // Encountered EOF.
+            break;
+        }
+        bytes_done += bytes_read;
+    }
+    return bytes_done;
+}
+
+ssize_t pwrite_n_bytes(int fd, const void* dsptr, size_t n, off_t offset) {
+    size_t bytes_done = 0;
+    while (bytes_done < n) {
+        ssize_t bytes_written = pwrite(fd, (const char*)dsptr + bytes_done,
+                                        n - bytes_done, offset + bytes_done);
+        if (bytes_written <= 0) {
+            return bytes_written;
+        }
+        bytes_done += bytes_written;
+    }
+    return bytes_done;
+}
+
 struct sockaddr_in get_server_address(char const *host, 
                                         uint16_t port, int8_t protocol_id) {
     struct addrinfo hints;
@@ -212,10 +470,10 @@ void print_data(char* data, size_t len) {
     fflush(stdout);
 }
 
-uint32_t calc_pck_size(uint64_t data_length) {
+uint32_t calc_pck_size(uint64_t data_length, uint32_t pck_size) {
     // Calculate a size of the data chunk that will be
     // send received.
-    uint32_t curr_len = PCK_SIZE;
+    uint32_t curr_len = pck_size;
     if (curr_len > data_length) {
         curr_len = data_length;
     }
@@ -239,6 +497,78 @@ bool get_connac_pck(const CONACC* ack_pck, uint64_t session_id) {
     return false;
 }
 
+bool get_conn_resp(const char* resp, ssize_t resp_len, 
+                    const client_opts* opts, const char* data, 
+                    uint64_t data_length, uint64_t* pck_number, 
+                    uint64_t* data_offset) {
+    const RESACC* res_pck = (const RESACC*)resp;
+    *pck_number = 0;
+    *data_offset = 0;
+    if (opts->b_first_flight && resp_len == sizeof(CONACC) + sizeof(ACC)) {
+        // The server took the DATA package sent with the CONN.
+        const ACC* acc_pck = (const ACC*)(resp + sizeof(CONACC));
+        if (acc_pck->pkt_type_id != ACC_TYPE || 
+            acc_pck->session_id != opts->session_id ||
+            acc_pck->pkt_nr != htobe64(0)) {
+            error("Invalid package");
+            return true;
+        }
+        *pck_number = 1;
+        *data_offset = calc_pck_size(data_length, opts->pck_size);
+        return get_connac_pck((const CONACC*)resp, opts->session_id);
+    }
+    if (!(opts->conn_flags & CONN_FLAG_RESUME) || 
+        res_pck->pkt_type_id != RESACC_TYPE) {
+        if (resp_len != sizeof(CONACC)) {
+            error("Invalid package");
+            return true;
+        }
+        return get_connac_pck((const CONACC*)resp, opts->session_id);
+    }
+
+    if (resp_len != sizeof(RESACC) || 
+        res_pck->session_id != opts->session_id) {
+        error("Invalid package");
+        return true;
+    }
+
+    uint64_t byte_offset = be64toh(res_pck->byte_offset);
+    if (byte_offset > data_length) {
+        error("Server has more data than we want to send");
+        return true;
+    }
+    if (update_checksum(CHECKSUM_INIT, data, byte_offset) != 
+        be32toh(res_pck->checksum)) {
+        // The server holds a different prefix, we can't continue it.
+        error("Resumed data does not match the server's copy");
+        return true;
+    }
+
+    *pck_number = be64toh(res_pck->pkt_nr);
+    *data_offset = byte_offset;
+    return false;
+}
+
+uint32_t update_checksum(uint32_t checksum, const char* data, size_t len) {
+    // Adler-32. 5552 is the largest n for which the sums
+    // can't overflow 32 bits before taking the modulo.
+    const uint32_t mod = 65521;
+    uint32_t a = checksum & 0xFFFF;
+    uint32_t b = checksum >> 16;
+    const unsigned char* iter = (const unsigned char*)data;
+    while (len > 0) {
+        size_t block = len < 5552 ? len : 5552;
+        len -= block;
+        while (block-- > 0) {
+            a += *iter++;
+            b += a;
+        }
+        a %= mod;
+        b %= mod;
+    }
+    return (b << 16) | a;
+}
+
 bool get_nonudpr_rcvd(const RCVD* rcvd_pck, uint64_t session_id) {
     if (rcvd_pck->pkt_type_id == RJT_TYPE && 
         rcvd_pck->session_id == session_id) {
@@ -263,7 +593,8 @@ int create_socket(uint8_t protocol_id, char* data_from_stream) {
     if (protocol_id == TCP_PROT_ID) {
         socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     }
-    else if (protocol_id == UDP_PROT_ID || protocol_id == UDPR_PROT_ID) {
+    else if (protocol_id == UDP_PROT_ID || protocol_id == UDPR_PROT_ID ||
+            protocol_id == UDPM_PROT_ID) {
         socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
     }
 
@@ -313,6 +644,112 @@ void set_timeouts(int main_fd, int secondary_fd,
 
 }
 
+// The TCP options below are optimizations, so failing to set them is
+// only reported.
+void set_tcp_option(int socket_fd, int option, int value, 
+                    const char* description) {
+    if (setsockopt(socket_fd, IPPROTO_TCP, option, 
+                    &value, sizeof(value)) < 0) {
+        error("Failed to set %s", description);
+        errno = 0;
+    }
+}
+
+void tune_tcp_socket(int socket_fd) {
+    set_tcp_option(socket_fd, TCP_NODELAY, 1, "TCP_NODELAY");
+    quick_ack(socket_fd);
+}
+
+void quick_ack(int socket_fd) {
+    set_tcp_option(socket_fd, TCP_QUICKACK, 1, "TCP_QUICKACK");
+}
+
+void enable_fastopen_connect(int socket_fd) {
+    set_tcp_option(socket_fd, TCP_FASTOPEN_CONNECT, 1, 
+                    "TCP_FASTOPEN_CONNECT");
+}
+
+void enable_fastopen_listen(int socket_fd, int queue_length) {
+    set_tcp_option(socket_fd, TCP_FASTOPEN, queue_length, "TCP_FASTOPEN");
+}
+
+// Socket buffers are optimizations too, failing to size them is only 
+// reported.
+void set_socket_buffer(int socket_fd, int option, int force_option, 
+                        int bytes, const char* description) {
+    if (bytes <= 0) {
+        return;
+    }
+    if (setsockopt(socket_fd, SOL_SOCKET, force_option, &bytes, 
+                    sizeof(bytes)) < 0 &&
+        setsockopt(socket_fd, SOL_SOCKET, option, &bytes, 
+                    sizeof(bytes)) < 0) {
+        error("Failed to set %s", description);
+    }
+    errno = 0;
+}
+
+int set_socket_buffers(int socket_fd, int rcvbuf, int sndbuf) {
+    set_socket_buffer(socket_fd, SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf, 
+                        "SO_RCVBUF");
+    set_socket_buffer(socket_fd, SO_SNDBUF, SO_SNDBUFFORCE, sndbuf, 
+                        "SO_SNDBUF");
+    int granted = 0;
+    socklen_t length = sizeof(granted);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &granted, 
+                    &length) < 0) {
+        errno = 0;
+    }
+    return granted;
+}
+
+void enable_drop_count(int socket_fd) {
+    int enable = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, 
+                    sizeof(enable)) < 0) {
+        error("Failed to set SO_RXQ_OVFL");
+        errno = 0;
+    }
+}
+
+void set_multicast_sender(int socket_fd, struct in_addr iface) {
+    unsigned char loop = 1;
+    if (setsockopt(socket_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, 
+                    sizeof(iface)) < 0 ||
+        setsockopt(socket_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                    sizeof(loop)) < 0) {
+        close(socket_fd);
+        syserr("Failed to set up multicast");
+    }
+}
+
+int setup_multicast_socket(struct sockaddr_in* addr, uint16_t port,
+                            struct in_addr group, struct in_addr iface) {
+    int socket_fd = create_socket(UDP_PROT_ID, NULL);
+    int reuse = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, 
+                    sizeof(reuse)) < 0) {
+        close(socket_fd);
+        syserr("Failed to share the port");
+    }
+
+    init_sockaddr(addr, port);
+    if (bind(socket_fd, (struct sockaddr*)addr, 
+            (socklen_t) sizeof(*addr)) < 0) {
+        close(socket_fd);
+        syserr("Failed to bind a socket");
+    }
+
+    struct ip_mreq membership = {.imr_multiaddr = group, 
+                                .imr_interface = iface};
+    if (setsockopt(socket_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                    sizeof(membership)) < 0) {
+        close(socket_fd);
+        syserr("Failed to join the multicast group");
+    }
+    return socket_fd;
+}
+
 void ignore_signal(void (*handler)(), int8_t signtoign) {
     struct sigaction action;
     sigset_t block_mask;
@@ -335,6 +772,52 @@ void ignore_signal(void (*handler)(), int8_t signtoign) {
     }
 }
 
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 bool assert_data_size(uint32_t data_size) {
     return (data_size > 0 && data_size <= 64000);
+}
+
+bool is_expected_data(const DATA* dt, ssize_t pck_len, uint64_t session_id,
+                        uint64_t pck_number) {
+    return pck_len >= (ssize_t)(sizeof(DATA) - sizeof(char*)) && 
+            dt->pkt_type_id == DATA_TYPE && dt->session_id == session_id &&
+            be64toh(dt->pkt_nr) == pck_number && 
+            assert_data_size(be32toh(dt->data_size));
+}
+
+bool is_expected_stream_data(const DATA* dt, ssize_t pck_len, 
+                                uint64_t session_id, uint64_t pck_number) {
+    return is_expected_data(dt, pck_len, session_id, pck_number) ||
+            (pck_len == (ssize_t)(sizeof(DATA) - sizeof(char*)) && 
+            dt->pkt_type_id == DATA_TYPE && dt->session_id == session_id &&
+            be64toh(dt->pkt_nr) == pck_number && dt->data_size == 0);
+}
+
+bool is_eos(const DATA* dt, ssize_t pck_len, uint64_t session_id,
+            uint64_t pck_number) {
+    return pck_len == (ssize_t)(sizeof(DATA) - sizeof(char*)) && 
+            dt->pkt_type_id == EOS_TYPE && dt->session_id == session_id &&
+            be64toh(dt->pkt_nr) == pck_number && dt->data_size == 0;
+}
+
+bool is_expected_digests(const DATA* dt, ssize_t pck_len, uint64_t session_id,
+                            uint64_t pck_number) {
+    uint32_t data_size = be32toh(dt->data_size);
+    return pck_len == (ssize_t)(sizeof(DATA) - sizeof(char*)) && 
+            dt->pkt_type_id == DIGESTS_TYPE && dt->session_id == session_id &&
+            be64toh(dt->pkt_nr) == pck_number && 
+            assert_data_size(data_size) && 
+            data_size % sizeof(CHUNK_REF) == 0;
+}
+
+bool is_missing(const DATA* dt, uint64_t session_id, uint64_t pck_number,
+                size_t ref_count) {
+    return dt->pkt_type_id == MISSING_TYPE && dt->session_id == session_id &&
+            be64toh(dt->pkt_nr) == pck_number && 
+            be32toh(dt->data_size) == (ref_count + 7) / 8;
 }
\ No newline at end of file
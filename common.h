@@ -24,10 +24,32 @@
 #define TCP_PROT "tcp"
 #define UDP_PROT "udp"
 #define UDPR_PROT "udpr"
+#define UDPM_PROT "udpm"
+// Not sent in CONN, the client picks one of the others by probing the path.
+#define AUTO_PROT "auto"
 
 #define TCP_PROT_ID 1
 #define UDP_PROT_ID 2
 #define UDPR_PROT_ID 3
+// UDP multicast from one client to many servers.
+#define UDPM_PROT_ID 4
+
+// The upper bits of CONN.prot_id carry optional session flags.
+#define PROT_ID_MASK 0x0F
+#define CONN_FLAG_RESUME 0x10
+#define CONN_FLAG_COMPACT 0x20
+#define CONN_FLAG_STRIPE 0x40
+// The client may open another session on the connection after RCVD.
+#define CONN_FLAG_KEEP 0x80
+
+// Maximal number of TCP sessions a single payload can be striped over.
+#define MAX_STRIPES 16
+
+// Maximal number of servers a multicast client delivers to.
+#define MCAST_MAX_RECEIVERS 64
+
+// Maximal time in microseconds a receive may spin, see busy_poll_us.
+#define MAX_BUSY_POLL 1000000
 
 #define PCK_SIZE 64000
 
@@ -38,6 +60,29 @@
 #define ACC_TYPE 5
 #define RJT_TYPE 6
 #define RCVD_TYPE 7
+#define RESACC_TYPE 8
+#define CDATA_TYPE 9
+// Ends a stream. It has the (compact) DATA header, with no data.
+#define EOS_TYPE 10
+// Deduplicated TCP sessions send the digests of the next chunks of their 
+// data in a DIGESTS package, with a DATA header and CHUNK_REFs as the data.
+// The server answers with MISSING, a DATA header followed by a bitmap of 
+// the chunks it doesn't have, lowest bit first. Only those are sent then, 
+// one chunk per DATA package, numbered after the DIGESTS.
+#define DIGESTS_TYPE 11
+#define MISSING_TYPE 12
+// Feedback of a multicast receiver to the sender, see NAK.
+#define NAK_TYPE 13
+// Measures the path to a UDP server, which answers at once, see PROBE.
+#define PROBE_TYPE 14
+
+// Size of a SHA-256 digest.
+#define DIGEST_SIZE 32
+
+// CONN.data_length of a stream, whose length isn't known up front. The 
+// client ends it with an EOS package. Streams may also carry empty DATA 
+// packages, which only keep an idle session alive.
+#define STREAM_LENGTH UINT64_MAX
 
 typedef struct __attribute__((__packed__)) {
     uint8_t pkt_type_id;
@@ -47,6 +92,21 @@ typedef struct __attribute__((__packed__)) {
     uint64_t data_length;
 } CONN;
 
+// Follows a TCP CONN with CONN_FLAG_STRIPE set. The session carries 
+// data_length bytes of a larger payload, starting at offset.
+typedef struct __attribute__((__packed__)) {
+    // Big endian, the same for all stripes of the payload.
+    uint64_t group_id;
+    // Big endian, length of the whole payload.
+    uint64_t group_length;
+    // Big endian
+    uint64_t offset;
+    // Big endian
+    uint16_t stripe_idx;
+    // Big endian
+    uint16_t stripe_count;
+} STRIPE;
+
 typedef struct __attribute__((__packed__)) {
     uint8_t pkt_type_id;
     uint64_t session_id;
@@ -57,6 +117,19 @@ typedef struct __attribute__((__packed__)) {
     uint64_t session_id;
 } CONRJT;
 
+// Answer to a CONN with CONN_FLAG_RESUME set. Tells the client where
+// the server's copy of the session ends.
+typedef struct __attribute__((__packed__)) {
+    uint8_t pkt_type_id;
+    uint64_t session_id;
+    // Big endian
+    uint64_t pkt_nr;
+    // Big endian
+    uint64_t byte_offset;
+    // Big endian, checksum of the first byte_offset bytes.
+    uint32_t checksum;
+} RESACC;
+
 typedef struct __attribute__((__packed__)) {
     uint8_t pkt_type_id;
     uint64_t session_id;
@@ -67,6 +140,40 @@ typedef struct __attribute__((__packed__)) {
     char* data;
 } DATA;
 
+// Compact DATA header of UDP sessions with CONN_FLAG_COMPACT. 
+// The data size is implied by the datagram length.
+typedef struct __attribute__((__packed__)) {
+    uint8_t pkt_type_id;
+    // Big endian, lowest 16 bits of the session id.
+    uint16_t conn_id;
+    // Big endian, lowest 32 bits of the package number.
+    uint32_t pkt_nr;
+} UDP_CDATA;
+
+// Compact DATA header of TCP sessions with CONN_FLAG_COMPACT.
+// The session is implied by the connection.
+typedef struct __attribute__((__packed__)) {
+    uint8_t pkt_type_id;
+    // Big endian, lowest 32 bits of the package number.
+    uint32_t pkt_nr;
+    // Big endian
+    uint16_t data_size;
+} TCP_CDATA;
+
+// Offset at which a compact UDP header has to be received, so that 
+// it can be expanded in place into a full DATA header.
+#define CDATA_OFFSET (sizeof(DATA) - sizeof(char*) - sizeof(UDP_CDATA))
+
+// A chunk of a deduplicated session, identified by the SHA-256 of its data.
+typedef struct __attribute__((__packed__)) {
+    uint8_t digest[DIGEST_SIZE];
+    // Big endian, at most PCK_SIZE.
+    uint32_t length;
+} CHUNK_REF;
+
+// Maximal number of chunks listed in a single DIGESTS package.
+#define MAX_CHUNK_REFS (PCK_SIZE / sizeof(CHUNK_REF))
+
 typedef struct __attribute__((__packed__)) {
     uint8_t pkt_type_id;
     uint64_t session_id;
@@ -81,25 +188,170 @@ typedef struct __attribute__((__packed__)) {
     uint64_t pkt_nr;
 } RJT;
 
+// Number of packages a multicast sender may be ahead of its slowest 
+// receiver, the width of NAK.missing.
+#define MCAST_WINDOW 64
+
+// Sent by a multicast receiver that noticed a gap, after a timeout and 
+// every MCAST_STATUS_INTERVAL packages. It has every package before pkt_nr.
+typedef struct __attribute__((__packed__)) {
+    uint8_t pkt_type_id;
+    uint64_t session_id;
+    // Big endian
+    uint64_t pkt_nr;
+    // Big endian, bit i set if package pkt_nr + i is missing.
+    uint64_t missing;
+} NAK;
+
 typedef struct __attribute__((__packed__)) {
     uint8_t pkt_type_id;
     uint64_t session_id;
 } RCVD;
 
+// Sent by a client probing the path, padded to the size of the probe. The 
+// UDP server sends back just the header, in or out of a session.
+typedef struct __attribute__((__packed__)) {
+    uint8_t pkt_type_id;
+    uint64_t session_id;
+    // Big endian
+    uint32_t probe_nr;
+} PROBE;
+
+// Optional client behaviour selected on the command line.
+typedef struct {
+    uint64_t session_id;
+    // CONN_FLAG_* bits or-ed into CONN.prot_id.
+    uint8_t conn_flags;
+    // Measure round trip times and print them at exit.
+    bool b_latency;
+    // Maximal size of the data in a single package.
+    uint32_t pck_size;
+    // Reader of the input, NULL when the whole input is in memory.
+    struct input_ring* input;
+    // Part of a striped payload carried by the session, NULL if none.
+    const STRIPE* stripe;
+    // Send the first DATA package of a UDP or UDPR session together with
+    // the CONN.
+    bool b_first_flight;
+    // Tune TCP sockets for small messages: no Nagle, quick ACKs and
+    // the CONN carried in the SYN.
+    bool b_tcp_tuned;
+    // Send only the chunks of the data the server doesn't have yet, see
+    // DIGESTS_TYPE.
+    bool b_dedup;
+    // Number of multicast receivers to wait for before sending.
+    uint16_t mcast_receivers;
+    // Interface multicast goes out of, INADDR_ANY for the default one.
+    struct in_addr mcast_iface;
+    // CPU the receiving thread is pinned to, -1 if it isn't.
+    int pin_cpu;
+} client_opts;
+
+// Optional server behaviour selected on the command line.
+typedef struct {
+    // Directory for per-session output files, stdout if NULL.
+    const char* output_dir;
+    // Where to write a stats snapshot on SIGUSR1.
+    const char* stats_file;
+    // UNIX socket serving stats snapshots.
+    const char* stats_socket;
+    // Tune TCP sockets for small messages, see client_opts.
+    bool b_tcp_tuned;
+    // Byte rate limits of every session and of every client address, 
+    // 0 if unlimited.
+    uint64_t session_rate;
+    uint64_t address_rate;
+    // Bytes the sessions may take for their buffers, 0 if unlimited.
+    uint64_t memory_budget;
+    // Multicast group the UDP server joins, on mcast_iface.
+    struct in_addr mcast_group;
+    bool b_mcast;
+    struct in_addr mcast_iface;
+    // Protocol of the downstream server sessions are relayed to, 0 if they
+    // are stored, see relay.h.
+    uint8_t relay_prot_id;
+    struct sockaddr_in relay_addr;
+    // CPU the receiving thread is pinned to, -1 if it isn't.
+    int pin_cpu;
+} server_opts;
+
 /* Utility function to read the port number from the execution args. */
 uint16_t read_port(const char* string);
 
+/* Utility function to read the package size (1 - PCK_SIZE) 
+from the execution args. */
+uint32_t read_pck_size(const char* string);
+
+/* Utility function to read the number of streams (1 - MAX_STRIPES) 
+from the execution args. */
+uint16_t read_stripe_count(const char* string);
+
+/* Utility function to read a positive rate in bytes per second from the 
+execution args. */
+uint64_t read_rate(const char* string);
+
+/* Utility function to read a positive memory budget in bytes from the 
+execution args. */
+uint64_t read_budget(const char* string);
+
+/* Utility function to read the session id from the execution args. */
+uint64_t read_session_id(const char* string);
+
 /* Function that reads data in loop as long as the total 
 length didn't reach n. */
 ssize_t read_n_bytes(int fd, void* dsptr, size_t n);
 /* Function that writes data in loop as long as the total 
 length didn't reach n. */
 ssize_t write_n_bytes(int fd, void* dsptr, size_t n);
+/* Function that reads everything from fd until EOF into a new buffer. 
+Implemented in O(nlogn), where n is the size of the data. Returns NULL if 
+the read failed. */
+char* read_all(int fd, uint64_t* data_length);
+/* Function that reads n bytes of a file starting at offset, like 
+read_n_bytes but without moving the file position. */
+ssize_t pread_n_bytes(int fd, void* dsptr, size_t n, off_t offset);
+/* Function that writes n bytes to a file starting at offset, like
+write_n_bytes but without moving the file position. */
+ssize_t pwrite_n_bytes(int fd, const void* dsptr, size_t n, off_t offset);
 
 /* Function that initializes a package of type DATA. */
 void init_data_pck(uint64_t session_id, uint64_t pck_number, 
                     uint32_t data_size, char* data_pck, const char* data);
 
+/* Function that initializes a package with a compact header (UDP_CDATA or 
+TCP_CDATA, depending on the protocol). Unlike init_data_pck it takes
+numbers in host order. Returns the size of the header. */
+size_t init_cdata_pck(uint8_t protocol_id, uint64_t session_id,
+                        uint64_t pck_number, uint32_t data_size,
+                        char* data_pck, const char* data);
+
+/* Function that returns the full package number closest to expected
+whose lowest 32 bits are equal to pkt_nr. */
+uint64_t expand_pkt_nr(uint32_t pkt_nr, uint64_t expected);
+
+/* Function that rewrites a UDP_CDATA header received at pck + CDATA_OFFSET
+into a full DATA header at pck, without moving the data. Other packages are
+moved back to pck. pck_len is updated to the length of the result. */
+void expand_udp_cdata(char* pck, ssize_t* pck_len, uint64_t session_id,
+                        uint64_t expected);
+
+/* Function that initializes the datagram opening a UDP or UDPR session: 
+a CONN followed, if first_data is not NULL, by a DATA package with its first
+first_len bytes. Returns the size of the datagram. */
+size_t init_conn_pck(uint8_t protocol_id, const client_opts* opts, 
+                        uint64_t data_length, const char* first_data,
+                        uint32_t first_len, char* pck);
+
+/* Function that initializes the EOS package ending a stream after 
+pck_number packages. Returns its size, at most the size of a full DATA 
+header. */
+size_t init_eos_pck(uint8_t protocol_id, const client_opts* opts, 
+                    uint64_t pck_number, char* pck);
+
+/* Function that fills the DATA header fields from a TCP_CDATA header. */
+void expand_tcp_cdata(const TCP_CDATA* cdata, DATA* dt, uint64_t session_id,
+                        uint64_t expected);
+
 /* Function that initializes the given sockaddr_in structure. */
 void init_sockaddr(struct sockaddr_in* addr, uint16_t port);
 
@@ -134,12 +386,26 @@ to check if len is not bigger than the data length.*/
 void print_data(char* data, size_t len);
 
 /* Function that calculates the size of the package 
-to send based on the PCK_SIZE variable. */
-uint32_t calc_pck_size(uint64_t data_length);
+to send based on the maximal package size (at most PCK_SIZE). */
+uint32_t calc_pck_size(uint64_t data_length, uint32_t pck_size);
 
 /* Function that check if the received package was CONACC from our session. */
 bool get_connac_pck(const CONACC* ack_pck,  uint64_t session_id);
 
+/* Function that checks the answer to CONN. For resumed sessions the server
+sends RESACC, whose offset and checksum are verified against the local data.
+On success pck_number and data_offset tell where to continue from. */
+bool get_conn_resp(const char* resp, ssize_t resp_len, 
+                    const client_opts* opts, const char* data,
+                    uint64_t data_length, uint64_t* pck_number,
+                    uint64_t* data_offset);
+
+// Checksum of an empty prefix.
+#define CHECKSUM_INIT 1
+
+/* Function that updates an Adler-32 checksum with len bytes of data. */
+uint32_t update_checksum(uint32_t checksum, const char* data, size_t len);
+
 /* Function that check if the received package was RCVD from our session. */
 bool get_nonudpr_rcvd(const RCVD* ack_pck, uint64_t session_id);
 
@@ -157,11 +423,92 @@ int setup_socket(struct sockaddr_in* addr, uint8_t protocol_id,
 On failure, sockets and secondary_data will be closed/cleaned. */
 void set_timeouts(int main_fd, int secondary_fd, char* secondary_data);
 
+/* Function that turns off Nagle's algorithm and delayed ACKs on a connected
+TCP socket. Failures only leave the default behaviour. */
+void tune_tcp_socket(int socket_fd);
+
+/* Function that asks for an immediate ACK of the data read so far. The 
+kernel falls back to delayed ACKs by itself, so it's repeated after reads. */
+void quick_ack(int socket_fd);
+
+/* Function that lets connect() return at once and send the first write 
+in the SYN (TCP Fast Open). Without a cookie the kernel falls back to 
+a regular handshake. */
+void enable_fastopen_connect(int socket_fd);
+
+/* Function that accepts TCP Fast Open SYNs on a listening socket, with up
+to queue_length pending ones. */
+void enable_fastopen_listen(int socket_fd, int queue_length);
+
+/* Function that sets the receive (SO_RCVBUF) and send (SO_SNDBUF) buffers
+of the socket to the given number of bytes, 0 keeps the current one. Beyond
+the system limit they are forced, if we're permitted to, otherwise they get 
+the limit. Returns the receive buffer the kernel granted. */
+int set_socket_buffers(int socket_fd, int rcvbuf, int sndbuf);
+
+/* Function that makes the kernel report the number of packages it dropped 
+on the socket for lack of room, see net_recvfrom_drops. */
+void enable_drop_count(int socket_fd);
+
+/* Function that sends the multicast packages of a UDP socket out of the 
+interface with address iface, INADDR_ANY for the default one. They are 
+looped back, so that receivers on this host get them too. */
+void set_multicast_sender(int socket_fd, struct in_addr iface);
+
+/* Function that creates a UDP socket bound to port, which receives the 
+packages sent to the multicast group on interface iface. Other sockets on 
+the host may bind to the same port and join the group too. */
+int setup_multicast_socket(struct sockaddr_in* addr, uint16_t port,
+                            struct in_addr group, struct in_addr iface);
+
+/* Utility function to read the time a receive spins (1 - MAX_BUSY_POLL
+microseconds) from the execution args. */
+uint32_t read_busy_poll(const char* string);
+
+/* Utility function to read the number of a CPU the process may run on 
+from the execution args. */
+int read_cpu(const char* string);
+
+/* Utility function to read an IPv4 address from the execution args. */
+struct in_addr read_ipv4(const char* string);
+
+/* Utility function to read the number of multicast receivers 
+(1 - MCAST_MAX_RECEIVERS) from the execution args. */
+uint16_t read_receiver_count(const char* string);
+
 /* Function that sets handler function as the handler fo thr given signal.
 If handler is NULL, handler is set to SIG_IGN. */
 void ignore_signal(void (*handler)(), int8_t signtoign);
 
+/* Function that returns the CLOCK_MONOTONIC time in nanoseconds. */
+uint64_t monotonic_ns(void);
+
 /* Function that checks if the data size is between 1 and 64000*/
 bool assert_data_size(uint32_t data_size);
 
+/* Function that checks if a package of pck_len bytes is the DATA package 
+with the given number that the session waits for. */
+bool is_expected_data(const DATA* dt, ssize_t pck_len, uint64_t session_id,
+                        uint64_t pck_number);
+
+/* Function that does the same as is_expected_data for streams, which also
+take empty packages. */
+bool is_expected_stream_data(const DATA* dt, ssize_t pck_len, 
+                                uint64_t session_id, uint64_t pck_number);
+
+/* Function that checks if a package of pck_len bytes (with an expanded 
+header) is the EOS ending the session after pck_number packages. */
+bool is_eos(const DATA* dt, ssize_t pck_len, uint64_t session_id,
+            uint64_t pck_number);
+
+/* Function that checks if a package of pck_len bytes (counting only the 
+header) is a valid DIGESTS header of the session, with pck_number. */
+bool is_expected_digests(const DATA* dt, ssize_t pck_len, uint64_t session_id,
+                            uint64_t pck_number);
+
+/* Function that checks if the header is a MISSING answer to the DIGESTS
+package pck_number, with a bitmap of ref_count chunks. */
+bool is_missing(const DATA* dt, uint64_t session_id, uint64_t pck_number,
+                size_t ref_count);
+
 #endif
\ No newline at end of file
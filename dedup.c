@@ -0,0 +1,247 @@
+#include "dedup.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Chunk boundaries where the top bits of the gear hash are all 0. The hash
+// is shifted by a bit per byte, so they depend on the last 64 bytes only.
+#define MASK_HARD (~0ULL << (64 - 15))
+#define MASK_EASY (~0ULL << (64 - 11))
+
+// Random value of every byte, the same in every run so that equal data is
+// always cut the same way.
+uint64_t gear[256];
+pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+void init_gear(void) {
+    // splitmix64
+    uint64_t state = 0x5050434244454450ULL;
+    for (size_t i = 0; i < 256; ++i) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t find_chunk(const char* data, size_t len, bool b_final) {
+    pthread_once(&gear_once, init_gear);
+    if (len <= DEDUP_MIN_CHUNK) {
+        return b_final ? len : 0;
+    }
+    size_t end = len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK;
+    size_t normal = end < DEDUP_AVG_CHUNK ? end : DEDUP_AVG_CHUNK;
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = 0;
+    // No chunk is cut shorter than the minimum, so its bytes aren't hashed.
+    size_t i = DEDUP_MIN_CHUNK;
+    for (; i < normal; ++i) {
+        hash = (hash << 1) + gear[bytes[i]];
+        if (!(hash & MASK_HARD)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; ++i) {
+        hash = (hash << 1) + gear[bytes[i]];
+        if (!(hash & MASK_EASY)) {
+            return i + 1;
+        }
+    }
+    return end == DEDUP_MAX_CHUNK || b_final ? end : 0;
+}
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/* Function that processes a single 64 byte block. */
+void sha256_block(uint32_t state[8], const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+                (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^
+                        (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^
+                        (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256(const char* data, size_t len, uint8_t digest[DIGEST_SIZE]) {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t done = 0;
+    for (; len - done >= 64; done += 64) {
+        sha256_block(state, bytes + done);
+    }
+
+    // The rest, a 1 bit, zeros and the length in bits.
+    uint8_t tail[128] = {0};
+    size_t rest = len - done;
+    memcpy(tail, bytes + done, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest + 1 + 8 <= 64 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tail_len - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    sha256_block(state, tail);
+    if (tail_len == 128) {
+        sha256_block(state, tail + 64);
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = (uint8_t)(state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)state[i];
+    }
+}
+
+/* Function that stores in path the file of the chunk,
+<output_dir>/chunks/<first byte>/<digest> in hex, and in dir_len the length
+of its directory part. Returns true if the path is too long. */
+bool chunk_path(char* path, const char* output_dir, const CHUNK_REF* ref,
+                int* dir_len) {
+    char hex[2 * DIGEST_SIZE + 1];
+    for (size_t i = 0; i < DIGEST_SIZE; ++i) {
+        sprintf(hex + 2 * i, "%02x", ref->digest[i]);
+    }
+    *dir_len = snprintf(path, PATH_MAX, "%s/" CHUNK_DIR "/%.2s", output_dir,
+                        hex);
+    int len = snprintf(path + *dir_len, PATH_MAX - *dir_len, "/%s", hex);
+    if (*dir_len < 0 || len < 0 || *dir_len + len >= PATH_MAX) {
+        error("Chunk path too long");
+        return true;
+    }
+    return false;
+}
+
+bool has_chunk(const char* output_dir, const CHUNK_REF* ref) {
+    char path[PATH_MAX];
+    int dir_len;
+    struct stat chunk_stat;
+    if (chunk_path(path, output_dir, ref, &dir_len)) {
+        return false;
+    }
+    bool b_found = stat(path, &chunk_stat) == 0 &&
+                    S_ISREG(chunk_stat.st_mode) &&
+                    chunk_stat.st_size == be32toh(ref->length);
+    errno = 0;
+    return b_found;
+}
+
+bool load_chunk(const char* output_dir, const CHUNK_REF* ref, char* buffer) {
+    char path[PATH_MAX];
+    int dir_len;
+    if (chunk_path(path, output_dir, ref, &dir_len)) {
+        return true;
+    }
+    int fd = open(path, O_RDONLY);
+    ssize_t bytes_read = fd < 0 ? -1 :
+                            read_n_bytes(fd, buffer, be32toh(ref->length));
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (bytes_read != (ssize_t)be32toh(ref->length)) {
+        error("Failed to read chunk %s", path);
+        errno = 0;
+        return true;
+    }
+    return false;
+}
+
+bool save_chunk(const char* output_dir, const CHUNK_REF* ref,
+                const char* data) {
+    char path[PATH_MAX];
+    int dir_len;
+    if (chunk_path(path, output_dir, ref, &dir_len)) {
+        return true;
+    }
+    if (has_chunk(output_dir, ref)) {
+        // Another session brought it.
+        return false;
+    }
+
+    // Both levels of directories are made on demand.
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/" CHUNK_DIR, output_dir);
+    bool b_failed = mkdir(dir, 0755) < 0 && errno != EEXIST;
+    if (!b_failed) {
+        snprintf(dir, sizeof(dir), "%.*s", dir_len, path);
+        b_failed = mkdir(dir, 0755) < 0 && errno != EEXIST;
+    }
+    if (b_failed) {
+        error("Failed to create %s", dir);
+        errno = 0;
+        return true;
+    }
+
+    // Written under a temporary name and renamed when complete.
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%.*s/.tmpXXXXXX", dir_len, path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        error("Failed to create a chunk in %s", dir);
+        errno = 0;
+        return true;
+    }
+    b_failed = write_n_bytes(fd, (char*)data, be32toh(ref->length)) !=
+                    (ssize_t)be32toh(ref->length);
+    b_failed = close(fd) < 0 || b_failed;
+    if (!b_failed) {
+        b_failed = rename(tmp_path, path) < 0;
+    }
+    if (b_failed) {
+        unlink(tmp_path);
+        error("Failed to save chunk %s", path);
+        errno = 0;
+    }
+    errno = 0;
+    return b_failed;
+}
\ No newline at end of file
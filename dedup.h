@@ -0,0 +1,46 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "common.h"
+#include "err.h"
+
+// Chunk sizes of content-defined chunking. Chunks are cut where a gear hash
+// of the last bytes matches a mask, so an insertion only moves the chunk
+// boundaries around it. Between the minimal and the average size the mask is
+// harder to match, after it easier, which keeps the sizes close to the
+// average. A chunk fits in a single DATA package.
+#define DEDUP_MIN_CHUNK 2048
+#define DEDUP_AVG_CHUNK 8192
+#define DEDUP_MAX_CHUNK PCK_SIZE
+
+// Input the client chunks at once. The chunks of a batch are listed in
+// a single DIGESTS package.
+#define DEDUP_BATCH_SIZE (4 << 20)
+
+// Subdirectory of the server output directory holding the chunk store.
+// Every chunk is a file named after its digest.
+#define CHUNK_DIR "chunks"
+
+/* Function that returns the length of the first chunk of the len bytes at
+data. If the data may go on after them (b_final not set) and no boundary was
+found, it returns 0: the chunk needs more data. */
+size_t find_chunk(const char* data, size_t len, bool b_final);
+
+/* Function that computes the SHA-256 digest of len bytes of data. */
+void sha256(const char* data, size_t len, uint8_t digest[DIGEST_SIZE]);
+
+/* Function that checks if the store under output_dir holds the chunk. */
+bool has_chunk(const char* output_dir, const CHUNK_REF* ref);
+
+/* Function that reads the chunk from the store under output_dir into
+buffer. Returns true (after printing the reason) if it failed. */
+bool load_chunk(const char* output_dir, const CHUNK_REF* ref, char* buffer);
+
+/* Function that adds the chunk with the given data to the store under
+output_dir. The file appears only once it's complete, so concurrent
+sessions never see a part of it. Returns true (after printing the reason)
+if it failed. */
+bool save_chunk(const char* output_dir, const CHUNK_REF* ref,
+                const char* data);
+
+#endif
\ No newline at end of file
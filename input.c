@@ -0,0 +1,145 @@
+#include "input.h"
+#include "protconst.h"
+
+#include <poll.h>
+
+void* input_reader(void* arg) {
+    input_ring* ring = arg;
+    uint64_t remaining = ring->length;
+    off_t offset = ring->offset;
+    uint32_t slot;
+    while (remaining > 0 && spsc_reserve(&ring->ring, true, &slot)) {
+        uint32_t len = calc_pck_size(remaining, ring->slot_size);
+        char* dest = ring->slots + (size_t)slot * ring->slot_size;
+        // A pipe has no offsets, it's read in order.
+        ssize_t bytes_read = ring->offset < 0 ? 
+                                read_n_bytes(ring->fd, dest, len) :
+                                pread_n_bytes(ring->fd, dest, len, offset);
+        if (bytes_read != (ssize_t)len) {
+            error("Failed to read data from STDIN");
+            ring->b_failed = true;
+            break;
+        }
+        ring->lengths[slot] = len;
+        spsc_publish(&ring->ring);
+        remaining -= len;
+        offset += len;
+    }
+    spsc_close(&ring->ring);
+    return NULL;
+}
+
+void* stream_reader(void* arg) {
+    input_ring* ring = arg;
+    uint32_t slot;
+    while (spsc_reserve(&ring->ring, true, &slot)) {
+        struct pollfd pfd = {.fd = ring->fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, STREAM_IDLE_WAIT);
+        ssize_t len = 0;
+        if (ready > 0) {
+            // Take whatever is there, the data shouldn't wait for more.
+            len = read(ring->fd, ring->slots + (size_t)slot * 
+                                ring->slot_size, ring->slot_size);
+            if (len == 0) {
+                // The input ended.
+                break;
+            }
+        }
+        if (ready < 0 || len < 0) {
+            error("Failed to read data from STDIN");
+            ring->b_failed = true;
+            break;
+        }
+        ring->lengths[slot] = len;
+        spsc_publish(&ring->ring);
+    }
+    spsc_close(&ring->ring);
+    return NULL;
+}
+
+input_ring* create_input_ring(int fd, off_t offset, uint64_t length, 
+                                uint32_t slot_size, uint32_t slot_count,
+                                void* (*reader)(void*)) {
+    input_ring* ring = calloc(1, sizeof(input_ring));
+    assert_null((char*)ring, -1, -1, NULL, NULL);
+    ring->slots = malloc((size_t)slot_count * slot_size);
+    assert_null(ring->slots, -1, -1, (char*)ring, NULL);
+    ring->fd = fd;
+    ring->offset = offset;
+    ring->length = length;
+    ring->slot_size = slot_size;
+    ring->slot_count = slot_count;
+    spsc_init(&ring->ring, slot_count);
+
+    // Signals are for the sending thread, their handlers 
+    // have to interrupt its calls.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&ring->thread, NULL, reader, ring) != 0) {
+        fatal("Failed to start the input thread");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ring;
+}
+
+input_ring* start_input_ring(int fd, off_t offset, uint64_t length, 
+                                uint32_t slot_size) {
+    return create_input_ring(fd, offset, length, slot_size, 
+                                INPUT_RING_SLOTS, input_reader);
+}
+
+input_ring* start_pipe_ring(int fd, uint64_t length, uint32_t slot_size,
+                            uint32_t slot_count) {
+    return create_input_ring(fd, -1, length, slot_size, slot_count, 
+                                input_reader);
+}
+
+input_ring* start_stream_ring(int fd, uint32_t slot_size, 
+                                uint32_t slot_count) {
+    return create_input_ring(fd, 0, STREAM_LENGTH, slot_size, slot_count,
+                                stream_reader);
+}
+
+const char* input_ring_peek(input_ring* ring, uint32_t* len) {
+    uint32_t slot;
+    if (!spsc_peek(&ring->ring, true, &slot)) {
+        return NULL;
+    }
+    *len = ring->lengths[slot];
+    return ring->slots + (size_t)slot * ring->slot_size;
+}
+
+void input_ring_release(input_ring* ring) {
+    spsc_release(&ring->ring);
+}
+
+void close_input_ring(input_ring* ring) {
+    if (ring == NULL) {
+        return;
+    }
+    spsc_cancel(&ring->ring);
+    pthread_join(ring->thread, NULL);
+    free(ring->slots);
+    free(ring);
+}
+
+const char* input_next(input_ring* ring, const char** data_ptr, 
+                        uint32_t* len) {
+    if (ring == NULL) {
+        const char* chunk = *data_ptr;
+        *data_ptr += *len;
+        return chunk;
+    }
+    return input_ring_peek(ring, len);
+}
+
+void input_release(input_ring* ring) {
+    if (ring != NULL) {
+        input_ring_release(ring);
+    }
+}
+
+bool input_failed(input_ring* ring) {
+    return ring != NULL && ring->b_failed;
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "err.h"
+#include "spsc.h"
+
+// Maximal number of package sized slots between the reader thread and the
+// sender.
+#define INPUT_RING_SLOTS 64
+
+// Ring filled by a reader thread with consecutive chunks of the input, one
+// package each, for the sending thread.
+typedef struct input_ring {
+    int fd;
+    off_t offset;
+    // STREAM_LENGTH if the input is read until it ends.
+    uint64_t length;
+    uint32_t slot_size;
+    uint32_t slot_count;
+    char* slots;
+    uint32_t lengths[INPUT_RING_SLOTS];
+    // Closed by the reader when the input ends or fails.
+    spsc_ring ring;
+    // Set before closing the ring if reading failed.
+    bool b_failed;
+    pthread_t thread;
+} input_ring;
+
+/* Function that starts a thread reading length bytes of the file fd, from
+offset on, into a new ring, in chunks of slot_size bytes (the last one may be 
+shorter). */
+input_ring* start_input_ring(int fd, off_t offset, uint64_t length, 
+                                uint32_t slot_size);
+
+/* Function that starts a thread reading length bytes of the pipe fd into
+a new ring of slot_count (at most INPUT_RING_SLOTS) slots, in chunks of 
+slot_size bytes (the last one may be shorter). */
+input_ring* start_pipe_ring(int fd, uint64_t length, uint32_t slot_size,
+                            uint32_t slot_count);
+
+/* Function that starts a thread reading the pipe fd until it ends, into 
+a new ring of slot_count (at most INPUT_RING_SLOTS) slots. Every chunk holds
+what was available, up to slot_size bytes. If nothing comes for 
+STREAM_IDLE_WAIT milliseconds, an empty chunk is queued, so that the session
+can be kept alive. */
+input_ring* start_stream_ring(int fd, uint32_t slot_size, 
+                                uint32_t slot_count);
+
+/* Function that returns the next chunk of the input and its length, waiting
+for the reader if needed. Returns NULL once the input ended (or failed). */
+const char* input_ring_peek(input_ring* ring, uint32_t* len);
+
+/* Function that hands the chunk returned by input_ring_peek back to the 
+reader. */
+void input_ring_release(input_ring* ring);
+
+/* Function that stops the reader thread and frees the ring. */
+void close_input_ring(input_ring* ring);
+
+/* Function that returns the next *len bytes to send. They come from the ring
+if there is one, otherwise from *data_ptr, which is advanced. A stream ring
+may return fewer bytes, *len is then updated. The chunk has to be released 
+with input_release once it was copied. */
+const char* input_next(input_ring* ring, const char** data_ptr, 
+                        uint32_t* len);
+
+/* Function that releases the chunk returned by input_next. */
+void input_release(input_ring* ring);
+
+/* Function that tells if the input ended because reading it failed. */
+bool input_failed(input_ring* ring);
+
+#endif
\ No newline at end of file
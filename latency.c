@@ -0,0 +1,160 @@
+#include "latency.h"
+#include "net.h"
+
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sys/uio.h>
+
+latency_hist conn_rtt_hist = {.min = UINT64_MAX};
+latency_hist data_rtt_hist = {.min = UINT64_MAX};
+
+size_t hist_bucket(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return value;
+    }
+    // Position of the highest bit decides the range, 
+    // the next HIST_SUB_BITS bits the bucket inside it.
+    int exponent = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (size_t)(exponent + 1) * HIST_SUB_COUNT + 
+            ((value >> exponent) & (HIST_SUB_COUNT - 1));
+}
+
+uint64_t hist_bucket_value(size_t bucket) {
+    size_t exponent = bucket / HIST_SUB_COUNT;
+    uint64_t sub = bucket % HIST_SUB_COUNT;
+    if (exponent == 0) {
+        return sub;
+    }
+    // Highest value in the bucket.
+    return ((HIST_SUB_COUNT | sub) << (exponent - 1)) + 
+            ((1ULL << (exponent - 1)) - 1);
+}
+
+void hist_record(latency_hist* hist, uint64_t value) {
+    ++hist->counts[hist_bucket(value)];
+    ++hist->total;
+    hist->sum += value;
+    if (value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void record_rtt(latency_hist* hist, uint64_t sent_ns, uint64_t received_ns) {
+    // Mixed kernel and user space stamps may be slightly out of order.
+    hist_record(hist, received_ns > sent_ns ? received_ns - sent_ns : 0);
+}
+
+uint64_t hist_percentile(const latency_hist* hist, double fraction) {
+    if (hist->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(fraction * hist->total);
+    if (rank >= hist->total) {
+        rank = hist->total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < HIST_BUCKETS; ++bucket) {
+        seen += hist->counts[bucket];
+        if (seen > rank) {
+            uint64_t value = hist_bucket_value(bucket);
+            return value > hist->max ? hist->max : value;
+        }
+    }
+    return hist->max;
+}
+
+void hist_print(const latency_hist* hist, const char* name, FILE* out) {
+    fprintf(out, "latency %s count=%" PRIu64, name, hist->total);
+    if (hist->total > 0) {
+        fprintf(out, " min_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f"
+                " max_us=%.1f mean_us=%.1f", hist->min / 1000.0, 
+                hist_percentile(hist, 0.5) / 1000.0,
+                hist_percentile(hist, 0.99) / 1000.0,
+                hist_percentile(hist, 0.999) / 1000.0, hist->max / 1000.0,
+                (double)hist->sum / hist->total / 1000.0);
+    }
+    fprintf(out, "\n");
+}
+
+void enable_timestamping(int socket_fd) {
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+                SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPING, 
+                    &flags, sizeof(flags)) < 0) {
+        // Not fatal, user space timestamps are used instead.
+        error("Kernel timestamps unavailable");
+        errno = 0;
+    }
+}
+
+uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool get_cmsg_timestamp(struct msghdr* msg, uint64_t* ts_ns) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; 
+            cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && 
+            cmsg->cmsg_type == SO_TIMESTAMPING) {
+            // Software timestamp is the first of the three.
+            struct scm_timestamping* tss = 
+                                    (struct scm_timestamping*)CMSG_DATA(cmsg);
+            if (tss->ts[0].tv_sec != 0 || tss->ts[0].tv_nsec != 0) {
+                *ts_ns = (uint64_t)tss->ts[0].tv_sec * 1000000000ULL + 
+                            tss->ts[0].tv_nsec;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+ssize_t recvfrom_ts(int socket_fd, void* buf, size_t len, int flags,
+                    struct sockaddr* addr, socklen_t* addr_length,
+                    uint64_t* rx_ns) {
+    if (rx_ns == NULL) {
+        return net_recvfrom(socket_fd, buf, len, flags, addr, addr_length);
+    }
+
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct msghdr msg = {.msg_name = addr, 
+                        .msg_namelen = addr_length ? *addr_length : 0,
+                        .msg_iov = &iov, .msg_iovlen = 1, 
+                        .msg_control = control, 
+                        .msg_controllen = sizeof(control)};
+
+    ssize_t bytes_read = busy_recvmsg(socket_fd, &msg, flags);
+    if (bytes_read >= 0) {
+        if (addr_length != NULL) {
+            *addr_length = msg.msg_namelen;
+        }
+        if (!get_cmsg_timestamp(&msg, rx_ns)) {
+            *rx_ns = realtime_ns();
+        }
+    }
+    return bytes_read;
+}
+
+uint64_t tx_timestamp(int socket_fd, uint64_t fallback_ns) {
+    uint64_t ts_ns = fallback_ns;
+    char control[512];
+    // Loopback and most drivers stamp the package before sendto returns,
+    // so the error queue is read without waiting.
+    while (true) {
+        struct msghdr msg = {.msg_control = control, 
+                            .msg_controllen = sizeof(control)};
+        if (recvmsg(socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        get_cmsg_timestamp(&msg, &ts_ns);
+    }
+    errno = 0;
+    return ts_ns;
+}
\ No newline at end of file
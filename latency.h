@@ -0,0 +1,59 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "common.h"
+#include "err.h"
+
+// Log-linear (HDR style) histogram of nanosecond values. Every power of two
+// range is split into 2^HIST_SUB_BITS buckets, so the error is below 2^-5.
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} latency_hist;
+
+// Round trips measured by the client when latency reporting is on.
+// CONN->CONACC in all protocols, DATA->ACC in UDPR.
+extern latency_hist conn_rtt_hist;
+extern latency_hist data_rtt_hist;
+
+/* Function that adds a value to the histogram. */
+void hist_record(latency_hist* hist, uint64_t value);
+
+/* Function that returns the value below which the given 
+fraction (0.0 - 1.0) of the recorded values falls. */
+uint64_t hist_percentile(const latency_hist* hist, double fraction);
+
+/* Function that records the round trip between two timestamps. */
+void record_rtt(latency_hist* hist, uint64_t sent_ns, uint64_t received_ns);
+
+/* Function that prints a one line summary of the histogram to out. */
+void hist_print(const latency_hist* hist, const char* name, FILE* out);
+
+/* Function that turns on software RX/TX kernel timestamps on the socket. 
+If the kernel refuses, the timestamps are taken in user space. */
+void enable_timestamping(int socket_fd);
+
+/* Function that returns the current CLOCK_REALTIME time, the clock 
+of the kernel timestamps, in nanoseconds. */
+uint64_t realtime_ns(void);
+
+/* Function that works like recvfrom, but also stores the time at which the
+kernel received the package in rx_ns (or the current time if the kernel 
+didn't provide one). With rx_ns NULL it is a plain recvfrom. */
+ssize_t recvfrom_ts(int socket_fd, void* buf, size_t len, int flags,
+                    struct sockaddr* addr, socklen_t* addr_length,
+                    uint64_t* rx_ns);
+
+/* Function that returns the kernel timestamp of the latest package sent 
+through the socket, or fallback_ns if there is none. Drains the socket's
+error queue. */
+uint64_t tx_timestamp(int socket_fd, uint64_t fallback_ns);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "mempool.h"
+#include "output.h"
+
+#include <pthread.h>
+
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t pool_budget = 0;
+// Free buffers, each holding the pointer to the next one.
+char* pool_free_list = NULL;
+uint64_t pool_cached = 0;
+// Buffers taken from malloc and not freed yet, including the cached ones.
+uint64_t pool_total = 0;
+uint64_t pool_reserved = 0;
+uint64_t pool_sessions = 0;
+
+void pool_init(uint64_t budget) {
+    pool_budget = budget;
+}
+
+uint32_t pool_queue_slots(void) {
+    return pool_budget > 0 ? POOL_SESSION_SLOTS : OUTPUT_QUEUE_SLOTS;
+}
+
+/* Function that returns the number of buffers reserved for a session. */
+uint64_t session_quota(uint32_t held_buffers) {
+    return (uint64_t)pool_queue_slots() + held_buffers;
+}
+
+bool pool_admit(uint32_t held_buffers) {
+    if (pool_budget == 0) {
+        return false;
+    }
+    uint64_t quota = session_quota(held_buffers) * POOL_BUFFER_SIZE;
+    pthread_mutex_lock(&pool_lock);
+    bool b_full = pool_reserved + quota > pool_budget;
+    if (!b_full) {
+        pool_reserved += quota;
+        ++pool_sessions;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (b_full) {
+        error("Memory budget exhausted");
+    }
+    return b_full;
+}
+
+void pool_leave(uint32_t held_buffers) {
+    if (pool_budget == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_reserved -= session_quota(held_buffers) * POOL_BUFFER_SIZE;
+    --pool_sessions;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+char* pool_alloc(void) {
+    pthread_mutex_lock(&pool_lock);
+    char* buffer = pool_free_list;
+    if (buffer != NULL) {
+        pool_free_list = *(char**)buffer;
+        --pool_cached;
+    }
+    else {
+        ++pool_total;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buffer == NULL) {
+        buffer = malloc(POOL_BUFFER_SIZE);
+        assert_null(buffer, -1, -1, NULL, NULL);
+    }
+    return buffer;
+}
+
+void pool_free(char* buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    // With a budget, the cached buffers fill what the budget leaves.
+    uint64_t in_use = pool_total - pool_cached;
+    uint64_t budget_buffers = pool_budget / POOL_BUFFER_SIZE;
+    uint64_t cache_limit = pool_budget == 0 ? POOL_CACHE : 
+                            budget_buffers > in_use ? budget_buffers - in_use :
+                            0;
+    if (pool_cached < cache_limit) {
+        *(char**)buffer = pool_free_list;
+        pool_free_list = buffer;
+        ++pool_cached;
+        buffer = NULL;
+    }
+    else {
+        --pool_total;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(buffer);
+}
+
+void pool_get_usage(pool_usage* usage) {
+    pthread_mutex_lock(&pool_lock);
+    usage->used = (pool_total - pool_cached) * POOL_BUFFER_SIZE;
+    usage->cached = pool_cached * POOL_BUFFER_SIZE;
+    usage->reserved = pool_reserved;
+    usage->budget = pool_budget;
+    usage->sessions = pool_sessions;
+    pthread_mutex_unlock(&pool_lock);
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include "common.h"
+#include "err.h"
+
+// Size of every buffer, enough for any datagram.
+#define POOL_BUFFER_SIZE 65536
+
+// Output queue slots of a session when the memory has a budget. A power 
+// of 2.
+#define POOL_SESSION_SLOTS 32
+
+// Free buffers kept for reuse when the memory has no budget.
+#define POOL_CACHE 1024
+
+// Receive buffers shared by all the sessions of the server. Freed buffers
+// go to a free list for reuse. With a budget, every session reserves its 
+// quota of buffers when it's accepted, and sessions that don't fit are 
+// rejected. Its output queue is only as long as the quota, so a session 
+// ahead of the writer by the whole quota waits for room.
+typedef struct {
+    // Buffers in use and on the free list, in bytes.
+    uint64_t used;
+    uint64_t cached;
+    // Quotas of the accepted sessions, in bytes.
+    uint64_t reserved;
+    // 0 if there is none.
+    uint64_t budget;
+    uint64_t sessions;
+} pool_usage;
+
+/* Function that sets the memory budget in bytes, 0 for none. Has to be 
+called before the first session. */
+void pool_init(uint64_t budget);
+
+/* Function that returns the number of output queue slots of a session. */
+uint32_t pool_queue_slots(void);
+
+/* Function that reserves the quota of a new session, which holds up to 
+held_buffers buffers besides its output queue. Returns true if the budget
+can't fit it. */
+bool pool_admit(uint32_t held_buffers);
+
+/* Function that gives back the quota reserved by pool_admit. */
+void pool_leave(uint32_t held_buffers);
+
+/* Function that returns a buffer of POOL_BUFFER_SIZE bytes. */
+char* pool_alloc(void);
+
+/* Function that gives a buffer from pool_alloc back, NULL is ignored. */
+void pool_free(char* buffer);
+
+/* Function that stores the current memory use in *usage. */
+void pool_get_usage(pool_usage* usage);
+
+#endif
\ No newline at end of file
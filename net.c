@@ -0,0 +1,194 @@
+// For the CPU affinity calls.
+#define _GNU_SOURCE
+
+#include "net.h"
+#include "err.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+
+const net_ops* net_current = NULL;
+uint32_t busy_poll_us = 0;
+
+// CPUs of the process before a thread was pinned.
+cpu_set_t unpinned_cpus;
+bool b_pinned = false;
+
+/* Function that tells if a receive with the flags should try again without
+blocking. The first call starts the budget at deadline_ns. */
+bool keep_spinning(int flags, uint64_t* deadline_ns) {
+    if (busy_poll_us == 0 || (flags & MSG_DONTWAIT)) {
+        return false;
+    }
+    uint64_t now_ns = monotonic_ns();
+    if (*deadline_ns == 0) {
+        *deadline_ns = now_ns + (uint64_t)busy_poll_us * 1000;
+        return true;
+    }
+    return now_ns < *deadline_ns;
+}
+
+ssize_t busy_recvfrom(int socket_fd, void* buf, size_t len, int flags,
+                        struct sockaddr* addr, socklen_t* addr_length) {
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {.msg_name = addr, 
+                        .msg_namelen = addr_length ? *addr_length : 0,
+                        .msg_iov = &iov, .msg_iovlen = 1};
+    ssize_t bytes_read = busy_recvmsg(socket_fd, &msg, flags);
+    if (bytes_read >= 0 && addr_length != NULL) {
+        *addr_length = msg.msg_namelen;
+    }
+    return bytes_read;
+}
+
+ssize_t busy_recvmsg(int socket_fd, struct msghdr* msg, int flags) {
+    int saved_errno = errno;
+    uint64_t deadline_ns = 0;
+    // A failed try may have shortened the lengths.
+    socklen_t name_length = msg->msg_namelen;
+    size_t control_length = msg->msg_controllen;
+    while (keep_spinning(flags, &deadline_ns)) {
+        ssize_t bytes_read = recvmsg(socket_fd, msg, flags | MSG_DONTWAIT);
+        if (bytes_read >= 0) {
+            errno = saved_errno;
+            return bytes_read;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return bytes_read;
+        }
+        msg->msg_namelen = name_length;
+        msg->msg_controllen = control_length;
+    }
+    struct timeval timeout;
+    socklen_t timeout_length = sizeof(timeout);
+    if (deadline_ns == 0 ||
+        getsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                    &timeout_length) < 0 ||
+        (timeout.tv_sec == 0 && timeout.tv_usec == 0)) {
+        // Nothing to shorten, wait for the package.
+        errno = saved_errno;
+        return recvmsg(socket_fd, msg, flags);
+    }
+
+    // Nothing came within the budget. The time spun counts towards the
+    // receive timeout, so it times out as it would without spinning.
+    uint64_t timeout_ns = deadline_ns - (uint64_t)busy_poll_us * 1000 +
+                            (uint64_t)timeout.tv_sec * 1000000000ULL +
+                            (uint64_t)timeout.tv_usec * 1000;
+    struct pollfd pfd = {.fd = socket_fd, .events = POLLIN};
+    while (true) {
+        uint64_t now_ns = monotonic_ns();
+        int ready = now_ns >= timeout_ns ? 0 :
+                poll(&pfd, 1, (int)((timeout_ns - now_ns + 999999) / 1000000));
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = EAGAIN;
+            }
+            return -1;
+        }
+        ssize_t bytes_read = recvmsg(socket_fd, msg, flags | MSG_DONTWAIT);
+        if (bytes_read >= 0) {
+            errno = saved_errno;
+            return bytes_read;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return bytes_read;
+        }
+        msg->msg_namelen = name_length;
+        msg->msg_controllen = control_length;
+    }
+}
+
+ssize_t busy_read_n_bytes(int socket_fd, void* dsptr, size_t n) {
+    if (busy_poll_us == 0) {
+        return read_n_bytes(socket_fd, dsptr, n);
+    }
+    size_t bytes_done = 0;
+    while (bytes_done < n) {
+        struct iovec iov = {.iov_base = (char*)dsptr + bytes_done, 
+                            .iov_len = n - bytes_done};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        ssize_t bytes_read = busy_recvmsg(socket_fd, &msg, 0);
+        if (bytes_read < 0) {
+            return bytes_read;
+        }
+        else if (bytes_read == 0) {
+            // Encountered EOF.
+            break;
+        }
+        bytes_done += bytes_read;
+    }
+    return bytes_done;
+}
+
+void enable_busy_poll(int socket_fd) {
+    // An optimization, so failing to set it is only reported. Raising it
+    // above net.core.busy_read takes CAP_NET_ADMIN, spinning in user space
+    // works without it.
+    int usecs = (int)busy_poll_us;
+    if (usecs > 0 && setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, 
+                                sizeof(usecs)) < 0) {
+        error("Failed to set SO_BUSY_POLL");
+        errno = 0;
+    }
+}
+
+void pin_thread(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+    if (!b_pinned) {
+        sched_getaffinity(0, sizeof(unpinned_cpus), &unpinned_cpus);
+        b_pinned = true;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        errno = err;
+        error("Failed to pin the thread to CPU %d", cpu);
+        errno = 0;
+    }
+}
+
+void unpin_thread(void) {
+    if (b_pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(unpinned_cpus), 
+                                &unpinned_cpus);
+    }
+}
+
+ssize_t net_recvfrom_drops(int socket_fd, void* buf, size_t len, int flags,
+                            struct sockaddr* addr, socklen_t* addr_length,
+                            uint32_t* drops) {
+    if (net_current != NULL) {
+        return net_current->recvfrom(socket_fd, buf, len, flags, addr, 
+                                        addr_length);
+    }
+
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    struct msghdr msg = {.msg_name = addr, 
+                        .msg_namelen = addr_length ? *addr_length : 0,
+                        .msg_iov = &iov, .msg_iovlen = 1, 
+                        .msg_control = control, 
+                        .msg_controllen = sizeof(control)};
+    ssize_t bytes_read = busy_recvmsg(socket_fd, &msg, flags);
+    if (bytes_read < 0) {
+        return bytes_read;
+    }
+    if (addr_length != NULL) {
+        *addr_length = msg.msg_namelen;
+    }
+    // The count comes only once the kernel dropped something.
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; 
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && 
+            cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+        }
+    }
+    return bytes_read;
+}
\ No newline at end of file
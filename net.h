@@ -0,0 +1,79 @@
+#ifndef NET_H
+#define NET_H
+
+#include "common.h"
+
+// Datagram calls made by the UDP state machines. They go straight to the
+// socket unless a simulated network is installed (see udpr_sim.c), in which
+// case the socket descriptor is ignored.
+typedef struct {
+    ssize_t (*sendto)(int socket_fd, const void* buf, size_t len, int flags,
+                        const struct sockaddr* addr, socklen_t addr_length);
+    ssize_t (*recvfrom)(int socket_fd, void* buf, size_t len, int flags,
+                        struct sockaddr* addr, socklen_t* addr_length);
+} net_ops;
+
+// NULL means the real network.
+extern const net_ops* net_current;
+
+static inline ssize_t net_sendto(int socket_fd, const void* buf, size_t len,
+                                int flags, const struct sockaddr* addr,
+                                socklen_t addr_length) {
+    if (net_current == NULL) {
+        return sendto(socket_fd, buf, len, flags, addr, addr_length);
+    }
+    return net_current->sendto(socket_fd, buf, len, flags, addr, addr_length);
+}
+
+// Time in microseconds a receive spins on the socket before it blocks, 0 if
+// it blocks right away. Spinning takes a core but saves the wakeup of a
+// blocked thread on every package. Set once at start up.
+extern uint32_t busy_poll_us;
+
+/* Function that works like recvfrom, spinning with MSG_DONTWAIT for up to
+busy_poll_us before it blocks. */
+ssize_t busy_recvfrom(int socket_fd, void* buf, size_t len, int flags,
+                        struct sockaddr* addr, socklen_t* addr_length);
+
+/* Function that works like recvmsg, spinning with MSG_DONTWAIT for up to
+busy_poll_us before it blocks. */
+ssize_t busy_recvmsg(int socket_fd, struct msghdr* msg, int flags);
+
+/* Function that works like read_n_bytes on a stream socket, spinning before
+every read that would block. */
+ssize_t busy_read_n_bytes(int socket_fd, void* dsptr, size_t n);
+
+/* Function that sets SO_BUSY_POLL on the socket, so the kernel polls the 
+device queue for busy_poll_us when the socket has nothing to read. Does 
+nothing if busy polling is off. */
+void enable_busy_poll(int socket_fd);
+
+/* Function that pins the calling thread to the cpu, nothing if it's 
+negative. Threads it starts later inherit the pin, see unpin_thread. */
+void pin_thread(int cpu);
+
+/* Function that lets the calling thread run on the CPUs the process could
+use before pin_thread. Helper threads started by a pinned one call it, so
+they don't compete for its core. */
+void unpin_thread(void);
+
+static inline ssize_t net_recvfrom(int socket_fd, void* buf, size_t len,
+                                int flags, struct sockaddr* addr,
+                                socklen_t* addr_length) {
+    if (net_current == NULL) {
+        return busy_poll_us == 0 ? 
+                recvfrom(socket_fd, buf, len, flags, addr, addr_length) :
+                busy_recvfrom(socket_fd, buf, len, flags, addr, addr_length);
+    }
+    return net_current->recvfrom(socket_fd, buf, len, flags, addr, 
+                                    addr_length);
+}
+
+/* Function that works like net_recvfrom and also stores in *drops the 
+number of packages the kernel dropped on the socket so far, if the package
+reports it (see enable_drop_count). A simulated network drops none. */
+ssize_t net_recvfrom_drops(int socket_fd, void* buf, size_t len, int flags,
+                            struct sockaddr* addr, socklen_t* addr_length,
+                            uint32_t* drops);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
+
+void* output_writer(void* arg) {
+    output_queue* queue = arg;
+    uint32_t slot;
+    while (spsc_peek(&queue->ring, true, &slot)) {
+        output_item* item = &queue->items[slot];
+        // After a failure the rest of the session is dropped.
+        if (!atomic_load(&queue->b_failed) && 
+            TRACED(TRACE_OUTPUT, store_session_data(item->store, item->data,
+                                                    item->len))) {
+            atomic_store(&queue->b_failed, true);
+        }
+
+        char* buffer = item->buffer;
+        spsc_release(&queue->ring);
+        pool_free(buffer);
+    }
+    return NULL;
+}
+
+output_queue* start_output(void) {
+    output_queue* queue = calloc(1, sizeof(output_queue));
+    assert_null((char*)queue, -1, -1, NULL, NULL);
+    spsc_init(&queue->ring, pool_queue_slots());
+    atomic_init(&queue->b_failed, false);
+
+    // Signals are for the receiving thread, their handlers 
+    // have to interrupt its calls.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&queue->thread, NULL, output_writer, queue) != 0) {
+        fatal("Failed to start the output thread");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return queue;
+}
+
+char* output_buffer(output_queue* queue) {
+    (void)queue;
+    return pool_alloc();
+}
+
+bool output_push(output_queue* queue, session_store* store, char* buffer,
+                    char* data, uint32_t len, bool b_wait) {
+    if (store->b_pipe && b_wait) {
+        // A relay takes the data at the pace of its downstream session. 
+        // Written right here, its back-pressure holds up the sender 
+        // instead of the queue taking in the tail of the session.
+        uint64_t start_ns = monotonic_ns();
+        spsc_wait_empty(&queue->ring);
+        if (!atomic_load(&queue->b_failed) && 
+            TRACED(TRACE_OUTPUT, store_session_data(store, data, len))) {
+            atomic_store(&queue->b_failed, true);
+        }
+        stats_add(&stats_current->blocked_us, 
+                    (monotonic_ns() - start_ns) / 1000);
+        pool_free(buffer);
+        return false;
+    }
+    uint32_t slot;
+    if (!spsc_reserve(&queue->ring, false, &slot)) {
+        if (!b_wait) {
+            return true;
+        }
+        // The session used up its quota, hold it back until the writer 
+        // catches up.
+        uint64_t start_ns = monotonic_ns();
+        bool b_reserved = spsc_reserve(&queue->ring, true, &slot);
+        stats_add(&stats_current->blocked_us, 
+                    (monotonic_ns() - start_ns) / 1000);
+        if (!b_reserved) {
+            return true;
+        }
+    }
+    queue->items[slot] = (output_item){.store = store, .buffer = buffer,
+                                        .data = data, .len = len};
+    spsc_publish(&queue->ring);
+    return false;
+}
+
+bool output_failed(output_queue* queue) {
+    return atomic_load(&queue->b_failed);
+}
+
+bool output_flush(output_queue* queue) {
+    spsc_wait_empty(&queue->ring);
+    return atomic_exchange(&queue->b_failed, false);
+}
+
+void close_output(output_queue* queue) {
+    spsc_close(&queue->ring);
+    pthread_join(queue->thread, NULL);
+    free(queue);
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "err.h"
+#include "mempool.h"
+#include "session_store.h"
+#include "spsc.h"
+
+// Number of packages the receiving thread can get ahead of the writer.
+#define OUTPUT_QUEUE_SLOTS 256
+
+// Received package waiting to be written.
+typedef struct {
+    session_store* store;
+    // Buffer the package was received into, reused once written.
+    char* buffer;
+    char* data;
+    uint32_t len;
+} output_item;
+
+// Queue between the receiving thread and a writer thread, which saves the
+// packages with store_session_data. Receive buffers from the pool travel 
+// with the packages and go back to it once written, so nothing is copied.
+typedef struct output_queue {
+    output_item items[OUTPUT_QUEUE_SLOTS];
+    spsc_ring ring;
+    // A write failed since the last output_flush.
+    _Atomic bool b_failed;
+    pthread_t thread;
+} output_queue;
+
+/* Function that starts a writer thread with a new queue, as long as the 
+memory pool allows for a session. */
+output_queue* start_output(void);
+
+/* Function that returns a free buffer of POOL_BUFFER_SIZE bytes to receive 
+the next package into. */
+char* output_buffer(output_queue* queue);
+
+/* Function that queues len bytes at data, which lies in buffer from 
+output_buffer, to be written to store. The buffer then belongs to the queue.
+If the queue is full, it waits for the writer when b_wait is set, the time
+spent waiting counts as blocked_us. A relay pipe is written right away when 
+b_wait is set. Returns true if the package was not queued. */
+bool output_push(output_queue* queue, session_store* store, char* buffer,
+                    char* data, uint32_t len, bool b_wait);
+
+/* Function that returns true if a write failed since the last output_flush.
+The packages queued after it are dropped. */
+bool output_failed(output_queue* queue);
+
+/* Function that waits until every queued package is written. Returns true if
+any write failed since the last call. */
+bool output_flush(output_queue* queue);
+
+/* Function that writes what is left, stops the writer and frees the queue. */
+void close_output(output_queue* queue);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include "common.h"
+#include "err.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Loopback benchmark of ppcbc/ppcbs. Every combination of protocol, payload
+// size and package size is run the given number of times, and one CSV line
+// is printed per run. With -L the UDP runs go through ppcb_proxy once per
+// loss rate, seeded with the run number so every curve can be replayed.
+
+#define USAGE "usage: %s [-b bin_dir] [-p protocols] [-s sizes] "\
+                "[-k pck_sizes] [-L losses] [-r repeats] [-a client_args] "\
+                "[-o server_args]"
+
+#define MAX_LIST 32
+#define MAX_ARGS 16
+// Time given to the server to bind its socket.
+#define SERVER_START_US 100000
+// How often the client is checked for exit, bounds the timing error.
+#define POLL_MS 1
+// The server is stopped once its output has been quiet for this long after
+// the client exited, so datagrams still in flight are not cut off.
+#define DRAIN_SECONDS 0.2
+
+typedef struct {
+    const char* bin_dir;
+    const char* protocols[MAX_LIST];
+    size_t protocol_count;
+    uint64_t sizes[MAX_LIST];
+    size_t size_count;
+    uint64_t pck_sizes[MAX_LIST];
+    size_t pck_size_count;
+    // Loss rates passed to ppcb_proxy, none means a direct connection.
+    const char* losses[MAX_LIST];
+    size_t loss_count;
+    int repeats;
+    // Extra arguments passed to every client/server, space separated.
+    char* client_args;
+    char* server_args;
+} bench_opts;
+
+typedef struct {
+    bool b_ok;
+    double seconds;
+    uint64_t bytes_out;
+    struct rusage client_usage;
+    struct rusage server_usage;
+} bench_result;
+
+size_t split_list(char* list, const char** items, size_t max_items) {
+    size_t count = 0;
+    for (char* item = strtok(list, ","); item != NULL && count < max_items;
+            item = strtok(NULL, ",")) {
+        items[count++] = item;
+    }
+    return count;
+}
+
+size_t read_numbers(char* list, uint64_t* numbers, size_t max_numbers) {
+    const char* items[MAX_LIST];
+    size_t count = split_list(list, items, max_numbers);
+    for (size_t i = 0; i < count; ++i) {
+        char* endptr;
+        errno = 0;
+        numbers[i] = strtoull(items[i], &endptr, 10);
+        if (errno != 0 || *endptr != 0) {
+            fatal("%s is not a valid number.", items[i]);
+        }
+    }
+    return count;
+}
+
+double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Appends the space separated words of extra to argv.
+size_t append_args(const char** argv, size_t argc, char* extra) {
+    if (extra == NULL) {
+        return argc;
+    }
+    for (char* arg = strtok(extra, " "); arg != NULL && argc < MAX_ARGS - 4;
+            arg = strtok(NULL, " ")) {
+        argv[argc++] = arg;
+    }
+    return argc;
+}
+
+pid_t spawn(const char* const* argv, int stdin_fd, int stdout_fd,
+            int stderr_fd) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        syserr("fork failed");
+    }
+    else if (pid == 0) {
+        if (dup2(stdin_fd, STDIN_FILENO) < 0 ||
+            dup2(stdout_fd, STDOUT_FILENO) < 0 ||
+            dup2(stderr_fd, STDERR_FILENO) < 0) {
+            syserr("dup2 failed");
+        }
+        execv(argv[0], (char* const*)argv);
+        syserr("Failed to run %s", argv[0]);
+    }
+    return pid;
+}
+
+int create_input(uint64_t size) {
+    char path[] = "/tmp/ppcb_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        syserr("Failed to create the input file");
+    }
+    unlink(path);
+    // A sparse file reads as zeros without touching the disk.
+    if (ftruncate(fd, size) < 0) {
+        syserr("Failed to size the input file");
+    }
+    return fd;
+}
+
+bench_result run_once(const bench_opts* opts, const char* protocol,
+                        int input_fd, uint64_t pck_size, const char* loss,
+                        int run, uint16_t port) {
+    bench_result result = {.b_ok = false, .bytes_out = 0};
+    char ppcbs[PATH_MAX], ppcbc[PATH_MAX], ppcb_proxy[PATH_MAX];
+    char port_str[8], proxy_port_str[8], pck_size_str[16], seed_str[16];
+    snprintf(ppcbs, sizeof(ppcbs), "%s/ppcbs", opts->bin_dir);
+    snprintf(ppcbc, sizeof(ppcbc), "%s/ppcbc", opts->bin_dir);
+    snprintf(ppcb_proxy, sizeof(ppcb_proxy), "%s/ppcb_proxy", opts->bin_dir);
+    snprintf(port_str, sizeof(port_str), "%" PRIu16, port);
+    snprintf(proxy_port_str, sizeof(proxy_port_str), "%" PRIu16,
+                (uint16_t)(port + 1));
+    snprintf(pck_size_str, sizeof(pck_size_str), "%" PRIu64, pck_size);
+    snprintf(seed_str, sizeof(seed_str), "%d", run + 1);
+
+    // strtok modifies the strings, so every run works on a copy.
+    char* server_args = opts->server_args ? strdup(opts->server_args) : NULL;
+    char* client_args = opts->client_args ? strdup(opts->client_args) : NULL;
+
+    const char* server_argv[MAX_ARGS] = {ppcbs};
+    size_t server_argc = append_args(server_argv, 1, server_args);
+    server_argv[server_argc++] =
+                    strcmp(protocol, TCP_PROT) == 0 ? TCP_PROT : UDP_PROT;
+    server_argv[server_argc++] = port_str;
+    server_argv[server_argc] = NULL;
+
+    const char* client_argv[MAX_ARGS] = {ppcbc, "-P", pck_size_str};
+    size_t client_argc = append_args(client_argv, 3, client_args);
+    client_argv[client_argc++] = protocol;
+    client_argv[client_argc++] = "127.0.0.1";
+    client_argv[client_argc++] = loss ? proxy_port_str : port_str;
+    client_argv[client_argc] = NULL;
+
+    const char* proxy_argv[] = {ppcb_proxy, "-s", seed_str, "-l", loss,
+                                proxy_port_str, "127.0.0.1", port_str, NULL};
+
+    int out_pipe[2];
+    if (pipe(out_pipe) < 0) {
+        syserr("pipe failed");
+    }
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd < 0) {
+        syserr("Failed to open /dev/null");
+    }
+    // Client errors go to a file, an empty one means a clean run.
+    int client_err_fd = create_input(0);
+
+    pid_t server_pid = spawn(server_argv, null_fd, out_pipe[1], null_fd);
+    close(out_pipe[1]);
+    pid_t proxy_pid = -1;
+    if (loss != NULL) {
+        proxy_pid = spawn(proxy_argv, null_fd, null_fd, null_fd);
+    }
+    usleep(SERVER_START_US);
+
+    lseek(input_fd, 0, SEEK_SET);
+    double start = now_seconds();
+    pid_t client_pid = spawn(client_argv, input_fd, null_fd, client_err_fd);
+
+    // Drain the server output while the client runs, counting the bytes.
+    static char buffer[1 << 16];
+    bool b_client_done = false, b_server_done = false, b_killed = false;
+    int client_status = 0, server_status = 0;
+    double client_end = 0, last_output = start;
+    while (!b_server_done) {
+        struct pollfd pfd = {.fd = out_pipe[0], .events = POLLIN};
+        if (poll(&pfd, 1, POLL_MS) > 0) {
+            ssize_t bytes_read = read(out_pipe[0], buffer, sizeof(buffer));
+            if (bytes_read > 0) {
+                result.bytes_out += bytes_read;
+                last_output = now_seconds();
+            }
+            else if (bytes_read == 0) {
+                b_server_done = true;
+            }
+        }
+
+        if (!b_client_done && wait4(client_pid, &client_status, WNOHANG,
+                                    &result.client_usage) == client_pid) {
+            client_end = now_seconds();
+            b_client_done = true;
+        }
+        if (b_client_done && !b_killed &&
+            now_seconds() - last_output > DRAIN_SECONDS) {
+            kill(server_pid, SIGINT);
+            b_killed = true;
+        }
+    }
+    if (!b_client_done) {
+        // The server died first.
+        wait4(client_pid, &client_status, 0, &result.client_usage);
+        client_end = now_seconds();
+    }
+    // The transfer ends when the last byte leaves the server.
+    result.seconds = (last_output > client_end ? last_output : client_end) -
+                        start;
+    wait4(server_pid, &server_status, 0, &result.server_usage);
+    if (proxy_pid > 0) {
+        kill(proxy_pid, SIGINT);
+        waitpid(proxy_pid, NULL, 0);
+    }
+
+    result.b_ok = WIFEXITED(client_status) &&
+                    WEXITSTATUS(client_status) == 0 &&
+                    lseek(client_err_fd, 0, SEEK_END) == 0;
+
+    close(out_pipe[0]);
+    close(null_fd);
+    close(client_err_fd);
+    free(server_args);
+    free(client_args);
+    return result;
+}
+
+// Runs one combination opts->repeats times and prints a line per run.
+void bench_case(const bench_opts* opts, const char* protocol, int input_fd,
+                uint64_t size, uint64_t pck_size, const char* loss,
+                uint16_t* port) {
+    if (loss != NULL && strcmp(protocol, TCP_PROT) == 0) {
+        // The proxy only relays datagrams.
+        return;
+    }
+
+    uint64_t packets = (size + pck_size - 1) / pck_size;
+    for (int run = 0; run < opts->repeats; ++run) {
+        // Fresh ports avoid waiting for the old sockets.
+        bench_result res = run_once(opts, protocol, input_fd, pck_size, loss,
+                                    run, *port);
+        *port += 2;
+        printf("%s,%" PRIu64 ",%" PRIu64 ",%s,%d,%d,%.6f,%.3f,%.1f,"
+                "%.6f,%ld,%.6f,%ld,%" PRIu64 "\n",
+                protocol, size, pck_size, loss ? loss : "-", run,
+                res.b_ok && res.bytes_out == size, res.seconds,
+                size / 1e6 / res.seconds, packets / res.seconds,
+                timeval_seconds(res.client_usage.ru_utime) +
+                timeval_seconds(res.client_usage.ru_stime),
+                res.client_usage.ru_maxrss,
+                timeval_seconds(res.server_usage.ru_utime) +
+                timeval_seconds(res.server_usage.ru_stime),
+                res.server_usage.ru_maxrss, res.bytes_out);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    static char default_protocols[] = "tcp,udp,udpr";
+    static char default_sizes[] = "1,1000,1000000,100000000";
+    static char default_pck_sizes[] = "64000";
+    char* protocols = default_protocols;
+    char* sizes = default_sizes;
+    char* pck_sizes = default_pck_sizes;
+    bench_opts opts = {.bin_dir = ".", .repeats = 3, .client_args = NULL,
+                        .server_args = NULL, .loss_count = 0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:s:k:L:r:a:o:")) != -1) {
+        switch (opt) {
+            case 'b':
+                opts.bin_dir = optarg;
+                break;
+            case 'p':
+                protocols = optarg;
+                break;
+            case 's':
+                sizes = optarg;
+                break;
+            case 'k':
+                pck_sizes = optarg;
+                break;
+            case 'L':
+                opts.loss_count = split_list(optarg, opts.losses, MAX_LIST);
+                break;
+            case 'r':
+                opts.repeats = atoi(optarg);
+                break;
+            case 'a':
+                opts.client_args = optarg;
+                break;
+            case 'o':
+                opts.server_args = optarg;
+                break;
+            default:
+                fatal(USAGE, argv[0]);
+        }
+    }
+    if (optind != argc || opts.repeats <= 0) {
+        fatal(USAGE, argv[0]);
+    }
+
+    opts.protocol_count = split_list(protocols, opts.protocols, MAX_LIST);
+    opts.size_count = read_numbers(sizes, opts.sizes, MAX_LIST);
+    opts.pck_size_count = read_numbers(pck_sizes, opts.pck_sizes, MAX_LIST);
+    for (size_t k = 0; k < opts.pck_size_count; ++k) {
+        if (opts.pck_sizes[k] == 0 || opts.pck_sizes[k] > PCK_SIZE) {
+            fatal("Package size must be between 1 and %d.", PCK_SIZE);
+        }
+    }
+
+    // A dead client must not take the benchmark with it.
+    signal(SIGPIPE, SIG_IGN);
+    uint16_t port = 20000 + getpid() % 20000;
+
+    printf("protocol,size,pck_size,loss,run,ok,seconds,MBps,pps,"
+            "client_cpu_s,client_maxrss_kb,server_cpu_s,server_maxrss_kb,"
+            "bytes_out\n");
+    for (size_t s = 0; s < opts.size_count; ++s) {
+        int input_fd = create_input(opts.sizes[s]);
+        for (size_t k = 0; k < opts.pck_size_count; ++k) {
+            for (size_t p = 0; p < opts.protocol_count; ++p) {
+                size_t loss_runs = opts.loss_count ? opts.loss_count : 1;
+                for (size_t l = 0; l < loss_runs; ++l) {
+                    bench_case(&opts, opts.protocols[p], input_fd,
+                                opts.sizes[s], opts.pck_sizes[k],
+                                opts.loss_count ? opts.losses[l] : NULL,
+                                &port);
+                }
+            }
+        }
+        close(input_fd);
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,281 @@
+#include "common.h"
+#include "protconst.h"
+#include "err.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// Microbenchmarks of the common.c helpers on the data path. Every benchmark
+// runs for every package size, doubling the iteration count until a batch
+// takes at least the minimal time, and reports the time per call.
+
+#define USAGE "usage: %s [-s sizes] [-t min_seconds] [-f filter]"
+
+#define MAX_SIZES 32
+#define DEFAULT_SIZES "1,64,512,1400,8192,32768,64000"
+#define SESSION_ID 0x1122334455667788ULL
+
+typedef struct {
+    uint32_t size;
+    char* data;
+    char* pck;
+    char* recv_buf;
+    int fds[2];
+} bench_ctx;
+
+typedef struct {
+    const char* name;
+    void (*setup)(bench_ctx* ctx);
+    void (*run)(bench_ctx* ctx, uint64_t iters);
+    void (*teardown)(bench_ctx* ctx);
+} bench;
+
+// Keeps the compiler from dropping the benchmarked calls.
+volatile uint64_t bench_sink;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run_init_data_pck(bench_ctx* ctx, uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        init_data_pck(SESSION_ID, htobe64(i), htobe32(ctx->size), ctx->pck,
+                        ctx->data);
+    }
+    bench_sink += (uint8_t)ctx->pck[0];
+}
+
+void run_init_cdata_pck(bench_ctx* ctx, uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        bench_sink += init_cdata_pck(UDPR_PROT_ID, SESSION_ID, i, ctx->size,
+                                        ctx->pck, ctx->data);
+    }
+}
+
+void setup_data_pck(bench_ctx* ctx) {
+    init_data_pck(SESSION_ID, htobe64(0), htobe32(ctx->size), ctx->pck,
+                    ctx->data);
+}
+
+// The validation done by the servers for every received package.
+void run_is_expected_data(bench_ctx* ctx, uint64_t iters) {
+    const DATA* dt = (const DATA*)ctx->pck;
+    ssize_t pck_len = sizeof(DATA) - sizeof(char*) + ctx->size;
+    uint64_t hits = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        // Every other check fails on the package number.
+        hits += is_expected_data(dt, pck_len, SESSION_ID, i & 1);
+    }
+    bench_sink += hits;
+}
+
+void run_expand_udp_cdata(bench_ctx* ctx, uint64_t iters) {
+    char header[sizeof(UDP_CDATA)];
+    size_t hdr_size = init_cdata_pck(UDPR_PROT_ID, SESSION_ID, 0, ctx->size,
+                                        ctx->pck + CDATA_OFFSET, ctx->data);
+    memcpy(header, ctx->pck + CDATA_OFFSET, hdr_size);
+    for (uint64_t i = 0; i < iters; ++i) {
+        // The expansion overwrites the compact header, put it back.
+        memcpy(ctx->pck + CDATA_OFFSET, header, hdr_size);
+        ssize_t pck_len = hdr_size + ctx->size;
+        expand_udp_cdata(ctx->pck, &pck_len, SESSION_ID, 0);
+        bench_sink += pck_len;
+    }
+}
+
+void run_update_checksum(bench_ctx* ctx, uint64_t iters) {
+    uint32_t checksum = CHECKSUM_INIT;
+    for (uint64_t i = 0; i < iters; ++i) {
+        checksum = update_checksum(checksum, ctx->data, ctx->size);
+    }
+    bench_sink += checksum;
+}
+
+void setup_socketpair(bench_ctx* ctx) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx->fds) < 0) {
+        syserr("socketpair failed");
+    }
+}
+
+void setup_pipe(bench_ctx* ctx) {
+    if (pipe(ctx->fds) < 0) {
+        syserr("pipe failed");
+    }
+}
+
+void close_fds(bench_ctx* ctx) {
+    close(ctx->fds[0]);
+    close(ctx->fds[1]);
+}
+
+// One package through the kernel and back. Both buffers hold 64000 bytes,
+// so a single thread can write a package and then read it.
+void run_write_read_n_bytes(bench_ctx* ctx, uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (write_n_bytes(ctx->fds[1], ctx->data, ctx->size) !=
+                (ssize_t)ctx->size ||
+            read_n_bytes(ctx->fds[0], ctx->recv_buf, ctx->size) !=
+                (ssize_t)ctx->size) {
+            syserr("Transfer failed");
+        }
+    }
+    bench_sink += (uint8_t)ctx->recv_buf[0];
+}
+
+void* drain_pipe(void* arg) {
+    int fd = *(int*)arg;
+    char buffer[1 << 16];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {}
+    return NULL;
+}
+
+void run_print_data(bench_ctx* ctx, uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        print_data(ctx->data, ctx->size);
+    }
+}
+
+// Runs print_data with stdout pointed at target_fd.
+void run_print_data_to(bench_ctx* ctx, uint64_t iters, int target_fd) {
+    fflush(stdout);
+    int saved_fd = dup(STDOUT_FILENO);
+    if (saved_fd < 0 || dup2(target_fd, STDOUT_FILENO) < 0) {
+        syserr("Failed to redirect stdout");
+    }
+    run_print_data(ctx, iters);
+    if (dup2(saved_fd, STDOUT_FILENO) < 0) {
+        syserr("Failed to restore stdout");
+    }
+    close(saved_fd);
+}
+
+void run_print_data_null(bench_ctx* ctx, uint64_t iters) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        syserr("Failed to open /dev/null");
+    }
+    run_print_data_to(ctx, iters, null_fd);
+    close(null_fd);
+}
+
+void run_print_data_pipe(bench_ctx* ctx, uint64_t iters) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        syserr("pipe failed");
+    }
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, drain_pipe, &fds[0]) != 0) {
+        fatal("Failed to start the pipe reader");
+    }
+    run_print_data_to(ctx, iters, fds[1]);
+    // The reader stops once the last write end is closed.
+    close(fds[1]);
+    pthread_join(reader, NULL);
+    close(fds[0]);
+}
+
+const bench benches[] = {
+    {"init_data_pck", NULL, run_init_data_pck, NULL},
+    {"init_cdata_pck", NULL, run_init_cdata_pck, NULL},
+    {"is_expected_data", setup_data_pck, run_is_expected_data, NULL},
+    {"expand_udp_cdata", NULL, run_expand_udp_cdata, NULL},
+    {"update_checksum", NULL, run_update_checksum, NULL},
+    {"rw_n_bytes_socketpair", setup_socketpair, run_write_read_n_bytes,
+        close_fds},
+    {"rw_n_bytes_pipe", setup_pipe, run_write_read_n_bytes, close_fds},
+    {"print_data_devnull", NULL, run_print_data_null, NULL},
+    {"print_data_pipe", NULL, run_print_data_pipe, NULL},
+};
+
+// Returns the time of one call in nanoseconds.
+double measure(const bench* b, bench_ctx* ctx, double min_seconds) {
+    if (b->setup != NULL) {
+        b->setup(ctx);
+    }
+    // Warm up the caches and the branch predictors.
+    b->run(ctx, 1);
+
+    uint64_t iters = 1;
+    double elapsed;
+    while (true) {
+        double start = now_seconds();
+        b->run(ctx, iters);
+        elapsed = now_seconds() - start;
+        if (elapsed >= min_seconds || iters >= (1ULL << 40)) {
+            break;
+        }
+        iters *= 2;
+    }
+
+    if (b->teardown != NULL) {
+        b->teardown(ctx);
+    }
+    return elapsed * 1e9 / iters;
+}
+
+int main(int argc, char* argv[]) {
+    static char default_sizes[] = DEFAULT_SIZES;
+    char* size_list = default_sizes;
+    double min_seconds = 0.2;
+    const char* filter = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:f:")) != -1) {
+        switch (opt) {
+            case 's':
+                size_list = optarg;
+                break;
+            case 't':
+                min_seconds = atof(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            default:
+                fatal(USAGE, argv[0]);
+        }
+    }
+    if (optind != argc || min_seconds <= 0) {
+        fatal(USAGE, argv[0]);
+    }
+
+    uint32_t sizes[MAX_SIZES];
+    size_t size_count = 0;
+    for (char* item = strtok(size_list, ","); item != NULL &&
+            size_count < MAX_SIZES; item = strtok(NULL, ",")) {
+        sizes[size_count++] = read_pck_size(item);
+    }
+
+    bench_ctx ctx;
+    ctx.data = malloc(PCK_SIZE);
+    ctx.pck = malloc(CDATA_OFFSET + sizeof(DATA) + PCK_SIZE);
+    ctx.recv_buf = malloc(PCK_SIZE);
+    if (ctx.data == NULL || ctx.pck == NULL || ctx.recv_buf == NULL) {
+        fatal("Out of memory");
+    }
+    for (size_t i = 0; i < PCK_SIZE; ++i) {
+        ctx.data[i] = (char)(i * 131);
+    }
+
+    printf("%-24s %8s %14s %12s\n", "benchmark", "size", "ns/op", "MB/s");
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); ++b) {
+        if (filter != NULL && strstr(benches[b].name, filter) == NULL) {
+            continue;
+        }
+        for (size_t s = 0; s < size_count; ++s) {
+            ctx.size = sizes[s];
+            double ns = measure(&benches[b], &ctx, min_seconds);
+            printf("%-24s %8" PRIu32 " %14.1f %12.1f\n", benches[b].name,
+                    ctx.size, ns, ctx.size * 1e3 / ns);
+            fflush(stdout);
+        }
+    }
+
+    free(ctx.data);
+    free(ctx.pck);
+    free(ctx.recv_buf);
+    return 0;
+}
\ No newline at end of file
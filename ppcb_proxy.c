@@ -0,0 +1,441 @@
+#include "common.h"
+#include "protconst.h"
+#include "err.h"
+
+#include <poll.h>
+
+// UDP relay placed between ppcbc and ppcbs which impairs the traffic passing
+// through it. The client talks to the proxy port, the proxy forwards to the
+// server from its own socket. Every direction has its own loss (uniform or
+// Gilbert-Elliott), delay, jitter, reordering, duplication and rate limit.
+// Options apply to the direction chosen by the latest -D (both by default).
+
+#define USAGE "usage: %s [-D up|down|both] [-l loss] [-g p_gb,p_bg,bad_loss] "\
+        "[-d delay_ms] [-j jitter_ms] [-r reorder[,extra_ms]] [-u dup] "\
+        "[-b rate_Bps] [-q queue_bytes] [-s seed] "\
+        "<listen_port> <server_host> <server_port>"
+
+#define DIR_UP 0 // Client to server.
+#define DIR_DOWN 1 // Server to client.
+#define DIR_COUNT 2
+
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+#define DEFAULT_REORDER_MS 10
+#define DEFAULT_QUEUE_BYTES (1 << 20)
+// Largest UDP payload over IPv4, a first flight package carries a CONN too.
+#define MAX_DATAGRAM_SIZE 65507
+
+typedef struct {
+    double loss;
+    // Gilbert-Elliott: transition probabilities good->bad and bad->good,
+    // and the loss probability in the bad state. p_gb == 0 disables it.
+    double p_gb;
+    double p_bg;
+    double bad_loss;
+    uint64_t delay_ns;
+    uint64_t jitter_ns;
+    double reorder;
+    uint64_t reorder_ns;
+    double dup;
+    uint64_t rate_Bps; // 0 means unlimited.
+    uint64_t queue_bytes;
+} link_opts;
+
+typedef struct {
+    uint64_t received;
+    uint64_t forwarded;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t queue_drops;
+    uint64_t duplicated;
+    uint64_t reordered;
+} link_stats;
+
+typedef struct {
+    link_opts opts;
+    link_stats stats;
+    bool b_bad_state;
+    // Time when the rate limited link finishes sending its backlog.
+    uint64_t busy_until_ns;
+} link_state;
+
+typedef struct {
+    uint64_t send_ns;
+    uint64_t seq; // Keeps equal send times in arrival order.
+    int dir;
+    size_t len;
+    char data[];
+} queued_pck;
+
+// Min-heap of packets ordered by send time.
+typedef struct {
+    queued_pck** pcks;
+    size_t count;
+    size_t capacity;
+    uint64_t next_seq;
+} pck_queue;
+
+static volatile sig_atomic_t b_stop = false;
+static uint64_t rng_state;
+
+void stop_handler(int signo) {
+    (void)signo;
+    b_stop = true;
+}
+
+// xorshift64*, so a given seed replays the same impairments.
+uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+double rng_uniform(void) {
+    return (rng_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+bool rng_chance(double probability) {
+    return probability > 0 && rng_uniform() < probability;
+}
+
+bool pck_before(const queued_pck* a, const queued_pck* b) {
+    return a->send_ns < b->send_ns ||
+            (a->send_ns == b->send_ns && a->seq < b->seq);
+}
+
+void queue_push(pck_queue* queue, queued_pck* pck) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->pcks = realloc(queue->pcks,
+                                queue->capacity * sizeof(queued_pck*));
+        if (queue->pcks == NULL) {
+            syserr("Failed to grow the packet queue");
+        }
+    }
+    pck->seq = queue->next_seq++;
+
+    size_t i = queue->count++;
+    while (i > 0 && pck_before(pck, queue->pcks[(i - 1) / 2])) {
+        queue->pcks[i] = queue->pcks[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->pcks[i] = pck;
+}
+
+queued_pck* queue_pop(pck_queue* queue) {
+    queued_pck* top = queue->pcks[0];
+    queued_pck* last = queue->pcks[--queue->count];
+    size_t i = 0;
+    while (2 * i + 1 < queue->count) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < queue->count &&
+            pck_before(queue->pcks[child + 1], queue->pcks[child])) {
+            child++;
+        }
+        if (!pck_before(queue->pcks[child], last)) {
+            break;
+        }
+        queue->pcks[i] = queue->pcks[child];
+        i = child;
+    }
+    if (queue->count > 0) {
+        queue->pcks[i] = last;
+    }
+    return top;
+}
+
+double read_probability(const char* string) {
+    char* endptr;
+    double value = strtod(string, &endptr);
+    if (*endptr != 0 || !(value >= 0 && value <= 1)) {
+        fatal("%s is not a valid probability.", string);
+    }
+    return value;
+}
+
+uint64_t read_number(const char* string) {
+    char* endptr;
+    errno = 0;
+    unsigned long long value = strtoull(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || *string == 0) {
+        fatal("%s is not a valid number.", string);
+    }
+    return value;
+}
+
+// Returns whether the link drops the packet, advancing the Gilbert-Elliott
+// chain when it is enabled.
+bool link_loses(link_state* link) {
+    const link_opts* opts = &link->opts;
+    if (opts->p_gb > 0) {
+        if (link->b_bad_state) {
+            link->b_bad_state = !rng_chance(opts->p_bg);
+        }
+        else {
+            link->b_bad_state = rng_chance(opts->p_gb);
+        }
+        return rng_chance(link->b_bad_state ? opts->bad_loss : opts->loss);
+    }
+    return rng_chance(opts->loss);
+}
+
+// Computes when the packet leaves the link, -1 if the queue overflows.
+int64_t link_send_time(link_state* link, size_t len, uint64_t now) {
+    const link_opts* opts = &link->opts;
+    uint64_t departure = now;
+    if (opts->rate_Bps > 0) {
+        uint64_t start = link->busy_until_ns > now ? link->busy_until_ns : now;
+        uint64_t backlog = (start - now) * opts->rate_Bps / NS_PER_SEC;
+        if (backlog + len > opts->queue_bytes) {
+            return -1;
+        }
+        departure = start + len * NS_PER_SEC / opts->rate_Bps;
+        link->busy_until_ns = departure;
+    }
+
+    int64_t delay = opts->delay_ns;
+    if (opts->jitter_ns > 0) {
+        delay += (int64_t)(rng_next() % (2 * opts->jitter_ns + 1)) -
+                    (int64_t)opts->jitter_ns;
+        if (delay < 0) {
+            delay = 0;
+        }
+    }
+    if (rng_chance(opts->reorder)) {
+        // Held back so that the following packets overtake it.
+        delay += opts->reorder_ns;
+        link->stats.reordered++;
+    }
+    return departure + delay;
+}
+
+void enqueue(pck_queue* queue, link_state* link, int dir,
+                const char* data, size_t len, uint64_t now) {
+    link->stats.received++;
+    if (link_loses(link)) {
+        link->stats.lost++;
+        return;
+    }
+
+    int copies = rng_chance(link->opts.dup) ? 2 : 1;
+    link->stats.duplicated += copies - 1;
+    for (int i = 0; i < copies; ++i) {
+        int64_t send_ns = link_send_time(link, len, now);
+        if (send_ns < 0) {
+            link->stats.queue_drops++;
+            continue;
+        }
+        queued_pck* pck = malloc(sizeof(queued_pck) + len);
+        if (pck == NULL) {
+            syserr("Failed to queue a packet");
+        }
+        pck->send_ns = send_ns;
+        pck->dir = dir;
+        pck->len = len;
+        memcpy(pck->data, data, len);
+        queue_push(queue, pck);
+    }
+}
+
+void print_link_stats(const char* name, const link_stats* stats) {
+    fprintf(stderr, "%s received=%" PRIu64 " forwarded=%" PRIu64
+            " bytes=%" PRIu64 " lost=%" PRIu64 " queue_drops=%" PRIu64
+            " duplicated=%" PRIu64 " reordered=%" PRIu64 "\n",
+            name, stats->received, stats->forwarded, stats->bytes,
+            stats->lost, stats->queue_drops, stats->duplicated,
+            stats->reordered);
+}
+
+void apply_opt(link_state* links, int first, int last, int opt,
+                char* arg) {
+    for (int dir = first; dir <= last; ++dir) {
+        link_opts* opts = &links[dir].opts;
+        switch (opt) {
+            case 'l':
+                opts->loss = read_probability(arg);
+                break;
+            case 'g': {
+                char* copy = strdup(arg);
+                char* p_gb = strtok(copy, ",");
+                char* p_bg = strtok(NULL, ",");
+                char* bad_loss = strtok(NULL, ",");
+                if (p_gb == NULL || p_bg == NULL) {
+                    fatal("-g expects p_gb,p_bg[,bad_loss].");
+                }
+                opts->p_gb = read_probability(p_gb);
+                opts->p_bg = read_probability(p_bg);
+                opts->bad_loss = bad_loss ? read_probability(bad_loss) : 1;
+                free(copy);
+                break;
+            }
+            case 'd':
+                opts->delay_ns = read_number(arg) * NS_PER_MS;
+                break;
+            case 'j':
+                opts->jitter_ns = read_number(arg) * NS_PER_MS;
+                break;
+            case 'r': {
+                char* copy = strdup(arg);
+                char* reorder = strtok(copy, ",");
+                char* extra_ms = strtok(NULL, ",");
+                opts->reorder = read_probability(reorder ? reorder : arg);
+                opts->reorder_ns = (extra_ms ? read_number(extra_ms) :
+                                    DEFAULT_REORDER_MS) * NS_PER_MS;
+                free(copy);
+                break;
+            }
+            case 'u':
+                opts->dup = read_probability(arg);
+                break;
+            case 'b':
+                opts->rate_Bps = read_number(arg);
+                break;
+            case 'q':
+                opts->queue_bytes = read_number(arg);
+                break;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    link_state links[DIR_COUNT];
+    memset(links, 0, sizeof(links));
+    for (int dir = 0; dir < DIR_COUNT; ++dir) {
+        links[dir].opts.reorder_ns = DEFAULT_REORDER_MS * NS_PER_MS;
+        links[dir].opts.queue_bytes = DEFAULT_QUEUE_BYTES;
+    }
+    rng_state = monotonic_ns() ^ ((uint64_t)getpid() << 32);
+    int first = DIR_UP, last = DIR_DOWN;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "D:l:g:d:j:r:u:b:q:s:")) != -1) {
+        if (opt == 'D') {
+            if (strcmp(optarg, "up") == 0) {
+                first = last = DIR_UP;
+            }
+            else if (strcmp(optarg, "down") == 0) {
+                first = last = DIR_DOWN;
+            }
+            else if (strcmp(optarg, "both") == 0) {
+                first = DIR_UP;
+                last = DIR_DOWN;
+            }
+            else {
+                fatal(USAGE, argv[0]);
+            }
+        }
+        else if (opt == 's') {
+            rng_state = read_number(optarg);
+        }
+        else if (opt == '?') {
+            fatal(USAGE, argv[0]);
+        }
+        else {
+            apply_opt(links, first, last, opt, optarg);
+        }
+    }
+    if (argc - optind != 3) {
+        fatal(USAGE, argv[0]);
+    }
+    if (rng_state == 0) {
+        // xorshift never leaves zero.
+        rng_state = 1;
+    }
+    uint64_t seed = rng_state;
+
+    uint16_t listen_port = read_port(argv[optind]);
+    struct sockaddr_in server_addr = get_server_address(argv[optind + 1],
+                        read_port(argv[optind + 2]), UDP_PROT_ID);
+
+    struct sockaddr_in listen_addr;
+    int client_fd = setup_socket(&listen_addr, UDP_PROT_ID, listen_port, NULL);
+    int server_fd = create_socket(UDP_PROT_ID, NULL);
+    if (connect(server_fd, (struct sockaddr*)&server_addr,
+                sizeof(server_addr)) < 0) {
+        syserr("Failed to connect to the server");
+    }
+
+    ignore_signal(stop_handler, SIGINT);
+    ignore_signal(stop_handler, SIGTERM);
+
+    pck_queue queue = {.pcks = NULL, .count = 0, .capacity = 0,
+                        .next_seq = 0};
+    struct sockaddr_in client_addr;
+    bool b_have_client = false;
+    static char buffer[MAX_DATAGRAM_SIZE];
+
+    while (!b_stop) {
+        uint64_t now = monotonic_ns();
+        // Send everything that is due.
+        while (queue.count > 0 && queue.pcks[0]->send_ns <= now) {
+            queued_pck* pck = queue_pop(&queue);
+            ssize_t sent;
+            if (pck->dir == DIR_UP) {
+                sent = send(server_fd, pck->data, pck->len, 0);
+            }
+            else {
+                sent = sendto(client_fd, pck->data, pck->len, 0,
+                                (struct sockaddr*)&client_addr,
+                                sizeof(client_addr));
+            }
+            if (sent == (ssize_t)pck->len) {
+                links[pck->dir].stats.forwarded++;
+                links[pck->dir].stats.bytes += pck->len;
+            }
+            free(pck);
+        }
+
+        int timeout_ms = -1;
+        if (queue.count > 0) {
+            // Rounded up so that we never spin before the deadline.
+            timeout_ms = (queue.pcks[0]->send_ns - now + NS_PER_MS - 1) /
+                            NS_PER_MS;
+        }
+        struct pollfd fds[2] = {
+            {.fd = client_fd, .events = POLLIN},
+            {.fd = server_fd, .events = POLLIN},
+        };
+        if (poll(fds, 2, timeout_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syserr("poll failed");
+        }
+
+        now = monotonic_ns();
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t len = recvfrom(client_fd, buffer, sizeof(buffer), 0,
+                                    (struct sockaddr*)&from, &from_len);
+            if (len >= 0) {
+                // The latest client gets the replies, like the server does.
+                client_addr = from;
+                b_have_client = true;
+                enqueue(&queue, &links[DIR_UP], DIR_UP, buffer, len, now);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            // Nothing arrives from the server before the client spoke, but
+            // an ICMP error may still need draining.
+            ssize_t len = recv(server_fd, buffer, sizeof(buffer), 0);
+            if (len >= 0 && b_have_client) {
+                enqueue(&queue, &links[DIR_DOWN], DIR_DOWN, buffer, len, now);
+            }
+        }
+    }
+
+    fprintf(stderr, "seed=%" PRIu64 "\n", seed);
+    print_link_stats("up", &links[DIR_UP].stats);
+    print_link_stats("down", &links[DIR_DOWN].stats);
+
+    while (queue.count > 0) {
+        free(queue_pop(&queue));
+    }
+    free(queue.pcks);
+    close(client_fd);
+    close(server_fd);
+    return 0;
+}
\ No newline at end of file
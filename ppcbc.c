@@ -3,71 +3,267 @@
 #include "tcp_client.h"
 #include "udp_client.h"
 #include "udpr_client.h"
+#include "udpm_client.h"
+#include "probe.h"
 #include "err.h"
+#include "latency.h"
+#include "input.h"
+#include "tcp_daemon.h"
+#include "net.h"
+
+#include <sys/stat.h>
+
+#define USAGE "usage: %s [-s session_id] [-r] [-c] [-l] [-P pck_size] "\
+                "[-N streams] [-D socket] [-0] [-F] [-u] [-d] [-n receivers] "\
+                "[-i iface] [-B busy_poll_us] [-C cpu] <protocol> <host> "\
+                "<port> | -M socket"
 
 int main(int argc, char* argv[]) {
-    if (argc != 4){
-        fatal("usage: %s <protocol> <host> <port>", argv[0]);
+    client_opts opts = {.session_id = 0, .conn_flags = 0, 
+                        .b_latency = false, .pck_size = PCK_SIZE,
+                        .input = NULL, .stripe = NULL,
+                        .b_first_flight = false, .b_tcp_tuned = false,
+                        .b_dedup = false, .mcast_receivers = 1,
+                        .mcast_iface = {.s_addr = htonl(INADDR_ANY)},
+                        .pin_cpu = -1};
+    bool b_session_id_set = false;
+    bool b_pck_size_set = false;
+    uint16_t stripe_count = 1;
+    bool b_stream = false;
+    const char* daemon_path = NULL;
+    const char* submit_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:rclP:N:D:M:0Fudn:i:B:C:")) != -1) {
+        if (opt == 's') {
+            opts.session_id = read_session_id(optarg);
+            b_session_id_set = true;
+        }
+        else if (opt == 'r') {
+            opts.conn_flags |= CONN_FLAG_RESUME;
+        }
+        else if (opt == 'c') {
+            opts.conn_flags |= CONN_FLAG_COMPACT;
+        }
+        else if (opt == 'l') {
+            opts.b_latency = true;
+        }
+        else if (opt == 'P') {
+            opts.pck_size = read_pck_size(optarg);
+            b_pck_size_set = true;
+        }
+        else if (opt == 'N') {
+            stripe_count = read_stripe_count(optarg);
+        }
+        else if (opt == 'D') {
+            daemon_path = optarg;
+        }
+        else if (opt == 'M') {
+            submit_path = optarg;
+        }
+        else if (opt == '0') {
+            opts.b_first_flight = true;
+        }
+        else if (opt == 'F') {
+            opts.b_tcp_tuned = true;
+        }
+        else if (opt == 'u') {
+            b_stream = true;
+        }
+        else if (opt == 'd') {
+            opts.b_dedup = true;
+        }
+        else if (opt == 'n') {
+            opts.mcast_receivers = read_receiver_count(optarg);
+        }
+        else if (opt == 'i') {
+            opts.mcast_iface = read_ipv4(optarg);
+        }
+        else if (opt == 'B') {
+            busy_poll_us = read_busy_poll(optarg);
+        }
+        else if (opt == 'C') {
+            opts.pin_cpu = read_cpu(optarg);
+        }
+        else {
+            fatal(USAGE, argv[0]);
+        }
     }
-    else if (strcmp(argv[1], TCP_PROT) != 0 && strcmp(argv[1], UDP_PROT) &&
-    strcmp(argv[1], UDPR_PROT) != 0) {
-        fatal("Protocol %s is not supported.", argv[1]);
+
+    if (submit_path != NULL) {
+        // Hand the input over to a running daemon.
+        if (argc != optind) {
+            fatal(USAGE, argv[0]);
+        }
+        uint64_t data_length = 0;
+        char* buffer = read_all(STDIN_FILENO, &data_length);
+        if (buffer == NULL) {
+            syserr("Failed to read data from STDIN");
+        }
+        bool b_failed = submit_to_daemon(submit_path, buffer, data_length);
+        free(buffer);
+        if (b_failed) {
+            fatal("The daemon failed to deliver the data.");
+        }
+        return 0;
+    }
+
+    if (argc - optind != 3){
+        fatal(USAGE, argv[0]);
+    }
+    const char* protocol = argv[optind];
+    if (strcmp(protocol, TCP_PROT) != 0 && strcmp(protocol, UDP_PROT) &&
+    strcmp(protocol, UDPR_PROT) != 0 && strcmp(protocol, UDPM_PROT) != 0 &&
+    strcmp(protocol, AUTO_PROT) != 0) {
+        fatal("Protocol %s is not supported.", protocol);
+    }
+    else if ((opts.conn_flags & CONN_FLAG_RESUME) && !b_session_id_set) {
+        fatal("Resuming a session requires its id (-s).");
+    }
+    else if (stripe_count > 1 && strcmp(protocol, TCP_PROT) != 0) {
+        fatal("Only TCP transfers can be split into streams (-N).");
+    }
+    else if (stripe_count > 1 && (opts.conn_flags & CONN_FLAG_RESUME)) {
+        fatal("Split transfers can't be resumed.");
+    }
+    else if (daemon_path != NULL && (strcmp(protocol, TCP_PROT) != 0 || 
+                stripe_count > 1 || (opts.conn_flags & CONN_FLAG_RESUME))) {
+        fatal("The daemon (-D) sends only new, single stream TCP sessions.");
+    }
+    else if (opts.b_first_flight && (strcmp(protocol, TCP_PROT) == 0 ||
+                (opts.conn_flags & CONN_FLAG_RESUME))) {
+        fatal("First flight data (-0) is for new UDP and UDPR sessions only.");
+    }
+    else if (opts.b_tcp_tuned && strcmp(protocol, TCP_PROT) != 0) {
+        fatal("Only TCP sockets can be tuned (-F).");
+    }
+    else if (b_stream && ((opts.conn_flags & CONN_FLAG_RESUME) || 
+                stripe_count > 1 || daemon_path != NULL || 
+                opts.b_first_flight)) {
+        fatal("A stream of unknown length (-u) can't be resumed, split, "
+                "sent by the daemon or sent in the first flight.");
+    }
+    else if (opts.b_dedup && (strcmp(protocol, TCP_PROT) != 0 || 
+                (opts.conn_flags & (CONN_FLAG_RESUME | CONN_FLAG_COMPACT)) ||
+                stripe_count > 1 || daemon_path != NULL || b_stream)) {
+        fatal("Deduplication (-d) is for new, single stream TCP sessions of "
+                "known length, without compact headers.");
+    }
+    else if (strcmp(protocol, AUTO_PROT) == 0 && 
+                ((opts.conn_flags & CONN_FLAG_RESUME) || 
+                opts.b_first_flight || opts.b_tcp_tuned)) {
+        fatal("The protocol picked by auto can't be resumed, tuned (-F) or "
+                "sent in the first flight (-0).");
+    }
+    else if (strcmp(protocol, UDPM_PROT) == 0 && (opts.conn_flags || 
+                opts.b_first_flight || b_stream || daemon_path != NULL)) {
+        fatal("Multicast (udpm) sends only new sessions of known length, "
+                "without compact headers or first flight data.");
+    }
+
+    if (!b_session_id_set) {
+        // Generate a random session indetificator.
+        time_t t;
+        srand((unsigned)time(&t));
+        opts.session_id = rand();
+    }
+
+    const char* host_name = argv[optind + 1];
+    uint16_t port = read_port(argv[optind + 2]);
+    if (daemon_path != NULL) {
+        // Messages come from the daemon's socket instead of STDIN.
+        struct sockaddr_in server_addr = 
+                get_server_address(host_name, port, TCP_PROT_ID);
+        run_tcp_daemon(&server_addr, daemon_path, &opts);
+        if (opts.b_latency) {
+            hist_print(&conn_rtt_hist, "conn_rtt", stderr);
+            hist_print(&data_rtt_hist, "data_rtt", stderr);
+        }
+        return 0;
     }
 
-    // Read data from the standard input. Implemented in O(nlogn), 
-    // where n is the size of the input data.
-    uint64_t buffer_size = 1024;
-    char* buffer = malloc(buffer_size * sizeof(char));
-    assert_null(buffer, -1, -1, NULL, NULL);
-    ssize_t bytes_read = 0;
     uint64_t data_length = 0;
-    do {
-        if (buffer_size - data_length == 0) {
-            buffer_size *= 2;
-            buffer = realloc(buffer, buffer_size * sizeof(char));
-            assert_null(buffer, -1, -1, NULL, NULL);
-        }
-        bytes_read = read(STDIN_FILENO, buffer + data_length, 
-                            buffer_size - data_length);
-        if (bytes_read == -1) {
-            free(buffer);
+    char* buffer = NULL;
+    struct stat input_stat;
+    off_t input_pos = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    // A regular file tells its length up front, so it's read by another
+    // thread while we send. Resuming needs the prefix before sending
+    // starts to verify it, so it reads everything first. Every stream of
+    // a split transfer gets its own reader.
+    bool b_file = !b_stream && !(opts.conn_flags & CONN_FLAG_RESUME) && 
+                    input_pos >= 0 && fstat(STDIN_FILENO, &input_stat) == 0 &&
+                    S_ISREG(input_stat.st_mode) && 
+                    input_stat.st_size > input_pos;
+    if (b_stream) {
+        // Sent as it comes, without knowing where it ends.
+        data_length = STREAM_LENGTH;
+    }
+    else if (b_file) {
+        data_length = input_stat.st_size - input_pos;
+    }
+    else {
+        buffer = read_all(STDIN_FILENO, &data_length);
+        if (buffer == NULL) {
             syserr("Failed to read data from STDIN");
         }
-        data_length += bytes_read;
-    } while (bytes_read > 0);
+    }
 
-    if(data_length != buffer_size) {
-        buffer = realloc(buffer, data_length);
-        assert_null(buffer, -1, -1, NULL, NULL);
+    if (strcmp(protocol, AUTO_PROT) == 0) {
+        // Picked before the readers start, they need the package size.
+        struct sockaddr_in server_addr = 
+                get_server_address(host_name, port, UDP_PROT_ID);
+        path_probe probe;
+        probe_path(&server_addr, opts.session_id, &probe);
+        protocol = choose_protocol(&probe, data_length, &opts, 
+                                    b_pck_size_set);
+    }
+
+    if (b_stream) {
+        opts.input = start_stream_ring(STDIN_FILENO, opts.pck_size,
+                                        INPUT_RING_SLOTS);
+    }
+    else if (b_file && stripe_count == 1) {
+        opts.input = start_input_ring(STDIN_FILENO, input_pos, 
+                                        data_length, opts.pck_size);
     }
-    
-    // Generate a random session indetificator.
-    time_t t;
-    srand((unsigned)time(&t));
-    uint64_t session_id = rand();
 
     // Start an appropriate server.
-    const char* host_name = argv[2];
-    uint16_t port = read_port(argv[3]);
-    if (strcmp(argv[1], "tcp") == 0) {
+    if (strcmp(protocol, "tcp") == 0) {
         struct sockaddr_in server_addr = 
                 get_server_address(host_name, port, TCP_PROT_ID);
-        run_tcp_client(&server_addr, buffer, data_length, session_id);
+        if (stripe_count > 1) {
+            run_tcp_stripes(&server_addr, buffer, data_length, STDIN_FILENO,
+                            input_pos, &opts, stripe_count);
+        }
+        else {
+            run_tcp_client(&server_addr, buffer, data_length, &opts);
+        }
     }
-    else if (strcmp(argv[1], "udp") == 0) {
+    else if (strcmp(protocol, "udp") == 0) {
         struct sockaddr_in server_addr = 
                 get_server_address(host_name, port, UDP_PROT_ID);
-        run_udp_client(&server_addr, buffer, data_length, session_id);
+        run_udp_client(&server_addr, buffer, data_length, &opts);
+    }
+    else if (strcmp(protocol, UDPM_PROT) == 0) {
+        // The host is the multicast group.
+        struct sockaddr_in group_addr = 
+                get_server_address(host_name, port, UDPM_PROT_ID);
+        run_udpm_client(&group_addr, buffer, data_length, &opts);
     }
     else { // UDPR protocol.
         struct sockaddr_in server_addr = 
                 get_server_address(host_name, port, UDPR_PROT_ID);
-        run_udpr_client(&server_addr, buffer, data_length, session_id);
+        run_udpr_client(&server_addr, buffer, data_length, &opts);
     }
     
-    if (data_length > 0) {
+    if (buffer != NULL && data_length > 0) {
         free(buffer);
     }
+    close_input_ring(opts.input);
+
+    if (opts.b_latency) {
+        hist_print(&conn_rtt_hist, "conn_rtt", stderr);
+        hist_print(&data_rtt_hist, "data_rtt", stderr);
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -3,22 +3,92 @@
 #include "tcp_server.h"
 #include "udp_server.h"
 #include "err.h"
+#include "stats.h"
+#include "mempool.h"
+#include "relay.h"
+#include "net.h"
+
+#define USAGE "Usage: %s [-o output_dir] [-S stats_file] [-U stats_socket] "\
+                "[-F] [-R session_rate] [-A address_rate] [-M memory_budget] "\
+                "[-g group] [-i iface] [-f protocol:host:port] [-B busy_poll_us] "\
+                "[-C cpu] <protocol> <port>"
 
 int main(int argc, char* argv[]) {
-    if (argc != 3){
-        fatal("Usage: %s <protocol> <port>", argv[0]);
+    server_opts opts = {.output_dir = NULL, .stats_file = NULL, 
+                        .stats_socket = NULL, .b_tcp_tuned = false,
+                        .session_rate = 0, .address_rate = 0,
+                        .memory_budget = 0, .b_mcast = false,
+                        .mcast_iface = {.s_addr = htonl(INADDR_ANY)},
+                        .relay_prot_id = 0, .pin_cpu = -1};
+    int opt;
+    while ((opt = getopt(argc, argv, "o:S:U:FR:A:M:g:i:f:B:C:")) != -1) {
+        if (opt == 'o') {
+            opts.output_dir = optarg;
+        }
+        else if (opt == 'S') {
+            opts.stats_file = optarg;
+        }
+        else if (opt == 'U') {
+            opts.stats_socket = optarg;
+        }
+        else if (opt == 'F') {
+            opts.b_tcp_tuned = true;
+        }
+        else if (opt == 'R') {
+            opts.session_rate = read_rate(optarg);
+        }
+        else if (opt == 'A') {
+            opts.address_rate = read_rate(optarg);
+        }
+        else if (opt == 'M') {
+            opts.memory_budget = read_budget(optarg);
+        }
+        else if (opt == 'g') {
+            opts.mcast_group = read_ipv4(optarg);
+            opts.b_mcast = true;
+        }
+        else if (opt == 'i') {
+            opts.mcast_iface = read_ipv4(optarg);
+        }
+        else if (opt == 'f') {
+            read_relay_target(optarg, &opts);
+        }
+        else if (opt == 'B') {
+            busy_poll_us = read_busy_poll(optarg);
+        }
+        else if (opt == 'C') {
+            opts.pin_cpu = read_cpu(optarg);
+        }
+        else {
+            fatal(USAGE, argv[0]);
+        }
+    }
+
+    if (argc - optind != 2){
+        fatal(USAGE, argv[0]);
     }
-    else if (strcmp(argv[1], TCP_PROT) != 0 && strcmp(argv[1], UDP_PROT)){
-        fatal("Protocol %s is not supported.", argv[1]);
+    const char* protocol = argv[optind];
+    if (strcmp(protocol, TCP_PROT) != 0 && strcmp(protocol, UDP_PROT)){
+        fatal("Protocol %s is not supported.", protocol);
     }
+    else if (opts.b_mcast && strcmp(protocol, UDP_PROT) != 0) {
+        fatal("Only the UDP server joins multicast groups (-g).");
+    }
+    else if (opts.relay_prot_id != 0 && opts.output_dir != NULL) {
+        fatal("A relay (-f) forwards the sessions instead of storing them "
+                "(-o).");
+    }
+
+    uint16_t port = read_port(argv[optind + 1]);
 
-    uint16_t port = read_port(argv[2]);
+    pool_init(opts.memory_budget);
+    start_stats(opts.stats_file, opts.stats_socket);
 
     // Server dispatching.
-    if (strcmp(argv[1], TCP_PROT) == 0) {
-        run_tcp_server(port);
+    if (strcmp(protocol, TCP_PROT) == 0) {
+        run_tcp_server(port, &opts);
     }
     else {
-        run_udp_server(port);
+        run_udp_server(port, &opts);
     }
 }
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "probe.h"
+#include "protconst.h"
+#include "trace.h"
+#include "net.h"
+
+#include <math.h>
+#include <poll.h>
+
+void probe_path(const struct sockaddr_in* server_addr, uint64_t session_id,
+                path_probe* probe) {
+    *probe = (path_probe){.sent = 0, .received = 0, .rtt_ns = 0, 
+                            .bandwidth = 0};
+    int socket_fd = create_socket(UDP_PROT_ID, NULL);
+    char probe_pck[AUTO_PROBE_SIZE];
+    memset(probe_pck, 0, sizeof(probe_pck));
+    PROBE* header = (PROBE*)probe_pck;
+    header->pkt_type_id = PROBE_TYPE;
+    header->session_id = session_id;
+
+    // The train goes out back to back, so the answers come spaced by the 
+    // narrowest link of the path.
+    uint64_t sent_ns[AUTO_PROBE_COUNT];
+    bool b_answered[AUTO_PROBE_COUNT] = {false};
+    for (uint32_t i = 0; i < AUTO_PROBE_COUNT; ++i) {
+        header->probe_nr = htobe32(i);
+        sent_ns[i] = monotonic_ns();
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                net_sendto(socket_fd, probe_pck, sizeof(probe_pck), 0,
+                            (struct sockaddr*)server_addr, 
+                            sizeof(*server_addr)));
+        if (bytes_written != sizeof(probe_pck)) {
+            errno = 0;
+            break;
+        }
+        ++probe->sent;
+    }
+
+    // Wait for the answers. Once some came, the rest is late after a few
+    // more round trips.
+    uint64_t first_ns = 0;
+    uint64_t last_ns = 0;
+    uint64_t deadline_ns = monotonic_ns() + MAX_WAIT * 1000000000ULL;
+    while (probe->received < probe->sent) {
+        uint64_t now_ns = monotonic_ns();
+        struct pollfd pfd = {.fd = socket_fd, .events = POLLIN};
+        if (now_ns >= deadline_ns ||
+            poll(&pfd, 1, (deadline_ns - now_ns) / 1000000 + 1) <= 0) {
+            break;
+        }
+        PROBE answer;
+        ssize_t bytes_read = TRACED(TRACE_RECV,
+                net_recvfrom(socket_fd, &answer, sizeof(answer), 
+                                MSG_DONTWAIT, NULL, NULL));
+        uint64_t received_ns = monotonic_ns();
+        if (bytes_read != sizeof(answer) || 
+            answer.pkt_type_id != PROBE_TYPE ||
+            answer.session_id != session_id ||
+            be32toh(answer.probe_nr) >= probe->sent || 
+            b_answered[be32toh(answer.probe_nr)]) {
+            errno = 0;
+            continue;
+        }
+        uint32_t probe_nr = be32toh(answer.probe_nr);
+        b_answered[probe_nr] = true;
+        ++probe->received;
+        // Probes later in the train waited behind the earlier ones.
+        uint64_t rtt_ns = received_ns - sent_ns[probe_nr];
+        if (probe->rtt_ns == 0 || rtt_ns < probe->rtt_ns) {
+            probe->rtt_ns = rtt_ns;
+        }
+        if (first_ns == 0) {
+            first_ns = received_ns;
+        }
+        last_ns = received_ns;
+        deadline_ns = received_ns + 4 * probe->rtt_ns + 10000000ULL;
+    }
+    if (probe->received > 1 && last_ns > first_ns) {
+        probe->bandwidth = (uint64_t)((probe->received - 1) * 
+                            (double)AUTO_PROBE_SIZE * 1e9 / 
+                            (last_ns - first_ns));
+    }
+    assert_socket_close(socket_fd);
+}
+
+const char* choose_protocol(const path_probe* probe, uint64_t data_length,
+                            client_opts* opts, bool b_pck_size_set) {
+    if (probe->received == 0) {
+        // No UDP server answered, only TCP is left.
+        fprintf(stderr, "auto probes=%" PRIu32 " answered=0 protocol=%s\n",
+                probe->sent, TCP_PROT);
+        return TCP_PROT;
+    }
+
+    double rtt = probe->rtt_ns / 1e9;
+    double loss = 1.0 - (double)probe->received / probe->sent;
+    // Too close to measure, the path is faster than we can send.
+    double bandwidth = probe->bandwidth > 0 ? (double)probe->bandwidth : 
+                                                INFINITY;
+    // A stream is taken for as long as it may get.
+    double length = data_length == STREAM_LENGTH ? 
+                    (double)UINT32_MAX : (double)data_length;
+
+    // UDPR sends a package per round trip, and a lost one waits for the 
+    // timeout. A datagram is lost with any of its fragments, so a lossy 
+    // path gets packages of the size of the probes.
+    uint32_t udpr_pck_size = b_pck_size_set ? opts->pck_size : 
+                                loss > 0 ? AUTO_PROBE_SIZE : PCK_SIZE;
+    double pck_loss = 1.0 - pow(1.0 - loss, 
+                                ceil((double)udpr_pck_size / 
+                                        AUTO_PROBE_SIZE));
+    double udpr_time = rtt + ceil(length / udpr_pck_size) * 
+                        (rtt + pck_loss * MAX_WAIT) + length / bandwidth;
+
+    // Plain UDP doesn't wait for anything, but it can't lose anything.
+    uint32_t pck_size = b_pck_size_set ? opts->pck_size : PCK_SIZE;
+    bool b_udp_safe = loss == 0 && 
+                        length <= (double)AUTO_UDP_MAX_PCKS * pck_size;
+    double udp_time = b_udp_safe ? 2 * rtt + length / bandwidth : INFINITY;
+
+    // The answers came from a UDP server, which takes UDP and UDPR 
+    // sessions only. A server serves a single protocol, so TCP isn't 
+    // an option.
+    const char* protocol = UDPR_PROT;
+    if (udp_time <= udpr_time) {
+        protocol = UDP_PROT;
+    }
+    else {
+        pck_size = udpr_pck_size;
+    }
+    opts->pck_size = pck_size;
+
+    fprintf(stderr, "auto probes=%" PRIu32 " answered=%" PRIu32 
+            " rtt_us=%" PRIu64 " loss=%.3f bandwidth_Bps=%" PRIu64
+            " udpr_ms=%.1f udp_ms=%.1f protocol=%s"
+            " pck_size=%" PRIu32 "\n", probe->sent, probe->received,
+            probe->rtt_ns / 1000, loss, probe->bandwidth,
+            udpr_time * 1e3, udp_time * 1e3, protocol, pck_size);
+    return protocol;
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "common.h"
+#include "err.h"
+
+// What a train of PROBE packages found out about the path to a UDP server.
+typedef struct {
+    uint32_t sent;
+    uint32_t received;
+    // Shortest round trip of a probe, in nanoseconds.
+    uint64_t rtt_ns;
+    // In bytes per second, from the spacing of the answers. 0 if unknown.
+    uint64_t bandwidth;
+} path_probe;
+
+/* Function that sends AUTO_PROBE_COUNT probes back to back to the UDP 
+server at server_addr and measures the path by their answers. */
+void probe_path(const struct sockaddr_in* server_addr, uint64_t session_id,
+                path_probe* probe);
+
+/* Function that picks the protocol expected to deliver data_length bytes
+the fastest over the probed path and returns its name. A server that
+answered the probes takes UDP or UDPR, TCP is picked only if none did. The
+package size is set in opts too, unless b_pck_size_set. The decision is 
+logged to stderr together with the measurements behind it. */
+const char* choose_protocol(const path_probe* probe, uint64_t data_length,
+                            client_opts* opts, bool b_pck_size_set);
+
+#endif
\ No newline at end of file
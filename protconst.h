@@ -4,5 +4,25 @@
 // In seconds
 #define MAX_WAIT 1
 #define MAX_RETRANSMITS 5
+// How long a kept TCP connection may stay idle between sessions.
+#define KEEP_ALIVE_WAIT 10
+// In milliseconds, how long an idle stream waits before it sends an empty 
+// package to keep the session alive.
+#define STREAM_IDLE_WAIT (MAX_WAIT * 1000 / 2)
+// In milliseconds, how often a multicast receiver may report a gap, and how
+// often the sender may repeat a package.
+#define MCAST_NAK_WAIT 5
+// Number of packages a multicast receiver takes between progress reports.
+#define MCAST_STATUS_INTERVAL 16
+// In bytes, the largest receive buffer a UDP server grows its socket to
+// after the kernel dropped packages on it.
+#define UDP_RCVBUF_MAX (64 << 20)
+// Probes sent back to back by ppcbc auto, and their size in bytes, that of
+// a package fitting a common MTU.
+#define AUTO_PROBE_COUNT 32
+#define AUTO_PROBE_SIZE 1400
+// Plain UDP can't recover a lost package, ppcbc auto picks it only for data
+// of at most this many packages over a path that lost no probe.
+#define AUTO_UDP_MAX_PCKS 2
 
 #endif
\ No newline at end of file
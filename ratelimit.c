@@ -0,0 +1,92 @@
+#include "ratelimit.h"
+
+#include <pthread.h>
+
+typedef struct {
+    struct in_addr addr;
+    token_bucket bucket;
+} address_bucket;
+
+pthread_mutex_t address_lock = PTHREAD_MUTEX_INITIALIZER;
+address_bucket address_buckets[RATE_ADDRESSES];
+size_t address_count = 0;
+
+double bucket_size(uint64_t rate) {
+    // A full package has to fit, or it would always wait.
+    double size = (double)rate * RATE_BURST_MS / 1000;
+    return size > PCK_SIZE ? size : PCK_SIZE;
+}
+
+void bucket_init(token_bucket* bucket, uint64_t rate) {
+    bucket->rate = rate;
+    bucket->tokens = bucket_size(rate);
+    bucket->last_ns = monotonic_ns();
+}
+
+uint64_t bucket_take(token_bucket* bucket, uint64_t bytes) {
+    if (bucket->rate == 0) {
+        return 0;
+    }
+    uint64_t now = monotonic_ns();
+    bucket->tokens += (double)(now - bucket->last_ns) * bucket->rate / 1e9;
+    bucket->last_ns = now;
+    if (bucket->tokens > bucket_size(bucket->rate)) {
+        bucket->tokens = bucket_size(bucket->rate);
+    }
+    bucket->tokens -= bytes;
+    if (bucket->tokens >= 0) {
+        return 0;
+    }
+    return (uint64_t)(-bucket->tokens * 1e9 / bucket->rate);
+}
+
+/* Function that finds the bucket of addr, or replaces the one idle for the
+longest time. Called with address_lock held. */
+token_bucket* address_bucket_of(struct in_addr addr, uint64_t rate) {
+    size_t oldest = 0;
+    for (size_t i = 0; i < address_count; ++i) {
+        if (address_buckets[i].addr.s_addr == addr.s_addr) {
+            return &address_buckets[i].bucket;
+        }
+        if (address_buckets[i].bucket.last_ns < 
+            address_buckets[oldest].bucket.last_ns) {
+            oldest = i;
+        }
+    }
+    size_t idx = address_count < RATE_ADDRESSES ? address_count++ : oldest;
+    address_buckets[idx].addr = addr;
+    bucket_init(&address_buckets[idx].bucket, rate);
+    return &address_buckets[idx].bucket;
+}
+
+uint64_t rate_limit(token_bucket* session, struct in_addr addr, 
+                    uint64_t address_rate, uint64_t bytes) {
+    uint64_t wait_ns = bucket_take(session, bytes);
+    if (address_rate > 0) {
+        pthread_mutex_lock(&address_lock);
+        uint64_t address_wait_ns = 
+                bucket_take(address_bucket_of(addr, address_rate), bytes);
+        pthread_mutex_unlock(&address_lock);
+        if (address_wait_ns > wait_ns) {
+            wait_ns = address_wait_ns;
+        }
+    }
+    if (wait_ns > 0) {
+        // Signals cut the wait short, the caller checks for them.
+        struct timespec ts = {.tv_sec = wait_ns / 1000000000ULL, 
+                                .tv_nsec = wait_ns % 1000000000ULL};
+        nanosleep(&ts, NULL);
+    }
+    return wait_ns;
+}
+
+void limit_rcvbuf(int socket_fd, uint64_t rate) {
+    uint64_t bytes = rate * RATE_RCVBUF_MS / 1000;
+    int size = bytes < PCK_SIZE / 2 ? PCK_SIZE / 2 : 
+                bytes > INT_MAX / 2 ? INT_MAX / 2 : (int)bytes;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &size, 
+                    sizeof(size)) < 0) {
+        error("Failed to limit the receive buffer");
+        errno = 0;
+    }
+}
\ No newline at end of file
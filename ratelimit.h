@@ -0,0 +1,52 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <netinet/in.h>
+
+#include "common.h"
+#include "err.h"
+
+// Number of client addresses whose rates are tracked at once. The address
+// idle for the longest time makes room for a new one.
+#define RATE_ADDRESSES 64
+
+// Bytes a session may send at once before the limit applies, in 
+// milliseconds of its rate.
+#define RATE_BURST_MS 100
+
+// Receive buffer of rate limited TCP connections, in milliseconds of the 
+// rate. Clients can't see how much data waits there and give up on the RCVD
+// after MAX_WAIT, so it has to drain quickly.
+#define RATE_RCVBUF_MS 50
+
+// Token bucket holding the bytes a sender may still send. It goes below
+// zero when a package is larger than what's left, the sender then waits
+// for the debt to be paid off.
+typedef struct {
+    // Bytes per second, 0 if unlimited.
+    uint64_t rate;
+    double tokens;
+    // CLOCK_MONOTONIC, in nanoseconds.
+    uint64_t last_ns;
+} token_bucket;
+
+/* Function that initializes a full bucket for rate bytes per second. */
+void bucket_init(token_bucket* bucket, uint64_t rate);
+
+/* Function that takes bytes out of the bucket. Returns how long, in 
+nanoseconds, the sender has to wait before sending more. */
+uint64_t bucket_take(token_bucket* bucket, uint64_t bytes);
+
+/* Function that charges bytes received from addr to the session's bucket
+and to the bucket of the address (limited to address_rate bytes per second,
+shared by all server threads), and sleeps as long as the stricter of the 
+two requires. Returns the time slept, in nanoseconds. */
+uint64_t rate_limit(token_bucket* session, struct in_addr addr, 
+                    uint64_t address_rate, uint64_t bytes);
+
+/* Function that shrinks the receive buffer of TCP connections limited to 
+rate bytes per second to RATE_RCVBUF_MS of the rate (at least half 
+a package, the kernel doubles it). */
+void limit_rcvbuf(int socket_fd, uint64_t rate);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+// For F_SETPIPE_SZ.
+#define _GNU_SOURCE
+
+#include "relay.h"
+#include "protconst.h"
+#include "tcp_client.h"
+#include "udpr_client.h"
+#include "input.h"
+#include "net.h"
+
+#include <fcntl.h>
+#include <signal.h>
+
+void read_relay_target(char* string, server_opts* opts) {
+    char* protocol = strtok(string, ":");
+    char* host = strtok(NULL, ":");
+    char* port = strtok(NULL, ":");
+    if (protocol == NULL || host == NULL || port == NULL || 
+        strtok(NULL, ":") != NULL) {
+        fatal("The downstream server has to be given as protocol:host:port.");
+    }
+    if (strcmp(protocol, TCP_PROT) == 0) {
+        opts->relay_prot_id = TCP_PROT_ID;
+    }
+    else if (strcmp(protocol, UDPR_PROT) == 0) {
+        opts->relay_prot_id = UDPR_PROT_ID;
+    }
+    else {
+        fatal("Sessions can't be relayed over %s.", protocol);
+    }
+    opts->relay_addr = get_server_address(host, read_port(port), 
+                                            opts->relay_prot_id);
+}
+
+void* run_relay(void* arg) {
+    relay* relay = arg;
+    // The receiving thread may be pinned, the relay leaves its core to it.
+    unpin_thread();
+    // Data of known length goes on in full packages, a stream as it comes.
+    relay->opts.input = relay->data_length == STREAM_LENGTH ?
+            start_stream_ring(relay->pipe_fd, relay->opts.pck_size,
+                                RELAY_RING_SLOTS) :
+            start_pipe_ring(relay->pipe_fd, relay->data_length, 
+                            relay->opts.pck_size, RELAY_RING_SLOTS);
+    if (relay->prot_id == TCP_PROT_ID) {
+        int socket_fd = connect_to_server(&relay->server_addr, &relay->opts);
+        relay->b_failed = socket_fd < 0 || 
+                            send_tcp_session(socket_fd, NULL, 
+                                            relay->data_length, &relay->opts,
+                                            NULL);
+        if (socket_fd >= 0) {
+            close(socket_fd);
+        }
+    }
+    else {
+        int socket_fd = create_socket(UDPR_PROT_ID, NULL);
+        set_timeouts(-1, socket_fd, NULL);
+        relay->b_failed = send_udpr_session(socket_fd, &relay->server_addr,
+                                            NULL, relay->data_length, 
+                                            &relay->opts);
+        close(socket_fd);
+    }
+
+    // If the downstream session ended early, the rest of the data can't be
+    // written anymore, which ends the upstream one too.
+    close_input_ring(relay->opts.input);
+    close(relay->pipe_fd);
+    errno = 0;
+    return NULL;
+}
+
+bool open_relay_store(session_store* store, relay* relay, 
+                        const server_opts* opts, uint64_t session_id, 
+                        uint64_t data_length, bool b_resume) {
+    relay->b_active = false;
+    if (b_resume) {
+        // Nothing was persisted, so there is nothing to resume.
+        error("Relayed sessions can't be resumed");
+        return true;
+    }
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        error("Failed to create a pipe");
+        errno = 0;
+        return true;
+    }
+    // A single package, the pipe shouldn't buffer the session.
+    if (fcntl(pipe_fds[1], F_SETPIPE_SZ, PCK_SIZE) < 0) {
+        error("Failed to size the relay pipe");
+        errno = 0;
+    }
+    relay->prot_id = opts->relay_prot_id;
+    relay->server_addr = opts->relay_addr;
+    relay->pipe_fd = pipe_fds[0];
+    relay->data_length = data_length;
+    relay->b_failed = false;
+    relay->opts = (client_opts){.session_id = session_id, .conn_flags = 0,
+                                .b_latency = false, .pck_size = PCK_SIZE,
+                                .input = NULL, .stripe = NULL,
+                                .b_first_flight = false, 
+                                .b_tcp_tuned = false, .b_dedup = false,
+                                .pin_cpu = -1};
+
+    // Signals are for the server threads, their handlers have to interrupt
+    // its calls.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    bool b_failed = pthread_create(&relay->thread, NULL, run_relay, 
+                                    relay) != 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (b_failed) {
+        error("Failed to start the relay");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return true;
+    }
+    relay->b_active = true;
+    open_pipe_store(store, pipe_fds[1], data_length);
+    return false;
+}
+
+bool finish_relay(session_store* store, relay* relay) {
+    if (!relay->b_active) {
+        return false;
+    }
+    // Closing the pipe ends a stream.
+    close_session_store(store);
+    pthread_join(relay->thread, NULL);
+    relay->b_active = false;
+    if (relay->b_failed) {
+        error("The downstream server didn't confirm the session");
+    }
+    return relay->b_failed;
+}
\ No newline at end of file
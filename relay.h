@@ -0,0 +1,51 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "err.h"
+#include "session_store.h"
+
+// Packages of a relayed session between the pipe and its downstream sender.
+#define RELAY_RING_SLOTS 2
+
+// A relaying server forwards every session it accepts to a downstream 
+// server instead of storing it, as a client session of its own. The data 
+// is written by the receiving thread into a pipe and sent on by a separate 
+// thread as it comes. Only the pipe and the input ring of the downstream 
+// session hold it meanwhile, a few packages, so the upstream session is 
+// held back at the pace of the downstream one. Its client then waits for 
+// RCVD only as long as these take to be sent on.
+typedef struct {
+    uint8_t prot_id;
+    struct sockaddr_in server_addr;
+    // The end of the pipe the downstream session reads.
+    int pipe_fd;
+    uint64_t data_length;
+    client_opts opts;
+    // Set once the downstream session ended, if it wasn't confirmed.
+    bool b_failed;
+    // Set while the downstream session runs.
+    bool b_active;
+    pthread_t thread;
+} relay;
+
+/* Utility function to read the downstream server, protocol:host:port, from
+the execution args. Only the reliable protocols, TCP and UDPR, can carry the
+relayed sessions. */
+void read_relay_target(char* string, server_opts* opts);
+
+/* Function that opens the output of a session forwarded to the downstream 
+server of opts, under the same session id. Returns true (after printing 
+the reason) if the session can't be accepted. */
+bool open_relay_store(session_store* store, relay* relay, 
+                        const server_opts* opts, uint64_t session_id, 
+                        uint64_t data_length, bool b_resume);
+
+/* Function that ends the output of a relayed session and waits for the 
+downstream session to end. Returns true if the downstream server didn't 
+confirm the data. Does nothing if the relay isn't active. */
+bool finish_relay(session_store* store, relay* relay);
+
+#endif
\ No newline at end of file
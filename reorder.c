@@ -0,0 +1,38 @@
+#include "reorder.h"
+#include "mempool.h"
+
+void reorder_init(reorder_buffer* reorder) {
+    memset(reorder, 0, sizeof(*reorder));
+}
+
+bool reorder_has(const reorder_buffer* reorder, uint64_t pkt_nr) {
+    uint32_t slot = pkt_nr % REORDER_WINDOW;
+    return reorder->present[slot / 64] & (1ULL << (slot % 64));
+}
+
+void reorder_put(reorder_buffer* reorder, uint64_t pkt_nr, char* buffer,
+                    ssize_t len) {
+    uint32_t slot = pkt_nr % REORDER_WINDOW;
+    reorder->buffers[slot] = buffer;
+    reorder->lengths[slot] = len;
+    reorder->present[slot / 64] |= 1ULL << (slot % 64);
+}
+
+char* reorder_take(reorder_buffer* reorder, uint64_t pkt_nr, ssize_t* len) {
+    if (!reorder_has(reorder, pkt_nr)) {
+        return NULL;
+    }
+    uint32_t slot = pkt_nr % REORDER_WINDOW;
+    reorder->present[slot / 64] &= ~(1ULL << (slot % 64));
+    *len = reorder->lengths[slot];
+    return reorder->buffers[slot];
+}
+
+void reorder_clear(reorder_buffer* reorder) {
+    for (uint32_t slot = 0; slot < REORDER_WINDOW; ++slot) {
+        if (reorder_has(reorder, slot)) {
+            pool_free(reorder->buffers[slot]);
+        }
+    }
+    reorder_init(reorder);
+}
\ No newline at end of file
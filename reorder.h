@@ -0,0 +1,38 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include "common.h"
+
+// How far ahead of the expected package a UDP session may receive.
+// A multiple of 64.
+#define REORDER_WINDOW 64
+
+// Packages of a UDP session that came before the ones preceding them, held
+// until the gap is filled. Package pkt_nr lives in slot pkt_nr % 
+// REORDER_WINDOW, so only the window after the expected package fits.
+typedef struct {
+    char* buffers[REORDER_WINDOW];
+    ssize_t lengths[REORDER_WINDOW];
+    // Bit of a slot set if it holds a package.
+    uint64_t present[REORDER_WINDOW / 64];
+} reorder_buffer;
+
+/* Function that initializes an empty buffer. */
+void reorder_init(reorder_buffer* reorder);
+
+/* Function that checks if package pkt_nr is held already. */
+bool reorder_has(const reorder_buffer* reorder, uint64_t pkt_nr);
+
+/* Function that holds buffer, with package pkt_nr of len bytes. The buffer 
+then belongs to the reorder buffer. */
+void reorder_put(reorder_buffer* reorder, uint64_t pkt_nr, char* buffer,
+                    ssize_t len);
+
+/* Function that takes package pkt_nr out of the buffer and stores its length
+in *len. Returns NULL if it's not held. */
+char* reorder_take(reorder_buffer* reorder, uint64_t pkt_nr, ssize_t* len);
+
+/* Function that gives all the held packages back to the pool. */
+void reorder_clear(reorder_buffer* reorder);
+
+#endif
\ No newline at end of file
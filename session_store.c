@@ -0,0 +1,278 @@
+#include "session_store.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Split transfer being put together by the stripe workers.
+typedef struct {
+    uint64_t group_id;
+    // Bits of the stripes written in full, 0 if the slot is free.
+    uint32_t done_mask;
+} stripe_group;
+
+pthread_mutex_t stripe_groups_lock = PTHREAD_MUTEX_INITIALIZER;
+stripe_group stripe_groups[STRIPE_GROUPS];
+// Slot taken by the next new group.
+size_t stripe_group_next = 0;
+
+/* Function that opens <output_dir>/<session_id>.<suffix> with the open
+flags, its path is stored in path (PATH_MAX bytes). */
+bool open_session_file(int* fd, char* path, const char* output_dir, 
+                                uint64_t session_id, const char* suffix,
+                                int flags) {
+    int len = snprintf(path, PATH_MAX, "%s/%" PRIu64 ".%s",
+                        output_dir, session_id, suffix);
+    if (len < 0 || len >= PATH_MAX) {
+        error("Output path too long");
+        return true;
+    }
+
+    *fd = open(path, flags, 0644);
+    if (*fd < 0 && errno == ENOENT && !(flags & O_CREAT)) {
+        error("Nothing saved to resume from %s", path);
+        errno = 0;
+        return true;
+    }
+    if (*fd < 0) {
+        error("Failed to open %s", path);
+        errno = 0;
+        return true;
+    }
+    return false;
+}
+
+bool write_progress(session_store* store) {
+    if (store->state_fd < 0) {
+        // Stripes are not resumable.
+        return false;
+    }
+    if (pwrite(store->state_fd, &store->progress, sizeof(store->progress), 
+                0) != sizeof(store->progress)) {
+        error("Failed to save session progress");
+        errno = 0;
+        return true;
+    }
+    store->synced_offset = store->progress.byte_offset;
+    return false;
+}
+
+/* Function that saves the progress once the data it covers is on disk. */
+bool checkpoint_progress(session_store* store) {
+    if (fdatasync(store->out_fd) < 0 || write_progress(store) ||
+        fdatasync(store->state_fd) < 0) {
+        error("Failed to checkpoint session progress");
+        errno = 0;
+        return true;
+    }
+    return false;
+}
+
+bool open_session_store(session_store* store, const char* output_dir,
+                        uint64_t session_id, uint64_t data_length,
+                        bool b_resume) {
+    store->out_fd = -1;
+    store->state_fd = -1;
+    store->b_pipe = false;
+    store->out_offset = 0;
+    store->progress = (session_progress){.data_length = data_length,
+                                        .pkt_nr = 0, .byte_offset = 0,
+                                        .checksum = CHECKSUM_INIT,
+                                        .b_complete = false};
+    store->synced_offset = 0;
+    store->stripe_bit = 0;
+    if (output_dir == NULL) {
+        if (b_resume) {
+            // Nothing was persisted, so there is nothing to resume.
+            error("Resume requires an output directory");
+            return true;
+        }
+        return false;
+    }
+
+    // A resume only continues what is already there.
+    int flags = O_RDWR | (b_resume ? 0 : O_CREAT | O_TRUNC);
+    char path[PATH_MAX];
+    if (open_session_file(&store->state_fd, path, output_dir, session_id, 
+                            "state", flags) ||
+        open_session_file(&store->out_fd, path, output_dir, session_id, 
+                            "out", flags)) {
+        close_session_store(store);
+        return true;
+    }
+
+    if (b_resume) {
+        session_progress saved;
+        ssize_t bytes_read = pread(store->state_fd, &saved, 
+                                    sizeof(saved), 0);
+        if (bytes_read != sizeof(saved)) {
+            error("Failed to load the progress of the resumed session");
+            errno = 0;
+            close_session_store(store);
+            return true;
+        }
+        if (saved.data_length != data_length) {
+            error("Resumed session has a different length");
+            close_session_store(store);
+            return true;
+        }
+        store->progress = saved;
+        if (saved.b_complete) {
+            // Delivered already, the client missed the RCVD.
+            store->synced_offset = saved.byte_offset;
+            return false;
+        }
+
+        // Drop anything written after the last saved progress.
+        if (ftruncate(store->out_fd, store->progress.byte_offset) < 0 ||
+            lseek(store->out_fd, 0, SEEK_END) < 0) {
+            error("Failed to restore session output");
+            errno = 0;
+            close_session_store(store);
+            return true;
+        }
+    }
+
+    if (write_progress(store)) {
+        close_session_store(store);
+        return true;
+    }
+    return false;
+}
+
+bool open_stripe_store(session_store* store, const char* output_dir,
+                        uint64_t group_id, uint64_t group_length,
+                        uint64_t offset, uint64_t data_length,
+                        uint16_t stripe_idx, uint16_t stripe_count) {
+    store->out_fd = -1;
+    store->state_fd = -1;
+    store->b_pipe = false;
+    store->out_offset = offset;
+    store->progress = (session_progress){.data_length = data_length,
+                                        .pkt_nr = 0, .byte_offset = 0,
+                                        .checksum = CHECKSUM_INIT,
+                                        .b_complete = false};
+    store->synced_offset = 0;
+    store->group_id = group_id;
+    store->stripe_bit = 1U << stripe_idx;
+    store->stripe_count = stripe_count;
+    if (output_dir == NULL) {
+        // The stripes can't be put together on stdout.
+        error("Split transfers require an output directory");
+        return true;
+    }
+    if (offset > group_length || data_length > group_length - offset) {
+        error("Stripe outside of its payload");
+        return true;
+    }
+
+    // The other stripes may be writing already, keep their data.
+    if (open_session_file(&store->out_fd, store->part_path, output_dir, 
+                            group_id, "out.part", O_RDWR | O_CREAT)) {
+        return true;
+    }
+    if (ftruncate(store->out_fd, group_length) < 0) {
+        error("Failed to size the output of a split transfer");
+        errno = 0;
+        close_session_store(store);
+        return true;
+    }
+    return false;
+}
+
+void open_pipe_store(session_store* store, int pipe_fd, 
+                        uint64_t data_length) {
+    store->out_fd = pipe_fd;
+    store->state_fd = -1;
+    store->b_pipe = true;
+    store->out_offset = 0;
+    store->progress = (session_progress){.data_length = data_length,
+                                        .pkt_nr = 0, .byte_offset = 0,
+                                        .checksum = CHECKSUM_INIT,
+                                        .b_complete = false};
+    store->synced_offset = 0;
+    store->stripe_bit = 0;
+}
+
+bool store_session_data(session_store* store, char* data, size_t len) {
+    if (store->out_fd < 0) {
+        print_data(data, len);
+        ++store->progress.pkt_nr;
+        store->progress.byte_offset += len;
+        return false;
+    }
+
+    // Data goes first, so the saved progress never covers lost bytes.
+    ssize_t bytes_written = store->b_pipe ? 
+            write_n_bytes(store->out_fd, data, len) :
+            pwrite_n_bytes(store->out_fd, data, len, store->out_offset + 
+                            store->progress.byte_offset);
+    if (bytes_written != (ssize_t)len) {
+        error("Failed to write session output");
+        errno = 0;
+        return true;
+    }
+    ++store->progress.pkt_nr;
+    store->progress.byte_offset += len;
+    store->progress.checksum = update_checksum(store->progress.checksum, 
+                                                data, len);
+    if (store->state_fd >= 0 && store->progress.byte_offset - 
+            store->synced_offset >= STATE_SYNC_INTERVAL) {
+        return checkpoint_progress(store);
+    }
+    return false;
+}
+
+/* Function that records the stripe of store as complete. Returns true if
+it was the last one of its payload. */
+bool complete_stripe(const session_store* store) {
+    pthread_mutex_lock(&stripe_groups_lock);
+    stripe_group* group = NULL;
+    for (size_t i = 0; i < STRIPE_GROUPS && group == NULL; ++i) {
+        if (stripe_groups[i].done_mask != 0 && 
+            stripe_groups[i].group_id == store->group_id) {
+            group = &stripe_groups[i];
+        }
+    }
+    if (group == NULL) {
+        group = &stripe_groups[stripe_group_next];
+        stripe_group_next = (stripe_group_next + 1) % STRIPE_GROUPS;
+        *group = (stripe_group){.group_id = store->group_id, .done_mask = 0};
+    }
+    group->done_mask |= store->stripe_bit;
+    bool b_last = group->done_mask == (1U << store->stripe_count) - 1;
+    if (b_last) {
+        group->done_mask = 0;
+    }
+    pthread_mutex_unlock(&stripe_groups_lock);
+    return b_last;
+}
+
+void complete_session_store(session_store* store) {
+    if (store->state_fd >= 0 && !store->progress.b_complete) {
+        store->progress.b_complete = true;
+        checkpoint_progress(store);
+    }
+    if (store->stripe_bit != 0 && complete_stripe(store)) {
+        // Everything but the ".part" suffix.
+        char out_path[PATH_MAX];
+        snprintf(out_path, sizeof(out_path), "%.*s", 
+                    (int)(strlen(store->part_path) - strlen(".part")), 
+                    store->part_path);
+        if (rename(store->part_path, out_path) < 0) {
+            error("Failed to rename %s", store->part_path);
+            errno = 0;
+        }
+    }
+}
+
+void close_session_store(session_store* store) {
+    if (store->out_fd >= 0) {
+        close(store->out_fd);
+        store->out_fd = -1;
+    }
+    if (store->state_fd >= 0) {
+        close(store->state_fd);
+        store->state_fd = -1;
+    }
+}
\ No newline at end of file
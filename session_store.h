@@ -0,0 +1,91 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include "common.h"
+#include "err.h"
+
+// Bytes written between two checkpoints of a resumable session. At a
+// checkpoint the output is synced, then the progress saved and synced, so
+// the saved progress survives a crash of the host too. A resumed session
+// sends again what came after the last checkpoint.
+#define STATE_SYNC_INTERVAL (4 << 20)
+
+// Split transfers the server keeps track of at once. The oldest one is
+// forgotten to make room, its output then never gets the final name.
+#define STRIPE_GROUPS 64
+
+// Progress of a session as persisted in its state file.
+typedef struct __attribute__((__packed__)) {
+    uint64_t data_length;
+    // Number of the next expected package.
+    uint64_t pkt_nr;
+    // Number of bytes already written to the output.
+    uint64_t byte_offset;
+    // Checksum of the first byte_offset bytes.
+    uint32_t checksum;
+    // Set once all the data is on disk, just before RCVD.
+    bool b_complete;
+} session_progress;
+
+// Output of a single session. Without an output directory the data goes
+// to stdout and nothing is persisted.
+typedef struct {
+    int out_fd;
+    int state_fd;
+    // Where the session's data starts in the output file.
+    uint64_t out_offset;
+    // Set if out_fd is a pipe, written in order.
+    bool b_pipe;
+    session_progress progress;
+    // Value of progress.byte_offset at the last checkpoint.
+    uint64_t synced_offset;
+    // Payload a stripe belongs to and its bit among the stripes, 0 if the
+    // session isn't a stripe.
+    uint64_t group_id;
+    uint32_t stripe_bit;
+    uint16_t stripe_count;
+    // Output of the payload until all of its stripes are written.
+    char part_path[PATH_MAX];
+} session_store;
+
+/* Function that opens the output of the given session. If output_dir is set,
+data is written to <output_dir>/<session_id>.out and the progress is kept in
+<output_dir>/<session_id>.state. With b_resume set, the previous progress
+is loaded and the output is cut to the last confirmed byte, a session with
+nothing saved can't be resumed. A complete session is resumed at its end.
+Returns true (after printing the reason) if the session can't be accepted. */
+bool open_session_store(session_store* store, const char* output_dir,
+                        uint64_t session_id, uint64_t data_length,
+                        bool b_resume);
+
+/* Function that opens the output of a session carrying stripe stripe_idx of
+stripe_count of a larger payload. All stripes of group_id write to
+<output_dir>/<group_id>.out.part, each at its own offset. It's renamed to
+<group_id>.out once every stripe is complete, so a payload with a failed
+stripe never looks delivered. Progress is not persisted. Returns true (after
+printing the reason) if the session can't be accepted. */
+bool open_stripe_store(session_store* store, const char* output_dir,
+                        uint64_t group_id, uint64_t group_length,
+                        uint64_t offset, uint64_t data_length,
+                        uint16_t stripe_idx, uint16_t stripe_count);
+
+/* Function that opens the output of a session written to pipe_fd, which
+the store then owns. Progress is not persisted. */
+void open_pipe_store(session_store* store, int pipe_fd, 
+                        uint64_t data_length);
+
+/* Function that writes len bytes of the next package to the session output 
+and persists the progress every STATE_SYNC_INTERVAL bytes. Returns true if
+the write failed. */
+bool store_session_data(session_store* store, char* data, size_t len);
+
+/* Function that finishes a session whose data is all written, just before
+its RCVD. The state is marked complete, so a client that missed the RCVD
+resumes without losing the output. The output of a payload gets its final
+name with the last of its stripes. */
+void complete_session_store(session_store* store);
+
+/* Function that closes the files opened by open_session_store. */
+void close_session_store(session_store* store);
+
+#endif
\ No newline at end of file
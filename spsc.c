@@ -0,0 +1,112 @@
+#include "spsc.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+void futex_wait(_Atomic uint32_t* word, uint32_t value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(_Atomic uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Tells the other side that seq changed, waking it only if it sleeps.
+void ring_notify(_Atomic uint32_t* seq, _Atomic uint32_t* b_waiting) {
+    atomic_fetch_add(seq, 1);
+    if (atomic_load(b_waiting)) {
+        futex_wake(seq);
+    }
+}
+
+void spsc_init(spsc_ring* ring, uint32_t capacity) {
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->produce_seq, 0);
+    atomic_init(&ring->consume_seq, 0);
+    atomic_init(&ring->b_consumer_waiting, 0);
+    atomic_init(&ring->b_producer_waiting, 0);
+    atomic_init(&ring->b_closed, false);
+    atomic_init(&ring->b_cancelled, false);
+}
+
+bool spsc_reserve(spsc_ring* ring, bool b_wait, uint32_t* slot) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire)
+            == ring->capacity) {
+        if (!b_wait || atomic_load(&ring->b_cancelled)) {
+            return false;
+        }
+        // The waiting flag is raised before the last check, so the futex 
+        // never sleeps through a release.
+        atomic_store(&ring->b_producer_waiting, 1);
+        uint32_t seen = atomic_load(&ring->consume_seq);
+        if (head - atomic_load(&ring->tail) == ring->capacity &&
+            !atomic_load(&ring->b_cancelled)) {
+            futex_wait(&ring->consume_seq, seen);
+        }
+        atomic_store(&ring->b_producer_waiting, 0);
+    }
+    if (atomic_load_explicit(&ring->b_cancelled, memory_order_relaxed)) {
+        return false;
+    }
+    *slot = head % ring->capacity;
+    return true;
+}
+
+void spsc_publish(spsc_ring* ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    ring_notify(&ring->produce_seq, &ring->b_consumer_waiting);
+}
+
+bool spsc_peek(spsc_ring* ring, bool b_wait, uint32_t* slot) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        if (!b_wait) {
+            return false;
+        }
+        atomic_store(&ring->b_consumer_waiting, 1);
+        uint32_t seen = atomic_load(&ring->produce_seq);
+        bool b_empty = atomic_load(&ring->head) == tail;
+        if (b_empty && atomic_load(&ring->b_closed)) {
+            atomic_store(&ring->b_consumer_waiting, 0);
+            return false;
+        }
+        if (b_empty) {
+            futex_wait(&ring->produce_seq, seen);
+        }
+        atomic_store(&ring->b_consumer_waiting, 0);
+    }
+    *slot = tail % ring->capacity;
+    return true;
+}
+
+void spsc_release(spsc_ring* ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    ring_notify(&ring->consume_seq, &ring->b_producer_waiting);
+}
+
+void spsc_wait_empty(spsc_ring* ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) != head) {
+        atomic_store(&ring->b_producer_waiting, 1);
+        uint32_t seen = atomic_load(&ring->consume_seq);
+        if (atomic_load(&ring->tail) != head) {
+            futex_wait(&ring->consume_seq, seen);
+        }
+        atomic_store(&ring->b_producer_waiting, 0);
+    }
+}
+
+void spsc_close(spsc_ring* ring) {
+    atomic_store(&ring->b_closed, true);
+    ring_notify(&ring->produce_seq, &ring->b_consumer_waiting);
+}
+
+void spsc_cancel(spsc_ring* ring) {
+    atomic_store(&ring->b_cancelled, true);
+    ring_notify(&ring->consume_seq, &ring->b_producer_waiting);
+}
\ No newline at end of file
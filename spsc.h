@@ -0,0 +1,55 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+
+#include "common.h"
+
+// Index part of a single producer, single consumer ring. The slots live with
+// the user, the ring only hands out their indexes. Both sides run without
+// locks and sleep on a futex only when the ring is empty or full.
+typedef struct {
+    uint32_t capacity;
+    // Number of slots published and released so far.
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    // Bumped after every change of head (tail), the futex words.
+    _Atomic uint32_t produce_seq;
+    _Atomic uint32_t consume_seq;
+    _Atomic uint32_t b_consumer_waiting;
+    _Atomic uint32_t b_producer_waiting;
+    // The producer is done, the consumer gets what is left and then stops.
+    _Atomic bool b_closed;
+    // The consumer is gone, the producer stops waiting for free slots.
+    _Atomic bool b_cancelled;
+} spsc_ring;
+
+/* Function that initializes an empty ring of capacity slots. */
+void spsc_init(spsc_ring* ring, uint32_t capacity);
+
+/* Function that stores in *slot the index of the next slot to fill. If the
+ring is full, it waits for the consumer when b_wait is set. Returns false if
+the ring is full and b_wait is not set or if the ring was cancelled. */
+bool spsc_reserve(spsc_ring* ring, bool b_wait, uint32_t* slot);
+
+/* Function that hands the slot from spsc_reserve to the consumer. */
+void spsc_publish(spsc_ring* ring);
+
+/* Function that stores in *slot the index of the oldest published slot. If 
+the ring is empty, it waits for the producer when b_wait is set. Returns false 
+if the ring is empty and b_wait is not set or if the ring was closed. */
+bool spsc_peek(spsc_ring* ring, bool b_wait, uint32_t* slot);
+
+/* Function that hands the slot from spsc_peek back to the producer. */
+void spsc_release(spsc_ring* ring);
+
+/* Function that waits until the consumer released every published slot. */
+void spsc_wait_empty(spsc_ring* ring);
+
+/* Function that tells the consumer that nothing more will be published. */
+void spsc_close(spsc_ring* ring);
+
+/* Function that tells the producer that nothing more will be released. */
+void spsc_cancel(spsc_ring* ring);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,344 @@
+#include "stats.h"
+#include "mempool.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+
+// All counters of a single thread.
+typedef struct stats_thread {
+    // Counters updated outside of any session.
+    stat_counters idle;
+    // Sum of the counters of all finished sessions.
+    stat_counters finished;
+    session_stats sessions[STATS_HISTORY];
+    _Atomic uint64_t session_count;
+    struct stats_thread* next;
+} stats_thread;
+
+// Sink for updates from threads that didn't register.
+stat_counters stats_unregistered;
+
+_Thread_local stat_counters* stats_current = &stats_unregistered;
+_Thread_local stats_thread* local_stats = NULL;
+
+// Registered threads. The list only grows, the lock is never 
+// taken on the hot path.
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+stats_thread* stats_threads = NULL;
+
+const char* stats_file_path = NULL;
+int stats_socket_fd = -1;
+int stats_signal_fd = -1;
+
+uint64_t load_counter(_Atomic uint64_t* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void fold_counters(stat_counters* dst, stat_counters* src) {
+    stats_add(&dst->bytes, load_counter(&src->bytes));
+    stats_add(&dst->packets, load_counter(&src->packets));
+    stats_add(&dst->rejects, load_counter(&src->rejects));
+    stats_add(&dst->retransmits, load_counter(&src->retransmits));
+    stats_add(&dst->duplicates, load_counter(&src->duplicates));
+    stats_add(&dst->timeouts, load_counter(&src->timeouts));
+    stats_add(&dst->drops, load_counter(&src->drops));
+    stats_add(&dst->kernel_drops, load_counter(&src->kernel_drops));
+    stats_add(&dst->throttled_us, load_counter(&src->throttled_us));
+    stats_add(&dst->blocked_us, load_counter(&src->blocked_us));
+    stats_add(&dst->dedup_bytes, load_counter(&src->dedup_bytes));
+}
+
+void reset_counters(stat_counters* counters) {
+    atomic_store_explicit(&counters->bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->packets, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->rejects, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->retransmits, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->duplicates, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->timeouts, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->drops, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->kernel_drops, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->throttled_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->blocked_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->dedup_bytes, 0, memory_order_relaxed);
+}
+
+void stats_register_thread(void) {
+    if (local_stats != NULL) {
+        return;
+    }
+
+    local_stats = calloc(1, sizeof(stats_thread));
+    assert_null((char*)local_stats, -1, -1, NULL, NULL);
+    stats_current = &local_stats->idle;
+
+    pthread_mutex_lock(&stats_lock);
+    local_stats->next = stats_threads;
+    stats_threads = local_stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_session_begin(uint64_t session_id, uint8_t prot_id) {
+    stats_register_thread();
+
+    uint64_t count = load_counter(&local_stats->session_count);
+    session_stats* session = &local_stats->sessions[count % STATS_HISTORY];
+    // Mark the slot as reused before touching it.
+    atomic_store_explicit(&session->state, 0, memory_order_release);
+    // A snapshot may be reading the slot.
+    reset_counters(&session->counters);
+    atomic_store_explicit(&session->session_id, session_id, 
+                            memory_order_relaxed);
+    atomic_store_explicit(&session->prot_id, prot_id, memory_order_relaxed);
+    atomic_store_explicit(&session->start_ns, monotonic_ns(), 
+                            memory_order_relaxed);
+    atomic_store_explicit(&session->end_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&session->state, STAT_SESSION_ACTIVE, 
+                            memory_order_release);
+    atomic_store_explicit(&local_stats->session_count, count + 1,
+                            memory_order_release);
+
+    stats_current = &session->counters;
+}
+
+void stats_session_end(bool b_completed) {
+    if (local_stats == NULL || stats_current == &local_stats->idle) {
+        return;
+    }
+
+    uint64_t count = load_counter(&local_stats->session_count);
+    session_stats* session = 
+                &local_stats->sessions[(count - 1) % STATS_HISTORY];
+    atomic_store_explicit(&session->end_ns, monotonic_ns(), 
+                            memory_order_relaxed);
+    atomic_store_explicit(&session->state, b_completed ? STAT_SESSION_DONE :
+                            STAT_SESSION_FAILED, memory_order_release);
+    // Only after the state changed, snapshots add up the counters of an
+    // active session themselves.
+    fold_counters(&local_stats->finished, &session->counters);
+
+    stats_current = &local_stats->idle;
+}
+
+void write_counters(FILE* out, stat_counters* counters) {
+    fprintf(out, " bytes=%" PRIu64 " packets=%" PRIu64 " rejects=%" PRIu64
+            " retransmits=%" PRIu64 " duplicates=%" PRIu64 
+            " timeouts=%" PRIu64 " drops=%" PRIu64 " kernel_drops=%" PRIu64
+            " throttled_us=%" PRIu64 " blocked_us=%" PRIu64 
+            " dedup_bytes=%" PRIu64,
+            load_counter(&counters->bytes), load_counter(&counters->packets),
+            load_counter(&counters->rejects), 
+            load_counter(&counters->retransmits),
+            load_counter(&counters->duplicates), 
+            load_counter(&counters->timeouts),
+            load_counter(&counters->drops),
+            load_counter(&counters->kernel_drops),
+            load_counter(&counters->throttled_us),
+            load_counter(&counters->blocked_us),
+            load_counter(&counters->dedup_bytes));
+}
+
+void write_session(FILE* out, session_stats* session, uint64_t now) {
+    int state = atomic_load_explicit(&session->state, memory_order_acquire);
+    const char* state_name = state == STAT_SESSION_ACTIVE ? "active" : 
+                            state == STAT_SESSION_DONE ? "done" : "failed";
+    uint8_t prot_id = atomic_load_explicit(&session->prot_id, 
+                                            memory_order_relaxed);
+    const char* prot_name = prot_id == TCP_PROT_ID ? TCP_PROT : 
+                            prot_id == UDP_PROT_ID ? UDP_PROT : 
+                            prot_id == UDPM_PROT_ID ? UDPM_PROT : UDPR_PROT;
+
+    uint64_t end_ns = state == STAT_SESSION_ACTIVE ? now : 
+                                        load_counter(&session->end_ns);
+    uint64_t duration_ns = end_ns - load_counter(&session->start_ns);
+    uint64_t bytes = load_counter(&session->counters.bytes);
+    uint64_t throughput = duration_ns == 0 ? 0 : 
+                    (uint64_t)((double)bytes * 1e9 / (double)duration_ns);
+
+    fprintf(out, "session id=%" PRIu64 " prot=%s state=%s duration_ms=%" 
+            PRIu64 " throughput_Bps=%" PRIu64, 
+            load_counter(&session->session_id), prot_name, state_name,
+            duration_ns / 1000000, throughput);
+    write_counters(out, &session->counters);
+    fprintf(out, "\n");
+}
+
+void write_stats(int fd) {
+    uint64_t now = monotonic_ns();
+    stat_counters total = {0};
+    uint64_t session_total = 0;
+
+    // The snapshot is put together in memory, so a client slow to read it
+    // doesn't hold the lock new threads register under.
+    char* snapshot = NULL;
+    size_t snapshot_size = 0;
+    FILE* out = open_memstream(&snapshot, &snapshot_size);
+    if (out == NULL) {
+        error("Failed to take a stats snapshot");
+        errno = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    for (stats_thread* th = stats_threads; th != NULL; th = th->next) {
+        fold_counters(&total, &th->idle);
+        fold_counters(&total, &th->finished);
+        uint64_t count = atomic_load_explicit(&th->session_count,
+                                                memory_order_acquire);
+        session_total += count;
+        if (count > 0) {
+            session_stats* last = &th->sessions[(count - 1) % STATS_HISTORY];
+            if (atomic_load_explicit(&last->state, memory_order_acquire) ==
+                STAT_SESSION_ACTIVE) {
+                fold_counters(&total, &last->counters);
+            }
+        }
+    }
+
+    fprintf(out, "total sessions=%" PRIu64, session_total);
+    write_counters(out, &total);
+    fprintf(out, "\n");
+
+    pool_usage usage;
+    pool_get_usage(&usage);
+    fprintf(out, "memory sessions=%" PRIu64 " used_bytes=%" PRIu64 
+            " cached_bytes=%" PRIu64 " reserved_bytes=%" PRIu64 
+            " budget_bytes=%" PRIu64 "\n", usage.sessions, usage.used, 
+            usage.cached, usage.reserved, usage.budget);
+
+    for (stats_thread* th = stats_threads; th != NULL; th = th->next) {
+        uint64_t count = atomic_load_explicit(&th->session_count,
+                                                memory_order_acquire);
+        uint64_t first = count > STATS_HISTORY ? count - STATS_HISTORY : 0;
+        for (uint64_t i = first; i < count; ++i) {
+            session_stats* session = &th->sessions[i % STATS_HISTORY];
+            if (atomic_load_explicit(&session->state, 
+                                    memory_order_acquire) != 0) {
+                write_session(out, session, now);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    if (fclose(out) != 0 || write_n_bytes(fd, snapshot, snapshot_size) != 
+                                (ssize_t)snapshot_size) {
+        error("Failed to write a stats snapshot");
+        errno = 0;
+    }
+    free(snapshot);
+}
+
+void dump_stats_file(void) {
+    // Write a temporary file first, so readers never see a partial snapshot.
+    char tmp_path[PATH_MAX];
+    int len = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_file_path);
+    if (len < 0 || (size_t)len >= sizeof(tmp_path)) {
+        error("Stats path too long");
+        return;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error("Failed to open %s", tmp_path);
+        errno = 0;
+        return;
+    }
+    write_stats(fd);
+    close(fd);
+    if (rename(tmp_path, stats_file_path) < 0) {
+        error("Failed to write %s", stats_file_path);
+        errno = 0;
+    }
+}
+
+void* stats_loop(void* arg) {
+    (void)arg;
+    struct pollfd fds[2] = {{.fd = stats_signal_fd, .events = POLLIN},
+                            {.fd = stats_socket_fd, .events = POLLIN}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syserr("Stats poll failed");
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(stats_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                dump_stats_file();
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            int client_fd = accept(stats_socket_fd, NULL, NULL);
+            if (client_fd >= 0) {
+                write_stats(client_fd);
+                close(client_fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+int setup_stats_socket(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fatal("Stats socket path too long");
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        syserr("Failed to create the stats socket");
+    }
+    // A stale socket from a previous run would make bind fail.
+    unlink(socket_path);
+    if (bind(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(socket_fd, 5) < 0) {
+        close(socket_fd);
+        syserr("Failed to set up the stats socket");
+    }
+    return socket_fd;
+}
+
+void start_stats(const char* stats_file, const char* socket_path) {
+    if (stats_file == NULL && socket_path == NULL) {
+        return;
+    }
+    stats_file_path = stats_file;
+
+    sigset_t usr_mask;
+    sigemptyset(&usr_mask);
+    sigaddset(&usr_mask, SIGUSR1);
+    if (stats_file != NULL) {
+        // SIGUSR1 is taken from the signalfd by the stats thread, 
+        // so no thread may handle it directly.
+        if (pthread_sigmask(SIG_BLOCK, &usr_mask, NULL) != 0) {
+            fatal("Failed to block SIGUSR1");
+        }
+        stats_signal_fd = signalfd(-1, &usr_mask, SFD_CLOEXEC);
+        if (stats_signal_fd < 0) {
+            syserr("Failed to create the stats signalfd");
+        }
+    }
+    if (socket_path != NULL) {
+        stats_socket_fd = setup_stats_socket(socket_path);
+    }
+
+    // The stats thread must not take the signals meant to interrupt 
+    // the server, so it starts with everything blocked.
+    sigset_t all_mask, old_mask;
+    sigfillset(&all_mask);
+    pthread_sigmask(SIG_SETMASK, &all_mask, &old_mask);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, stats_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (err != 0) {
+        fatal("Failed to start the stats thread");
+    }
+    pthread_detach(thread);
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "err.h"
+
+// Number of finished sessions kept per thread for the snapshots.
+#define STATS_HISTORY 16
+
+#define STAT_SESSION_ACTIVE 1
+#define STAT_SESSION_DONE 2
+#define STAT_SESSION_FAILED 3
+
+// Counters are written only by the thread that owns them, so updates are
+// plain relaxed loads and stores. Readers may see a slightly stale value.
+typedef struct {
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t packets;
+    // RJT and CONRJT packages sent.
+    _Atomic uint64_t rejects;
+    // ACC and CONACC retransmissions after a timeout.
+    _Atomic uint64_t retransmits;
+    // Packages that were received more than once.
+    _Atomic uint64_t duplicates;
+    _Atomic uint64_t timeouts;
+    // Packages lost before reaching us.
+    _Atomic uint64_t drops;
+    // Packages the kernel dropped for a full socket receive buffer, a part 
+    // of the ones lost.
+    _Atomic uint64_t kernel_drops;
+    // Time reads and ACCs were held back by the rate limits, in microseconds.
+    _Atomic uint64_t throttled_us;
+    // Time reads and ACCs were held back by a full output queue, in 
+    // microseconds.
+    _Atomic uint64_t blocked_us;
+    // Bytes of deduplicated sessions taken from the chunk store instead
+    // of the network.
+    _Atomic uint64_t dedup_bytes;
+} stat_counters;
+
+typedef struct {
+    _Atomic uint64_t session_id;
+    _Atomic uint8_t prot_id;
+    _Atomic int state;
+    // CLOCK_MONOTONIC, in nanoseconds.
+    _Atomic uint64_t start_ns;
+    _Atomic uint64_t end_ns;
+    stat_counters counters;
+} session_stats;
+
+// Counters of the thread that is currently executing. Points to the active 
+// session, or to counters not tied to any session.
+extern _Thread_local stat_counters* stats_current;
+
+/* Function that adds n to the given counter of the thread's current 
+session, e.g. stats_add(&stats_current->bytes, n). */
+static inline void stats_add(_Atomic uint64_t* counter, uint64_t n) {
+    atomic_store_explicit(counter, 
+                    atomic_load_explicit(counter, memory_order_relaxed) + n,
+                    memory_order_relaxed);
+}
+
+/* Function that gives the calling thread its own counters. Has to be called
+by every thread that updates them, before the first update. */
+void stats_register_thread(void);
+
+/* Function that starts counting a new session in the calling thread. */
+void stats_session_begin(uint64_t session_id, uint8_t prot_id);
+
+/* Function that ends the current session of the calling thread. */
+void stats_session_end(bool b_completed);
+
+/* Function that writes a text snapshot of all counters to fd. */
+void write_stats(int fd);
+
+/* Function that starts a thread serving the snapshots. If stats_file is set,
+a snapshot is written there on SIGUSR1. If socket_path is set, a snapshot is 
+sent to every client connecting to that UNIX socket. */
+void start_stats(const char* stats_file, const char* socket_path);
+
+#endif
\ No newline at end of file
@@ -1,7 +1,14 @@
 #include "tcp_client.h"
 #include "protconst.h"
+#include "trace.h"
+#include "latency.h"
+#include "input.h"
+#include "dedup.h"
 
 #include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 bool volatile b_was_tcp_cl_interrupted = false;
 
@@ -9,72 +16,286 @@ void tcp_cl_handler() {
     b_was_tcp_cl_interrupted = true;
 }
 
-void run_tcp_client(struct sockaddr_in* server_addr, char* data, 
-                    uint64_t data_length, uint64_t session_id) {
-    // Ignore SIGPIPE signals.
-    signal(SIGPIPE, SIG_IGN);
-    ignore_signal(tcp_cl_handler, SIGINT);
+/* Function that sends data_length bytes of a deduplicated session. The data
+is cut into chunks, batch by batch. Every batch is listed in a DIGESTS 
+package and only the chunks the server asks for are sent. Returns true if
+the session failed. */
+bool send_dedup_data(int socket_fd, char* data, uint64_t data_length,
+                        const client_opts* opts) {
+    uint64_t session_id = opts->session_id;
+    size_t hdr_size = sizeof(DATA) - sizeof(char*);
+    // A whole input chunk is taken even when it doesn't fit the batch.
+    char* batch = malloc(DEDUP_BATCH_SIZE + PCK_SIZE);
+    char* pck = malloc(hdr_size + PCK_SIZE);
+    CHUNK_REF* refs = malloc(MAX_CHUNK_REFS * sizeof(CHUNK_REF));
+    if (batch == NULL || pck == NULL || refs == NULL) {
+        free(data);
+        fatal("Out of memory");
+    }
 
-    // Create a socket with IPv4 protocol.
-    int socket_fd = create_socket(TCP_PROT_ID, data);
+    const char* data_ptr = data;
+    size_t fill = 0;
+    uint64_t pck_number = 0;
+    bool b_connection_closed = false;
+    while ((data_length > 0 || fill > 0) && !b_connection_closed && 
+            !b_was_tcp_cl_interrupted) {
+        while (fill < DEDUP_BATCH_SIZE && data_length > 0) {
+            uint32_t len = calc_pck_size(data_length, opts->pck_size);
+            const char* chunk = input_next(opts->input, &data_ptr, &len);
+            if (chunk == NULL) {
+                // The input ended early, the reader reported it.
+                b_connection_closed = true;
+                break;
+            }
+            memcpy(batch + fill, chunk, len);
+            input_release(opts->input);
+            fill += len;
+            data_length -= len;
+        }
+        if (b_connection_closed) {
+            break;
+        }
 
-    // Connect to the server.
-    if (connect(socket_fd, (struct sockaddr*)server_addr,
-                (socklen_t) sizeof(*server_addr)) < 0) {
-        free(data);
-        assert_socket_close(socket_fd);
-        syserr("Client failed to connect to the server");
+        // The last chunk of the batch waits for more data, unless the input
+        // ended.
+        size_t ref_count = 0;
+        size_t cut = 0;
+        while (ref_count < MAX_CHUNK_REFS && cut < fill) {
+            size_t len = find_chunk(batch + cut, fill - cut, 
+                                    data_length == 0);
+            if (len == 0) {
+                break;
+            }
+            sha256(batch + cut, len, refs[ref_count].digest);
+            refs[ref_count].length = htobe32(len);
+            ++ref_count;
+            cut += len;
+        }
+
+        // List the chunks and learn which ones the server lacks.
+        uint32_t refs_size = ref_count * sizeof(CHUNK_REF);
+        init_data_pck(session_id, htobe64(pck_number), htobe32(refs_size), 
+                        pck, (char*)refs);
+        ((DATA*)pck)->pkt_type_id = DIGESTS_TYPE;
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                write_n_bytes(socket_fd, pck, hdr_size + refs_size));
+        b_connection_closed = assert_write(bytes_written, 
+                                            hdr_size + refs_size, socket_fd,
+                                            -1, NULL, data);
+        // An RJT is shorter than the MISSING header, its prefix comes first.
+        DATA missing;
+        ssize_t bytes_read = -1;
+        if (!b_connection_closed) {
+            bytes_read = TRACED(TRACE_RECV,
+                    read_n_bytes(socket_fd, &missing, sizeof(RCVD)));
+            b_connection_closed = assert_read(bytes_read, sizeof(RCVD), 
+                                                socket_fd, -1, NULL, data);
+        }
+        if (!b_connection_closed && missing.pkt_type_id != MISSING_TYPE) {
+            // Rejected, or something we can't make sense of.
+            get_nonudpr_rcvd((RCVD*)&missing, session_id);
+            b_connection_closed = true;
+        }
+        if (!b_connection_closed) {
+            bytes_read = TRACED(TRACE_RECV,
+                    read_n_bytes(socket_fd, (char*)&missing + sizeof(RCVD),
+                                    hdr_size - sizeof(RCVD)));
+            b_connection_closed = assert_read(bytes_read, 
+                                                hdr_size - sizeof(RCVD),
+                                                socket_fd, -1, NULL, data);
+        }
+        if (!b_connection_closed && 
+            !is_missing(&missing, session_id, pck_number, ref_count)) {
+            error("Invalid package");
+            b_connection_closed = true;
+        }
+        uint8_t bitmap[(MAX_CHUNK_REFS + 7) / 8];
+        if (!b_connection_closed) {
+            bytes_read = TRACED(TRACE_RECV,
+                    read_n_bytes(socket_fd, bitmap, (ref_count + 7) / 8));
+            b_connection_closed = assert_read(bytes_read, 
+                                                (ref_count + 7) / 8, 
+                                                socket_fd, -1, NULL, data);
+        }
+        ++pck_number;
+
+        // Send what's missing.
+        size_t offset = 0;
+        for (size_t i = 0; i < ref_count && !b_connection_closed; ++i) {
+            uint32_t len = be32toh(refs[i].length);
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                init_data_pck(session_id, htobe64(pck_number), htobe32(len),
+                                pck, batch + offset);
+                bytes_written = TRACED(TRACE_SEND,
+                        write_n_bytes(socket_fd, pck, hdr_size + len));
+                b_connection_closed = assert_write(bytes_written, 
+                                                    hdr_size + len, 
+                                                    socket_fd, -1, NULL, 
+                                                    data);
+                ++pck_number;
+            }
+            offset += len;
+        }
+
+        memmove(batch, batch + cut, fill - cut);
+        fill -= cut;
     }
 
-    // Set timeouts for the server.
-    set_timeouts(-1, socket_fd, data);
+    free(batch);
+    free(pck);
+    free(refs);
+    return b_connection_closed;
+}
 
+/* Function that tells if the result of a CONN exchange shows a connection
+closed by the server. It's noted in b_dropped, if set. */
+bool is_conn_dropped(ssize_t result, bool* b_dropped) {
+    if (b_dropped == NULL || 
+        !(result == 0 || (result < 0 && 
+                            (errno == EPIPE || errno == ECONNRESET)))) {
+        return false;
+    }
+    error("Connection closed by the server");
+    errno = 0;
+    *b_dropped = true;
+    return true;
+}
+
+bool send_tcp_session(int socket_fd, char* data, uint64_t data_length,
+                        const client_opts* opts, bool* b_dropped) {
+    uint64_t session_id = opts->session_id;
     bool b_connection_closed = false;
     ssize_t bytes_written = -1;
+    uint64_t conn_sent_ns = 0;
     if (!b_was_tcp_cl_interrupted) {
         // Send a CONN package to mark the beginning of the connection.
+        // A striped session sends its STRIPE right behind it.
+        uint8_t stripe_flag = opts->stripe != NULL ? CONN_FLAG_STRIPE : 0;
         CONN connect_data = {.pkt_type_id = CONN_TYPE, 
-                            .session_id = session_id, .prot_id = TCP_PROT_ID, 
+                            .session_id = session_id, 
+                            .prot_id = TCP_PROT_ID | opts->conn_flags |
+                                        stripe_flag, 
                             .data_length = htobe64(data_length)};
-        bytes_written = write_n_bytes(socket_fd, &connect_data,
-                                        sizeof(connect_data));
-        b_connection_closed = assert_write(bytes_written,
-                                            sizeof(connect_data), socket_fd,
-                                            -1, NULL, data);
+        char conn_pck[sizeof(CONN) + sizeof(STRIPE)];
+        size_t conn_size = sizeof(CONN);
+        memcpy(conn_pck, &connect_data, sizeof(connect_data));
+        if (opts->stripe != NULL) {
+            memcpy(conn_pck + conn_size, opts->stripe, sizeof(STRIPE));
+            conn_size += sizeof(STRIPE);
+        }
+        conn_sent_ns = realtime_ns();
+        bytes_written = TRACED(TRACE_SEND,
+                write_n_bytes(socket_fd, conn_pck, conn_size));
+        b_connection_closed = is_conn_dropped(bytes_written, b_dropped) ||
+                                assert_write(bytes_written, conn_size, 
+                                            socket_fd, -1, NULL, data);
+        if (opts->b_latency) {
+            conn_sent_ns = tx_timestamp(socket_fd, conn_sent_ns);
+        }
     }
 
     
-    CONACC con_ack_data;
+    char con_ack_data[sizeof(RESACC)];
+    ssize_t ack_size = sizeof(CONACC);
+    uint64_t pck_number = 0;
+    uint64_t data_offset = 0;
     if (!b_connection_closed){
         // Read a CONACC package but only 
         // if we managed to send the CONN package.
-        ssize_t bytes_read = read_n_bytes(socket_fd, &con_ack_data, 
-                                sizeof(con_ack_data));
-        b_connection_closed = assert_read(bytes_read, sizeof(con_ack_data),
+        uint64_t conacc_rx_ns = 0;
+        ssize_t bytes_read;
+        if (opts->b_latency) {
+            // CONACC is a single segment, so its kernel timestamp
+            // comes with this read.
+            bytes_read = TRACED(TRACE_RECV, 
+                    recvfrom_ts(socket_fd, con_ack_data, sizeof(CONACC), 
+                                MSG_WAITALL, NULL, NULL, &conacc_rx_ns));
+        }
+        else {
+            bytes_read = TRACED(TRACE_RECV,
+                    read_n_bytes(socket_fd, con_ack_data, 
+                                    sizeof(CONACC)));
+        }
+        b_connection_closed = is_conn_dropped(bytes_read, b_dropped) ||
+                                assert_read(bytes_read, sizeof(CONACC),
                                             socket_fd, -1, NULL, data);
+        if (!b_connection_closed && opts->b_latency) {
+            record_rtt(&conn_rtt_hist, conn_sent_ns, conacc_rx_ns);
+        }
+        if (!b_connection_closed && opts->b_tcp_tuned) {
+            quick_ack(socket_fd);
+        }
+        if (!b_connection_closed && 
+            ((RESACC*)con_ack_data)->pkt_type_id == RESACC_TYPE) {
+            // RESACC carries the resume point after the CONACC fields.
+            ack_size = sizeof(RESACC);
+            bytes_read = TRACED(TRACE_RECV, read_n_bytes(socket_fd, 
+                                    con_ack_data + sizeof(CONACC),
+                                    sizeof(RESACC) - sizeof(CONACC)));
+            b_connection_closed = assert_read(bytes_read, 
+                                        sizeof(RESACC) - sizeof(CONACC),
+                                        socket_fd, -1, NULL, data);
+        }
         if (!b_connection_closed) {
-            b_connection_closed = get_connac_pck(&con_ack_data, session_id);
+            b_connection_closed = get_conn_resp(con_ack_data, ack_size, 
+                                                opts, data, data_length,
+                                                &pck_number, &data_offset);
         }
     }
 
     // If w managed to both send CONN and receive CONACK, we can proceed
     // to the data transfer.
-    if (!b_connection_closed && con_ack_data.pkt_type_id == CONACC_TYPE &&
-        con_ack_data.session_id == session_id) {
-        uint64_t pck_number = 0;
-        const char* data_ptr = data;
-        while(data_length > 0 && !b_connection_closed) {
-            uint32_t curr_len = calc_pck_size(data_length);
+    if (!b_connection_closed) {
+        // A stream goes on until the input ends, and then sends EOS.
+        bool b_stream = data_length == STREAM_LENGTH;
+        const char* data_ptr = data + data_offset;
+        data_length -= data_offset;
+        if (opts->b_dedup) {
+            b_connection_closed = send_dedup_data(socket_fd, data, 
+                                                    data_length, opts);
+            data_length = 0;
+        }
+        while((data_length > 0 || b_stream) && !b_connection_closed) {
+            uint32_t curr_len = calc_pck_size(data_length, opts->pck_size);
             // Initialize a package.
             size_t pck_size = sizeof(DATA) - sizeof(char*) + curr_len;
             char* data_pck = malloc(pck_size);
             assert_null(data_pck, socket_fd, -1, NULL, data);
 
-            init_data_pck(session_id, htobe64(pck_number), 
-                                    htobe32(curr_len), data_pck, data_ptr);
+            const char* chunk = input_next(opts->input, &data_ptr, &curr_len);
+            if (chunk == NULL && b_stream && !input_failed(opts->input)) {
+                pck_size = init_eos_pck(TCP_PROT_ID, opts, pck_number, 
+                                        data_pck);
+                bytes_written = TRACED(TRACE_SEND,
+                        write_n_bytes(socket_fd, data_pck, pck_size));
+                b_connection_closed = assert_write(bytes_written, pck_size, 
+                                                socket_fd, -1, data_pck, data);
+                if (!b_connection_closed) {
+                    free(data_pck);
+                }
+                break;
+            }
+            if (chunk == NULL) {
+                // The input ended early, the reader reported it.
+                free(data_pck);
+                b_connection_closed = true;
+                break;
+            }
+            pck_size = sizeof(DATA) - sizeof(char*) + curr_len;
+            if (opts->conn_flags & CONN_FLAG_COMPACT) {
+                pck_size = init_cdata_pck(TCP_PROT_ID, session_id, pck_number,
+                                        curr_len, data_pck, chunk) + curr_len;
+            }
+            else {
+                init_data_pck(session_id, htobe64(pck_number), 
+                                htobe32(curr_len), data_pck, chunk);
+            }
+            // The package holds its own copy now.
+            input_release(opts->input);
 
             // Send the package to the server.
-            bytes_written = write_n_bytes(socket_fd, data_pck, pck_size);
+            bytes_written = TRACED(TRACE_SEND,
+                    write_n_bytes(socket_fd, data_pck, pck_size));
             if (bytes_written == -1 && errno == 104) {
                 // Server closed the connection.
                 free(data_pck);
@@ -88,8 +309,9 @@ void run_tcp_client(struct sockaddr_in* server_addr, char* data,
             if (!b_connection_closed) {
                 // Update invariants.
                 ++pck_number;
-                data_ptr += curr_len;
-                data_length -= curr_len;
+                if (!b_stream) {
+                    data_length -= curr_len;
+                }
                 free(data_pck);
             }
         }
@@ -97,8 +319,22 @@ void run_tcp_client(struct sockaddr_in* server_addr, char* data,
         if (!b_connection_closed) {
             // Exited the data-sending loop, now we wait for the RCVD/RJT.
             RCVD recv_data_ack;
-            ssize_t bytes_read = read_n_bytes(socket_fd, &recv_data_ack,
-                    sizeof(recv_data_ack));
+            ssize_t bytes_read = TRACED(TRACE_RECV,
+                    read_n_bytes(socket_fd, &recv_data_ack,
+                    sizeof(recv_data_ack)));
+            // The server may still be taking in what we sent, e.g. when it
+            // limits our rate. Wait for as long as our queue shrinks.
+            int queued = INT_MAX;
+            int now_queued;
+            while (bytes_read < 0 && errno == EAGAIN && 
+                    ioctl(socket_fd, SIOCOUTQ, &now_queued) == 0 && 
+                    now_queued > 0 && now_queued < queued) {
+                errno = 0;
+                queued = now_queued;
+                bytes_read = TRACED(TRACE_RECV,
+                        read_n_bytes(socket_fd, &recv_data_ack,
+                        sizeof(recv_data_ack)));
+            }
             b_connection_closed = assert_read(bytes_read, 
                                             sizeof(recv_data_ack),
                                                 socket_fd, -1, NULL, data);
@@ -109,5 +345,130 @@ void run_tcp_client(struct sockaddr_in* server_addr, char* data,
         }
     }
     
+    return b_connection_closed;
+}
+
+int connect_to_server(struct sockaddr_in* server_addr, 
+                        const client_opts* opts) {
+    int socket_fd = create_socket(TCP_PROT_ID, NULL);
+    if (opts->b_latency) {
+        enable_timestamping(socket_fd);
+    }
+    if (opts->b_tcp_tuned) {
+        enable_fastopen_connect(socket_fd);
+        tune_tcp_socket(socket_fd);
+    }
+    if (connect(socket_fd, (struct sockaddr*)server_addr,
+                (socklen_t) sizeof(*server_addr)) < 0) {
+        error("Client failed to connect to the server");
+        errno = 0;
+        close(socket_fd);
+        return -1;
+    }
+    set_timeouts(-1, socket_fd, NULL);
+    return socket_fd;
+}
+
+void run_tcp_client(struct sockaddr_in* server_addr, char* data, 
+                    uint64_t data_length, const client_opts* opts) {
+    // Ignore SIGPIPE signals.
+    signal(SIGPIPE, SIG_IGN);
+    ignore_signal(tcp_cl_handler, SIGINT);
+
+    // Create a socket with IPv4 protocol.
+    int socket_fd = create_socket(TCP_PROT_ID, data);
+    if (opts->b_latency) {
+        enable_timestamping(socket_fd);
+    }
+    if (opts->b_tcp_tuned) {
+        // The CONN written first goes out in the SYN.
+        enable_fastopen_connect(socket_fd);
+        tune_tcp_socket(socket_fd);
+    }
+
+    // Connect to the server.
+    if (connect(socket_fd, (struct sockaddr*)server_addr,
+                (socklen_t) sizeof(*server_addr)) < 0) {
+        free(data);
+        assert_socket_close(socket_fd);
+        syserr("Client failed to connect to the server");
+    }
+
+    // Set timeouts for the server.
+    set_timeouts(-1, socket_fd, data);
+
+    send_tcp_session(socket_fd, data, data_length, opts, NULL);
     assert_socket_close(socket_fd);
+}
+
+// A single session of a striped transfer.
+typedef struct {
+    struct sockaddr_in* server_addr;
+    // Own copy of the part, NULL if it's read from a file.
+    char* data;
+    uint64_t data_length;
+    client_opts opts;
+    STRIPE stripe;
+    pthread_t thread;
+} tcp_stripe;
+
+void* run_tcp_stripe(void* arg) {
+    tcp_stripe* stripe = arg;
+    run_tcp_client(stripe->server_addr, stripe->data, stripe->data_length,
+                    &stripe->opts);
+    return NULL;
+}
+
+void run_tcp_stripes(struct sockaddr_in* server_addr, char* data,
+                        uint64_t data_length, int input_fd, off_t input_pos,
+                        const client_opts* opts, uint16_t stripe_count) {
+    if (stripe_count > data_length) {
+        // Every stripe carries at least a byte.
+        stripe_count = data_length;
+    }
+    if (stripe_count <= 1 && data != NULL) {
+        run_tcp_client(server_addr, data, data_length, opts);
+        return;
+    }
+
+    tcp_stripe stripes[MAX_STRIPES];
+    for (uint16_t i = 0; i < stripe_count; ++i) {
+        tcp_stripe* stripe = &stripes[i];
+        uint64_t begin = data_length / stripe_count * i;
+        uint64_t end = i + 1 == stripe_count ? data_length : 
+                                        data_length / stripe_count * (i + 1);
+        stripe->server_addr = server_addr;
+        stripe->data_length = end - begin;
+        stripe->stripe = (STRIPE){.group_id = htobe64(opts->session_id),
+                                .group_length = htobe64(data_length),
+                                .offset = htobe64(begin),
+                                .stripe_idx = htobe16(i),
+                                .stripe_count = htobe16(stripe_count)};
+        stripe->opts = *opts;
+        stripe->opts.session_id = opts->session_id + i;
+        stripe->opts.stripe = &stripe->stripe;
+        if (data != NULL) {
+            // run_tcp_client frees its data when it fails.
+            stripe->data = malloc(stripe->data_length);
+            assert_null(stripe->data, -1, -1, NULL, NULL);
+            memcpy(stripe->data, data + begin, stripe->data_length);
+            stripe->opts.input = NULL;
+        }
+        else {
+            stripe->data = NULL;
+            stripe->opts.input = start_input_ring(input_fd, input_pos + begin,
+                                                    stripe->data_length,
+                                                    opts->pck_size);
+        }
+        if (pthread_create(&stripe->thread, NULL, run_tcp_stripe, 
+                            stripe) != 0) {
+            fatal("Failed to start a stream");
+        }
+    }
+
+    for (uint16_t i = 0; i < stripe_count; ++i) {
+        pthread_join(stripes[i].thread, NULL);
+        free(stripes[i].data);
+        close_input_ring(stripes[i].opts.input);
+    }
 }
\ No newline at end of file
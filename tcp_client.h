@@ -1,12 +1,32 @@
-#ifndef TCP_SERVER_H
-#define TCP_SERVER_H
+#ifndef TCP_CLIENT_H
+#define TCP_CLIENT_H
 
 #include <arpa/inet.h>
 
 #include "common.h"
 #include "err.h"
 
+/* Function that sends data_length bytes as a single session over the 
+connected socket_fd and waits for RCVD. The connection stays open. Returns 
+true if the session failed. If b_dropped is set, a connection the server 
+closed before answering CONN is reported there instead of ending the 
+client, the server then never took the session. */
+bool send_tcp_session(int socket_fd, char* data, uint64_t data_length,
+                        const client_opts* opts, bool* b_dropped);
+
+/* Function that opens a new connection to the server. Returns -1 (after
+printing the reason) if it failed. */
+int connect_to_server(struct sockaddr_in* server_addr, 
+                        const client_opts* opts);
+
 void run_tcp_client(struct sockaddr_in* server_addr, char* data,
-                    uint64_t data_length, uint64_t session_id);
+                    uint64_t data_length, const client_opts* opts);
+
+/* Function that sends data_length bytes over stripe_count TCP sessions in
+parallel, each carrying a contiguous part of the data. The data is either in
+memory or, if data is NULL, in the file input_fd from input_pos on. */
+void run_tcp_stripes(struct sockaddr_in* server_addr, char* data,
+                        uint64_t data_length, int input_fd, off_t input_pos,
+                        const client_opts* opts, uint16_t stripe_count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "tcp_daemon.h"
+#include "tcp_client.h"
+#include "protconst.h"
+#include "latency.h"
+
+#include <signal.h>
+#include <sys/un.h>
+
+#define DAEMON_QUEUE_LENGTH 50
+
+bool volatile b_was_daemon_interrupted = false;
+
+void daemon_handler() {
+    b_was_daemon_interrupted = true;
+}
+
+/* Function that fills a UNIX socket address. Returns true if the path
+doesn't fit. */
+bool init_unix_addr(struct sockaddr_un* addr, const char* socket_path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        error("Socket path too long");
+        return true;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return false;
+}
+
+void run_tcp_daemon(struct sockaddr_in* server_addr, const char* socket_path,
+                    const client_opts* opts) {
+    // Ignore SIGPIPE signals.
+    signal(SIGPIPE, SIG_IGN);
+    ignore_signal(daemon_handler, SIGINT);
+
+    struct sockaddr_un local_addr;
+    if (init_unix_addr(&local_addr, socket_path)) {
+        exit(1);
+    }
+    int local_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (local_fd < 0) {
+        syserr("Failed to create a socket.");
+    }
+    // Take over the socket left by an earlier daemon.
+    unlink(socket_path);
+    errno = 0;
+    if (bind(local_fd, (struct sockaddr*)&local_addr, 
+                sizeof(local_addr)) < 0 ||
+        listen(local_fd, DAEMON_QUEUE_LENGTH) < 0) {
+        assert_socket_close(local_fd);
+        syserr("Failed to listen on %s", socket_path);
+    }
+
+    // Every message is a session of its own on the kept connection.
+    client_opts session_opts = *opts;
+    session_opts.conn_flags |= CONN_FLAG_KEEP;
+    int server_fd = -1;
+    while (!b_was_daemon_interrupted) {
+        int msg_fd = accept(local_fd, NULL, NULL);
+        if (msg_fd < 0) {
+            if (errno != EINTR) {
+                error("Failed to accept a message");
+            }
+            errno = 0;
+            continue;
+        }
+
+        uint64_t msg_length = 0;
+        char* msg = read_all(msg_fd, &msg_length);
+        bool b_failed = true;
+        if (msg == NULL) {
+            error("Failed to read a message");
+            errno = 0;
+        }
+        // The server drops a connection that stays idle for too long, so 
+        // a kept connection found closed before CONACC is retried on a new 
+        // one. A later failure may come after the server took the message,
+        // sending it again could deliver it twice.
+        for (int attempt = 0; msg != NULL && b_failed && attempt < 2 &&
+                                !b_was_daemon_interrupted; ++attempt) {
+            bool b_warm = server_fd >= 0;
+            if (!b_warm) {
+                server_fd = connect_to_server(server_addr, opts);
+            }
+            if (server_fd < 0) {
+                break;
+            }
+            bool b_dropped = false;
+            b_failed = send_tcp_session(server_fd, msg, msg_length, 
+                                        &session_opts, &b_dropped);
+            ++session_opts.session_id;
+            if (b_failed) {
+                close(server_fd);
+                server_fd = -1;
+                errno = 0;
+                if (!b_warm || !b_dropped) {
+                    break;
+                }
+            }
+        }
+
+        char status = b_failed ? 1 : 0;
+        if (write_n_bytes(msg_fd, &status, sizeof(status)) < 0) {
+            errno = 0;
+        }
+        close(msg_fd);
+        free(msg);
+    }
+
+    if (server_fd >= 0) {
+        assert_socket_close(server_fd);
+    }
+    assert_socket_close(local_fd);
+    unlink(socket_path);
+}
+
+bool submit_to_daemon(const char* socket_path, char* data, 
+                        uint64_t data_length) {
+    struct sockaddr_un addr;
+    if (init_unix_addr(&addr, socket_path)) {
+        return true;
+    }
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        syserr("Failed to create a socket.");
+    }
+    if (connect(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(socket_fd);
+        syserr("Failed to connect to the daemon");
+    }
+
+    // The message ends where our half of the connection does.
+    char status = 1;
+    if (write_n_bytes(socket_fd, data, data_length) != (ssize_t)data_length ||
+        shutdown(socket_fd, SHUT_WR) < 0 ||
+        read_n_bytes(socket_fd, &status, sizeof(status)) != 
+                                                    sizeof(status)) {
+        error("Failed to pass the message to the daemon");
+        errno = 0;
+        status = 1;
+    }
+    close(socket_fd);
+    return status != 0;
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef TCP_DAEMON_H
+#define TCP_DAEMON_H
+
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "err.h"
+
+/* Function that serves messages sent to the UNIX socket socket_path, until
+SIGINT. Every connection to the socket carries one message, ended by EOF. It
+is sent as a session over a single TCP connection to the server, kept open
+between the messages, and answered with a byte: 0 if it was delivered, 
+1 otherwise. */
+void run_tcp_daemon(struct sockaddr_in* server_addr, const char* socket_path,
+                    const client_opts* opts);
+
+/* Function that hands data_length bytes to the daemon listening on 
+socket_path. Returns true if they were not delivered. */
+bool submit_to_daemon(const char* socket_path, char* data, 
+                        uint64_t data_length);
+
+#endif
\ No newline at end of file
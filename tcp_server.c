@@ -1,6 +1,17 @@
 #include "tcp_server.h"
 #include "protconst.h"
+#include "session_store.h"
+#include "stats.h"
+#include "trace.h"
+#include "output.h"
+#include "mempool.h"
+#include "ratelimit.h"
+#include "dedup.h"
+#include "relay.h"
+#include "net.h"
 
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 
 bool volatile b_was_tcp_server_interrupted = false;
@@ -9,154 +20,741 @@ void tcp_server_handler() {
     b_was_tcp_server_interrupted = true;
 }
 
-void run_tcp_server(uint16_t port) {
-    // Ignore SIGPIPE signals.
-    signal(SIGPIPE, SIG_IGN);
-    ignore_signal(tcp_server_handler, SIGINT);
+/* Function that opens the output of an accepted session, forwarded through
+relay if the server relays. Returns true if the session can't be accepted. */
+bool open_tcp_store(session_store* store, relay* relay, 
+                    const CONN* connect_data, const STRIPE* stripe, 
+                    const server_opts* opts) {
+    bool b_resume = connect_data->prot_id & CONN_FLAG_RESUME;
+    relay->b_active = false;
+    if (opts->relay_prot_id != 0 && stripe != NULL) {
+        error("Split transfers can't be relayed");
+        return true;
+    }
+    if (opts->relay_prot_id != 0) {
+        return open_relay_store(store, relay, opts, connect_data->session_id,
+                                be64toh(connect_data->data_length), 
+                                b_resume);
+    }
+    if (stripe == NULL) {
+        return open_session_store(store, opts->output_dir, 
+                                    connect_data->session_id,
+                                    be64toh(connect_data->data_length),
+                                    b_resume);
+    }
+    if (b_resume || be16toh(stripe->stripe_count) > MAX_STRIPES ||
+        be16toh(stripe->stripe_idx) >= be16toh(stripe->stripe_count)) {
+        error("Invalid stripe");
+        return true;
+    }
+    return open_stripe_store(store, opts->output_dir, 
+                                be64toh(stripe->group_id),
+                                be64toh(stripe->group_length),
+                                be64toh(stripe->offset),
+                                be64toh(connect_data->data_length),
+                                be16toh(stripe->stripe_idx),
+                                be16toh(stripe->stripe_count));
+}
 
-    // Create a socket with IPv4 protocol.
-    struct sockaddr_in server_addr;
-    int socket_fd = setup_socket(&server_addr, TCP_PROT_ID, port, NULL);
+/* Function that sends RJT for package pkt_nr and closes the connection. */
+void reject_package(int socket_fd, int client_fd, uint64_t session_id,
+                    uint64_t pkt_nr) {
+    RJT error_pck = {.session_id = session_id, .pkt_type_id = RJT_TYPE,
+                    .pkt_nr = htobe64(pkt_nr)};
+    ssize_t bytes_written = TRACED(TRACE_SEND,
+            write_n_bytes(client_fd, &error_pck, sizeof(error_pck)));
+    if (!assert_write(bytes_written, sizeof(error_pck), socket_fd, client_fd,
+                        NULL, NULL)) {
+        assert_socket_close(client_fd);
+    }
+    stats_add(&stats_current->rejects, 1);
+}
 
-    // Set the socket to listen.
-    if(listen(socket_fd, QUEUE_LENGTH) < 0) {
-        assert_socket_close(socket_fd);
-        syserr("Socket failed to switch to the listening state.");
+/* Function that serves a DIGESTS package with refs_size bytes of CHUNK_REFs,
+whose header was read already. The chunks the store lacks are read from the
+client and saved, the others are loaded from the store, and all of them go 
+to the output in order. wire_bytes is set to the chunk bytes that came over 
+the network. Returns true if the connection was closed. */
+bool serve_dedup_batch(int socket_fd, int client_fd, uint64_t session_id,
+                        uint32_t refs_size, uint64_t* pck_number, 
+                        uint64_t* byte_count, session_store* store,
+                        const server_opts* opts, output_queue* output,
+                        uint64_t* wire_bytes) {
+    *wire_bytes = 0;
+    CHUNK_REF* refs = malloc(refs_size);
+    assert_null((char*)refs, socket_fd, client_fd, NULL, NULL);
+    ssize_t bytes_read = TRACED(TRACE_RECV,
+            busy_read_n_bytes(client_fd, refs, refs_size));
+    if (assert_read(bytes_read, refs_size, socket_fd, client_fd, 
+                    (char*)refs, NULL)) {
+        return true;
     }
 
-    // Communication loop:
-    while (!b_was_tcp_server_interrupted) {
-        struct sockaddr_in client_addr;
+    size_t ref_count = refs_size / sizeof(CHUNK_REF);
+    uint64_t batch_length = 0;
+    bool b_valid = true;
+    for (size_t i = 0; i < ref_count; ++i) {
+        uint32_t length = be32toh(refs[i].length);
+        b_valid = b_valid && assert_data_size(length);
+        batch_length += length;
+    }
+    if (opts->output_dir == NULL) {
+        error("Deduplication requires an output directory");
+        b_valid = false;
+    }
+    if (!b_valid || batch_length > *byte_count) {
+        reject_package(socket_fd, client_fd, session_id, *pck_number);
+        free(refs);
+        return true;
+    }
 
-        // Accept a connection with a client.
-        // Below I'm making a compound literal.
-        bool b_connection_closed = false;
-        int client_fd = accept(socket_fd, (struct sockaddr*)&client_addr, 
-                                &((socklen_t){sizeof(client_addr)}));
-        if (client_fd < 0) {
-            b_connection_closed = true;
-            error("Failed to connect with a client");
+    // Answer with the chunks we need.
+    uint8_t bitmap[(MAX_CHUNK_REFS + 7) / 8] = {0};
+    for (size_t i = 0; i < ref_count; ++i) {
+        if (!has_chunk(opts->output_dir, &refs[i])) {
+            bitmap[i / 8] |= 1 << (i % 8);
         }
+    }
+    uint32_t bitmap_size = (ref_count + 7) / 8;
+    char missing_pck[sizeof(DATA) - sizeof(char*) + sizeof(bitmap)];
+    init_data_pck(session_id, htobe64(*pck_number), htobe32(bitmap_size),
+                    missing_pck, (char*)bitmap);
+    ((DATA*)missing_pck)->pkt_type_id = MISSING_TYPE;
+    size_t missing_size = sizeof(DATA) - sizeof(char*) + bitmap_size;
+    ssize_t bytes_written = TRACED(TRACE_SEND,
+            write_n_bytes(client_fd, missing_pck, missing_size));
+    if (assert_write(bytes_written, missing_size, socket_fd, client_fd, 
+                        (char*)refs, NULL)) {
+        return true;
+    }
+    ++*pck_number;
 
-        CONN connect_data;
-        ssize_t bytes_read = -1;
-        if (!b_was_tcp_server_interrupted && !b_connection_closed) {
-            // Set timeouts for the client.
-            set_timeouts(socket_fd, client_fd, NULL);
-
-            // Get a CONN package.
-            bytes_read = read_n_bytes(client_fd, &connect_data, 
-                                                sizeof(connect_data));
-            b_connection_closed = assert_read(bytes_read, 
-                                                    sizeof(connect_data), 
-                                                    socket_fd, client_fd,
+    bool b_connection_closed = false;
+    for (size_t i = 0; i < ref_count && !b_connection_closed && 
+                        !b_was_tcp_server_interrupted; ++i) {
+        uint32_t length = be32toh(refs[i].length);
+        char* chunk = output_buffer(output);
+        if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+            b_connection_closed = load_chunk(opts->output_dir, &refs[i], 
+                                                chunk);
+            if (b_connection_closed) {
+                assert_socket_close(client_fd);
+            }
+            else {
+                stats_add(&stats_current->dedup_bytes, length);
+            }
+        }
+        else {
+            // Sent by the client in a DATA package of its own.
+            DATA dt;
+            size_t dt_size = sizeof(DATA) - sizeof(char*);
+            bytes_read = TRACED(TRACE_RECV, 
+                    busy_read_n_bytes(client_fd, &dt, dt_size));
+            b_connection_closed = assert_read(bytes_read, dt_size, socket_fd,
+                                                client_fd, NULL, NULL);
+            if (!b_connection_closed && 
+                (!is_expected_data(&dt, dt_size, session_id, *pck_number) ||
+                be32toh(dt.data_size) != length)) {
+                reject_package(socket_fd, client_fd, session_id, 
+                                be64toh(dt.pkt_nr));
+                b_connection_closed = true;
+            }
+            if (!b_connection_closed) {
+                bytes_read = TRACED(TRACE_RECV,
+                        busy_read_n_bytes(client_fd, chunk, length));
+                b_connection_closed = assert_read(bytes_read, length, 
+                                                    socket_fd, client_fd, 
                                                     NULL, NULL);
+            }
+            uint8_t digest[DIGEST_SIZE];
+            if (!b_connection_closed) {
+                sha256(chunk, length, digest);
+                if (memcmp(digest, refs[i].digest, DIGEST_SIZE) != 0) {
+                    error("Chunk doesn't match its digest");
+                    reject_package(socket_fd, client_fd, session_id, 
+                                    *pck_number);
+                    b_connection_closed = true;
+                }
+            }
+            if (!b_connection_closed) {
+                // A chunk that can't be saved is only sent again next time.
+                save_chunk(opts->output_dir, &refs[i], chunk);
+                stats_add(&stats_current->packets, 1);
+                *wire_bytes += length;
+                ++*pck_number;
+            }
         }
 
-        if (!b_connection_closed && (connect_data.pkt_type_id != CONN_TYPE || 
-            connect_data.prot_id != TCP_PROT_ID)) {
-            // We got something wrong. Close the connection.
-            error("Wanted CONN TCP, got something else");
-            b_connection_closed = true;
-            assert_socket_close(client_fd);
+        if (!b_connection_closed) {
+            output_push(output, store, chunk, chunk, length, true);
+            chunk = NULL;
+            if (output_failed(output)) {
+                // Failed to save the data, drop the client.
+                assert_socket_close(client_fd);
+                b_connection_closed = true;
+            }
+        }
+        if (!b_connection_closed) {
+            stats_add(&stats_current->bytes, length);
+            *byte_count -= length;
+        }
+        pool_free(chunk);
+    }
+    free(refs);
+    return b_connection_closed;
+}
+
+/* Function that serves a session whose CONN (and STRIPE, if it's striped)
+was already read. Returns true if the client kept the connection open for 
+another session, otherwise the connection is closed. */
+bool serve_tcp_session(int socket_fd, int client_fd, 
+                        const CONN* connect_data, const STRIPE* stripe,
+                        const server_opts* opts, output_queue* output) {
+    bool b_connection_closed = false;
+    bool b_kept = false;
+    ssize_t bytes_read = -1;
+    if (b_was_tcp_server_interrupted) {
+        assert_socket_close(client_fd);
+        return false;
+    }
+
+    session_store store;
+    relay relay = {.b_active = false};
+    bool b_resume = false;
+    bool b_compact = false;
+    if (!b_connection_closed && !b_was_tcp_server_interrupted) {
+        b_resume = connect_data->prot_id & CONN_FLAG_RESUME;
+        b_compact = connect_data->prot_id & CONN_FLAG_COMPACT;
+        // Sessions that don't fit the memory budget are rejected too. Only
+        // the buffer being received into is held besides the output queue.
+        bool b_rejected = pool_admit(1);
+        if (!b_rejected && open_tcp_store(&store, &relay, connect_data, stripe, 
+                                            opts)) {
+            pool_leave(1);
+            b_rejected = true;
         }
-        if(!b_connection_closed && !b_was_tcp_server_interrupted) {
-            // Managed to get the CONN package, its time to send 
-            // CONACC back to the client.
-            CONACC con_ack_data = {.pkt_type_id = CONACC_TYPE, 
-                                    .session_id = connect_data.session_id};
-            ssize_t bytes_written = write_n_bytes(client_fd, &con_ack_data, 
-                                                    sizeof(con_ack_data));
+        if (b_rejected) {
+            // We can't take this session, reject it.
+            CONRJT con_rjt_data = {.pkt_type_id = CONRJT_TYPE,
+                                .session_id = connect_data->session_id};
+            ssize_t bytes_written = TRACED(TRACE_SEND,
+                    write_n_bytes(client_fd, 
+                                                &con_rjt_data,
+                                                sizeof(con_rjt_data)));
             b_connection_closed = assert_write(bytes_written, 
-                                                sizeof(con_ack_data), 
-                                                socket_fd, client_fd, 
+                                                sizeof(con_rjt_data),
+                                                socket_fd, client_fd,
                                                 NULL, NULL);
+            if (!b_connection_closed) {
+                assert_socket_close(client_fd);
+            }
+            stats_add(&stats_current->rejects, 1);
+            b_connection_closed = true;
+        }
+    }
+    if(!b_connection_closed && !b_was_tcp_server_interrupted) {
+        stats_session_begin(connect_data->session_id, TCP_PROT_ID);
 
-            // Read data from the client.
-            uint64_t byte_count = be64toh(connect_data.data_length);
-            uint64_t pck_number = 0;
-            while (byte_count > 0 && !b_connection_closed && !b_was_tcp_server_interrupted) {
-                size_t pck_size = sizeof(DATA);
-                char* recv_data = malloc(pck_size);
-                assert_null(recv_data, socket_fd, client_fd, NULL, NULL);
-
-                bytes_read = read_n_bytes(client_fd, recv_data, 
-                                            sizeof(DATA) - sizeof(char*));
-                b_connection_closed = assert_read(bytes_read, 
-                                                    sizeof(DATA) - sizeof(char*), 
-                                                    socket_fd, client_fd, 
-                                                    recv_data, NULL);
-                if (!b_connection_closed) {
-                    DATA* dt = (DATA*)recv_data;
-                    if (dt->pkt_type_id != DATA_TYPE || 
-                        dt->session_id != connect_data.session_id || 
-                        be64toh(dt->pkt_nr) != pck_number || 
-                        !assert_data_size(be32toh(dt->data_size))) {
-                        // Invalid package, send RJT to
-                        // the client and move on.
-                        RJT error_pck = {.session_id = 
-                                        connect_data.session_id,
-                                        .pkt_type_id = RJT_TYPE, 
-                                        .pkt_nr = dt->pkt_nr};
-                        bytes_written = write_n_bytes(client_fd, 
-                                            &error_pck, sizeof(error_pck));
-                        b_connection_closed = assert_write(bytes_written,
-                                                sizeof(error_pck), socket_fd,
-                                                client_fd, recv_data, NULL);
-                        if (!b_connection_closed) {
-                            free(recv_data);
-                        }
-                        b_connection_closed = true;
+        // Managed to get the CONN package, its time to send 
+        // CONACC (or RESACC for resumed sessions) back to the client.
+        CONACC con_ack_data = {.pkt_type_id = CONACC_TYPE, 
+                                .session_id = connect_data->session_id};
+        RESACC res_ack_data = {.pkt_type_id = RESACC_TYPE,
+                    .session_id = connect_data->session_id,
+                    .pkt_nr = htobe64(store.progress.pkt_nr),
+                    .byte_offset = htobe64(store.progress.byte_offset),
+                    .checksum = htobe32(store.progress.checksum)};
+        void* ack_data = b_resume ? (void*)&res_ack_data : 
+                                    (void*)&con_ack_data;
+        size_t ack_size = b_resume ? sizeof(res_ack_data) : 
+                                    sizeof(con_ack_data);
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                write_n_bytes(client_fd, ack_data, 
+                                                ack_size));
+        b_connection_closed = assert_write(bytes_written, ack_size, 
+                                            socket_fd, client_fd, 
+                                            NULL, NULL);
+
+        // Read data from the client. A stream goes on until its EOS.
+        bool b_stream = be64toh(connect_data->data_length) == STREAM_LENGTH;
+        uint64_t byte_count = be64toh(connect_data->data_length) - 
+                                store.progress.byte_offset;
+        uint64_t pck_number = store.progress.pkt_nr;
+        // Rate limits hold back the reads, TCP then slows the client down.
+        token_bucket bucket;
+        bucket_init(&bucket, opts->session_rate);
+        struct sockaddr_in peer_addr = {0};
+        getpeername(client_fd, (struct sockaddr*)&peer_addr, 
+                    &((socklen_t){sizeof(peer_addr)}));
+        uint32_t throttled_bytes = 0;
+        while (byte_count > 0 && !b_connection_closed && !b_was_tcp_server_interrupted) {
+            if (throttled_bytes > 0) {
+                // The last package of a session doesn't wait, RCVD goes 
+                // out right away.
+                stats_add(&stats_current->throttled_us,
+                            rate_limit(&bucket, peer_addr.sin_addr,
+                                        opts->address_rate, 
+                                        throttled_bytes) / 1000);
+                throttled_bytes = 0;
+            }
+            size_t pck_size = sizeof(DATA);
+            char* recv_data = malloc(pck_size);
+            assert_null(recv_data, socket_fd, client_fd, NULL, NULL);
+
+            // Compact sessions send a shorter header.
+            TCP_CDATA cdata;
+            void* hdr = b_compact ? (void*)&cdata : (void*)recv_data;
+            size_t hdr_size = b_compact ? sizeof(cdata) : 
+                                        sizeof(DATA) - sizeof(char*);
+            bytes_read = TRACED(TRACE_RECV,
+                    busy_read_n_bytes(client_fd, hdr, hdr_size));
+            if (bytes_read < 0 && errno == EAGAIN) {
+                stats_add(&stats_current->timeouts, 1);
+                TRACE_MARK(TRACE_TIMEOUT, pck_number);
+            }
+            b_connection_closed = assert_read(bytes_read, hdr_size,
+                                                socket_fd, client_fd, 
+                                                recv_data, NULL);
+            if (!b_connection_closed) {
+                DATA* dt = (DATA*)recv_data;
+                if (b_compact) {
+                    expand_tcp_cdata(&cdata, dt, connect_data->session_id,
+                                        pck_number);
+                }
+                size_t dt_size = sizeof(DATA) - sizeof(char*);
+                if (b_stream && is_eos(dt, dt_size, connect_data->session_id,
+                                        pck_number)) {
+                    // The client sent everything.
+                    byte_count = 0;
+                    free(recv_data);
+                }
+                else if (!b_compact && 
+                        is_expected_digests(dt, dt_size, 
+                                        connect_data->session_id, 
+                                        pck_number)) {
+                    // The next batch of a deduplicated session.
+                    uint32_t refs_size = be32toh(dt->data_size);
+                    free(recv_data);
+                    uint64_t wire_bytes;
+                    b_connection_closed = serve_dedup_batch(socket_fd, 
+                                            client_fd, 
+                                            connect_data->session_id, 
+                                            refs_size, &pck_number, 
+                                            &byte_count, &store, opts, 
+                                            output, &wire_bytes);
+                    throttled_bytes = wire_bytes;
+                }
+                else if (b_stream ? 
+                        !is_expected_stream_data(dt, dt_size, 
+                                        connect_data->session_id, pck_number) :
+                        !is_expected_data(dt, dt_size,
+                                        connect_data->session_id, 
+                                        pck_number)) {
+                    // Invalid package, send RJT to
+                    // the client and move on.
+                    RJT error_pck = {.session_id = 
+                                    connect_data->session_id,
+                                    .pkt_type_id = RJT_TYPE, 
+                                    .pkt_nr = dt->pkt_nr};
+                    bytes_written = TRACED(TRACE_SEND,
+                            write_n_bytes(client_fd, 
+                                        &error_pck, sizeof(error_pck)));
+                    b_connection_closed = assert_write(bytes_written,
+                                            sizeof(error_pck), socket_fd,
+                                            client_fd, recv_data, NULL);
+                    if (!b_connection_closed) {
+                        free(recv_data);
+                    }
+                    stats_add(&stats_current->rejects, 1);
+                    b_connection_closed = true;
+                    assert_socket_close(client_fd);
+                }
+                else if (dt->data_size == 0) {
+                    // An idle stream keeping the connection alive.
+                    ++pck_number;
+                    free(recv_data);
+                }
+                else  {
+                    // Valid package, read the data part.
+                    char* data_to_print = output_buffer(output);
+                    bytes_read = TRACED(TRACE_RECV,
+                            busy_read_n_bytes(client_fd, data_to_print,
+                                                     be32toh(dt->data_size)));
+                    if (bytes_read < 0 && errno == EAGAIN) {
+                        stats_add(&stats_current->timeouts, 1);
+                        TRACE_MARK(TRACE_TIMEOUT, pck_number);
+                    }
+                    b_connection_closed = assert_read(bytes_read, 
+                                                        be32toh(dt->data_size),
+                                                        socket_fd, 
+                                                        client_fd, 
+                                                        recv_data, 
+                                                        data_to_print);
+                    if (!b_connection_closed && opts->b_tcp_tuned) {
+                        quick_ack(client_fd);
+                    }
+                    if (!b_connection_closed) {
+                        throttled_bytes = be32toh(dt->data_size);
+                    }
+                    // The writer thread saves the data. Waiting for room
+                    // in the queue holds back the client through TCP
+                    // flow control.
+                    if (!b_connection_closed) {
+                        output_push(output, &store, data_to_print, 
+                                    data_to_print, 
+                                    be32toh(dt->data_size), true);
+                        data_to_print = NULL;
+                    }
+                    if (!b_connection_closed && output_failed(output)) {
+                        // Failed to save the data, drop the client.
+                        free(recv_data);
                         assert_socket_close(client_fd);
+                        b_connection_closed = true;
                     }
-                    else  {
-                        // Valid package, read the data part.
-                        char* data_to_print = malloc(be32toh(dt->data_size));
-                        assert_null(data_to_print, socket_fd, client_fd, 
-                                        recv_data, NULL);
-                        bytes_read = read_n_bytes(client_fd, data_to_print,
-                                                    be32toh(dt->data_size));
-                        b_connection_closed = assert_read(bytes_read, 
-                                                            be32toh(dt->data_size),
-                                                            socket_fd, 
-                                                            client_fd, 
-                                                            recv_data, 
-                                                            data_to_print);
-                        if (!b_connection_closed) {
-                            // Managed to get the data. Print it.
-                            //print_data(data_to_print, be32toh(dt->data_size));
-                            ++pck_number;
-                            if (byte_count < byte_count - be32toh(dt->data_size)) {
-                                byte_count = 0;
-                            }
-                            else {
-                                byte_count -= be32toh(dt->data_size);
-                            }
-                            free(recv_data);
+                    if (!b_connection_closed) {
+                        // Managed to get and save the data.
+                        stats_add(&stats_current->bytes, 
+                                    be32toh(dt->data_size));
+                        stats_add(&stats_current->packets, 1);
+                        ++pck_number;
+                        if (byte_count < byte_count - be32toh(dt->data_size)) {
+                            byte_count = 0;
+                        }
+                        else {
+                            byte_count -= be32toh(dt->data_size);
                         }
-                        free(data_to_print);
+                        free(recv_data);
                     }
+                    pool_free(data_to_print);
                 }
             }
-            
-            if (!b_connection_closed && !b_was_tcp_server_interrupted) {
-                // Managed to get all the data. Send RCVD package
-                // to the client and close the connection.
-                RCVD recv_data_ack = {.pkt_type_id = RCVD_TYPE, 
-                                        .session_id = connect_data.session_id};
-                bytes_written = write_n_bytes(client_fd, &recv_data_ack, 
-                                                sizeof(recv_data_ack));
-                b_connection_closed = assert_write
-                                        (bytes_written, sizeof(recv_data_ack), 
-                                        socket_fd, client_fd, NULL, NULL);
+        }
+        
+        // RCVD goes out only once all the data is written.
+        if (output_flush(output) && !b_connection_closed) {
+            assert_socket_close(client_fd);
+            b_connection_closed = true;
+        }
+        // A relayed session once the downstream server confirmed it too.
+        if (!b_connection_closed && finish_relay(&store, &relay)) {
+            assert_socket_close(client_fd);
+            b_connection_closed = true;
+        }
+        if (!b_connection_closed && !b_was_tcp_server_interrupted) {
+            complete_session_store(&store);
+            // Managed to get all the data. Send RCVD package
+            // to the client and close the connection.
+            RCVD recv_data_ack = {.pkt_type_id = RCVD_TYPE, 
+                                    .session_id = connect_data->session_id};
+            bytes_written = TRACED(TRACE_SEND,
+                    write_n_bytes(client_fd, &recv_data_ack, 
+                                            sizeof(recv_data_ack)));
+            b_connection_closed = assert_write
+                                    (bytes_written, sizeof(recv_data_ack), 
+                                    socket_fd, client_fd, NULL, NULL);
+        }
+
+        stats_session_end(!b_connection_closed && 
+                            !b_was_tcp_server_interrupted);
+        // A kept connection stays open for the next session.
+        b_kept = !b_connection_closed && !b_was_tcp_server_interrupted &&
+                    (connect_data->prot_id & CONN_FLAG_KEEP);
+        if (!b_connection_closed && !b_kept) {
+            // Close the connection.
+            assert_socket_close(client_fd);
+        }
+        finish_relay(&store, &relay);
+        close_session_store(&store);
+        pool_leave(1);
+    }
+    return b_kept;
+}
+
+// Connection kept open after a session, waiting for the next CONN.
+typedef struct {
+    int client_fd;
+    // CLOCK_MONOTONIC, in nanoseconds, when it's closed if idle.
+    uint64_t deadline_ns;
+} kept_connection;
+
+// Connection of a striped session waiting for a worker.
+typedef struct {
+    int client_fd;
+    CONN connect_data;
+    STRIPE stripe;
+} stripe_job;
+
+// Striped sessions are served in parallel by a pool of worker threads, 
+// started on demand. All the other sessions are served one by one by the
+// accepting thread.
+pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stripe_cond = PTHREAD_COND_INITIALIZER;
+stripe_job stripe_jobs[STRIPE_WORKERS];
+size_t stripe_job_head = 0;
+size_t stripe_job_count = 0;
+size_t stripe_idle_workers = 0;
+size_t stripe_worker_count = 0;
+int stripe_socket_fd = -1;
+const server_opts* stripe_opts = NULL;
+
+void* stripe_worker(void* arg) {
+    (void)arg;
+    // Workers leave the core of a pinned accepting thread to it.
+    unpin_thread();
+    stats_register_thread();
+    output_queue* output = start_output();
+
+    pthread_mutex_lock(&stripe_lock);
+    while (true) {
+        ++stripe_idle_workers;
+        while (stripe_job_count == 0) {
+            pthread_cond_wait(&stripe_cond, &stripe_lock);
+        }
+        --stripe_idle_workers;
+        stripe_job job = stripe_jobs[stripe_job_head];
+        stripe_job_head = (stripe_job_head + 1) % STRIPE_WORKERS;
+        --stripe_job_count;
+        pthread_mutex_unlock(&stripe_lock);
+
+        if (serve_tcp_session(stripe_socket_fd, job.client_fd, 
+                                &job.connect_data, &job.stripe, stripe_opts,
+                                output)) {
+            // Stripes carry a single session each.
+            assert_socket_close(job.client_fd);
+        }
+        pthread_mutex_lock(&stripe_lock);
+    }
+    return NULL;
+}
+
+/* Function that reads the STRIPE following connect_data and hands the 
+session to a worker. */
+void queue_stripe(int socket_fd, int client_fd, const CONN* connect_data) {
+    stripe_job job = {.client_fd = client_fd, .connect_data = *connect_data};
+    ssize_t bytes_read = TRACED(TRACE_RECV,
+            busy_read_n_bytes(client_fd, &job.stripe, sizeof(job.stripe)));
+    if (assert_read(bytes_read, sizeof(job.stripe), socket_fd, client_fd,
+                    NULL, NULL)) {
+        return;
+    }
+
+    pthread_mutex_lock(&stripe_lock);
+    // A stripe left waiting for a worker would time out while its client
+    // waits for CONACC, so it's only taken if a worker can start on it.
+    bool b_full = stripe_idle_workers <= stripe_job_count &&
+                    stripe_worker_count == STRIPE_WORKERS;
+    if (!b_full) {
+        stripe_jobs[(stripe_job_head + stripe_job_count) % STRIPE_WORKERS] = 
+                                                                        job;
+        ++stripe_job_count;
+        if (stripe_idle_workers < stripe_job_count && 
+            stripe_worker_count < STRIPE_WORKERS) {
+            // Workers leave the signals to the accepting thread.
+            sigset_t all, old;
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, &old);
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, stripe_worker, NULL) != 0) {
+                fatal("Failed to start a worker");
             }
+            pthread_detach(worker);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            ++stripe_worker_count;
+        }
+        pthread_cond_signal(&stripe_cond);
+    }
+    pthread_mutex_unlock(&stripe_lock);
 
-            if (!b_connection_closed) {
-                // Close the connection.
+    if (b_full) {
+        // All workers are busy, reject this one.
+        CONRJT con_rjt_data = {.pkt_type_id = CONRJT_TYPE,
+                                .session_id = connect_data->session_id};
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                write_n_bytes(client_fd, &con_rjt_data, 
+                                sizeof(con_rjt_data)));
+        if (!assert_write(bytes_written, sizeof(con_rjt_data), socket_fd,
+                            client_fd, NULL, NULL)) {
+            assert_socket_close(client_fd);
+        }
+        stats_add(&stats_current->rejects, 1);
+    }
+}
+
+/* Function that tells if a kept connection brought the next CONN, false if
+the client closed it. */
+bool has_next_conn(int client_fd) {
+    char byte;
+    return recv(client_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/* Function that prepares an accepted connection for its sessions. */
+void setup_tcp_connection(int socket_fd, int client_fd, 
+                            const server_opts* opts) {
+    // Set timeouts for the client.
+    set_timeouts(socket_fd, client_fd, NULL);
+    if (opts->b_tcp_tuned) {
+        tune_tcp_socket(client_fd);
+    }
+    enable_busy_poll(client_fd);
+}
+
+/* Function that serves the next session of a connection. Returns true if 
+the client keeps the connection open for another one, otherwise it's closed
+or belongs to a stripe worker. */
+bool serve_next_session(int socket_fd, int client_fd, 
+                        const server_opts* opts, output_queue* output) {
+    // Get a CONN package.
+    CONN connect_data;
+    ssize_t bytes_read = TRACED(TRACE_RECV,
+            busy_read_n_bytes(client_fd, &connect_data, 
+                                sizeof(connect_data)));
+    if (assert_read(bytes_read, sizeof(connect_data), socket_fd, 
+                    client_fd, NULL, NULL)) {
+        return false;
+    }
+
+    if (connect_data.pkt_type_id != CONN_TYPE || 
+        (connect_data.prot_id & PROT_ID_MASK) != TCP_PROT_ID) {
+        // We got something wrong. Close the connection.
+        error("Wanted CONN TCP, got something else");
+        assert_socket_close(client_fd);
+        return false;
+    }
+
+    if (connect_data.prot_id & CONN_FLAG_STRIPE) {
+        queue_stripe(socket_fd, client_fd, &connect_data);
+        return false;
+    }
+    bool b_kept = serve_tcp_session(socket_fd, client_fd, &connect_data,
+                                    NULL, opts, output);
+    if (b_kept && b_was_tcp_server_interrupted) {
+        // Interrupted between two sessions.
+        assert_socket_close(client_fd);
+        return false;
+    }
+    return b_kept;
+}
+
+/* Function that adds a connection kept after a session to the ones waiting
+for their next CONN. The one idle for the longest is closed if there is no
+room. */
+void keep_connection(kept_connection* kept, size_t* kept_count, 
+                        int client_fd) {
+    if (*kept_count == KEEP_ALIVE_CONNECTIONS) {
+        assert_socket_close(kept[0].client_fd);
+        memmove(kept, kept + 1, (*kept_count - 1) * sizeof(*kept));
+        --*kept_count;
+    }
+    kept[(*kept_count)++] = (kept_connection){.client_fd = client_fd,
+            .deadline_ns = monotonic_ns() + KEEP_ALIVE_WAIT * 1000000000ULL};
+}
+
+void run_tcp_server(uint16_t port, const server_opts* opts) {
+    // Ignore SIGPIPE signals.
+    signal(SIGPIPE, SIG_IGN);
+    ignore_signal(tcp_server_handler, SIGINT);
+    stats_register_thread();
+    stripe_opts = opts;
+
+    // The output is written by a separate thread, so reading the next 
+    // package overlaps with writing the previous one.
+    output_queue* output = start_output();
+    // After the output thread started, so that it doesn't share the core.
+    pin_thread(opts->pin_cpu);
+
+    // Create a socket with IPv4 protocol.
+    struct sockaddr_in server_addr;
+    int socket_fd = setup_socket(&server_addr, TCP_PROT_ID, port, NULL);
+    stripe_socket_fd = socket_fd;
+
+    // Set the socket to listen.
+    if (opts->session_rate > 0 || opts->address_rate > 0) {
+        // Accepted connections inherit it.
+        limit_rcvbuf(socket_fd, opts->session_rate == 0 ? opts->address_rate :
+                        opts->address_rate == 0 ? opts->session_rate :
+                        opts->session_rate < opts->address_rate ? 
+                        opts->session_rate : opts->address_rate);
+    }
+    if (opts->b_tcp_tuned) {
+        enable_fastopen_listen(socket_fd, QUEUE_LENGTH);
+    }
+    if(listen(socket_fd, QUEUE_LENGTH) < 0) {
+        assert_socket_close(socket_fd);
+        syserr("Socket failed to switch to the listening state.");
+    }
+
+    // Communication loop. Kept connections wait for their next CONN 
+    // together with the listening socket, oldest first, so an idle one
+    // doesn't hold up other clients.
+    kept_connection kept[KEEP_ALIVE_CONNECTIONS];
+    size_t kept_count = 0;
+    struct pollfd fds[KEEP_ALIVE_CONNECTIONS + 1];
+    while (!b_was_tcp_server_interrupted) {
+        uint64_t now_ns = monotonic_ns();
+        int timeout_ms = -1;
+        for (size_t i = 0; i < kept_count; ++i) {
+            fds[i] = (struct pollfd){.fd = kept[i].client_fd, 
+                                    .events = POLLIN};
+            int wait_ms = kept[i].deadline_ns <= now_ns ? 0 :
+                    (int)((kept[i].deadline_ns - now_ns + 999999) / 1000000);
+            if (timeout_ms < 0 || wait_ms < timeout_ms) {
+                timeout_ms = wait_ms;
+            }
+        }
+        fds[kept_count] = (struct pollfd){.fd = socket_fd, .events = POLLIN};
+        if (poll(fds, kept_count + 1, timeout_ms) < 0) {
+            if (errno != EINTR) {
+                error("Failed to wait for clients");
+            }
+            errno = 0;
+            continue;
+        }
+
+        // Serve the kept connections that brought a CONN, drop the ones 
+        // that were closed or stayed idle for too long.
+        size_t polled_count = kept_count;
+        kept_count = 0;
+        now_ns = monotonic_ns();
+        for (size_t i = 0; i < polled_count; ++i) {
+            int client_fd = kept[i].client_fd;
+            if (fds[i].revents == 0 && kept[i].deadline_ns > now_ns) {
+                kept[kept_count++] = kept[i];
+            }
+            else if (fds[i].revents == 0 || !has_next_conn(client_fd) ||
+                        b_was_tcp_server_interrupted) {
+                // The client is done, or forgot about us.
+                errno = 0;
                 assert_socket_close(client_fd);
             }
+            else if (serve_next_session(socket_fd, client_fd, opts, 
+                                        output)) {
+                keep_connection(kept, &kept_count, client_fd);
+            }
+        }
+
+        if (!(fds[polled_count].revents & POLLIN) || 
+            b_was_tcp_server_interrupted) {
+            continue;
+        }
+        // Accept a connection with a client.
+        // Below I'm making a compound literal.
+        struct sockaddr_in client_addr;
+        int client_fd = accept(socket_fd, (struct sockaddr*)&client_addr, 
+                                &((socklen_t){sizeof(client_addr)}));
+        if (client_fd < 0) {
+            error("Failed to connect with a client");
+            errno = 0;
+            continue;
+        }
+        setup_tcp_connection(socket_fd, client_fd, opts);
+        if (serve_next_session(socket_fd, client_fd, opts, output)) {
+            keep_connection(kept, &kept_count, client_fd);
         }
     }
 
+    for (size_t i = 0; i < kept_count; ++i) {
+        assert_socket_close(kept[i].client_fd);
+    }
+    close_output(output);
     assert_socket_close(socket_fd);
 }
\ No newline at end of file
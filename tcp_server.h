@@ -5,7 +5,11 @@
 #include "err.h"
 
 #define QUEUE_LENGTH 50
+// Maximal number of kept connections waiting for their next session.
+#define KEEP_ALIVE_CONNECTIONS 64
+// Maximal number of striped sessions served at once.
+#define STRIPE_WORKERS MAX_STRIPES
 
-void run_tcp_server(uint16_t port);
+void run_tcp_server(uint16_t port, const server_opts* opts);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include "trace.h"
+#include "err.h"
+
+#ifdef PPCB_TRACE
+
+#include <fcntl.h>
+#include <pthread.h>
+
+typedef struct trace_ring {
+    trace_record records[TRACE_RING_SIZE];
+    // Total number of records written, only the owner thread updates it.
+    uint64_t head;
+    uint16_t thread_id;
+    struct trace_ring* next;
+} trace_ring;
+
+_Thread_local trace_ring* local_ring = NULL;
+
+// Rings are registered once per thread and never freed.
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+trace_ring* trace_rings = NULL;
+uint16_t trace_thread_count = 0;
+
+void dump_trace(void) {
+    char path[PATH_MAX];
+    const char* env_path = getenv("PPCB_TRACE_FILE");
+    if (env_path != NULL) {
+        snprintf(path, sizeof(path), "%s", env_path);
+    }
+    else {
+        snprintf(path, sizeof(path), "ppcb_trace.%d.bin", (int)getpid());
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_header header = {.magic = TRACE_MAGIC, .pid = getpid(), 
+                            .record_count = 0};
+    for (trace_ring* ring = trace_rings; ring != NULL; ring = ring->next) {
+        header.record_count += ring->head < TRACE_RING_SIZE ? 
+                                ring->head : TRACE_RING_SIZE;
+    }
+    FILE* comm = fopen("/proc/self/comm", "r");
+    if (comm != NULL) {
+        if (fgets(header.process_name, sizeof(header.process_name), 
+                    comm) != NULL) {
+            header.process_name[strcspn(header.process_name, "\n")] = 0;
+        }
+        fclose(comm);
+    }
+
+    write_n_bytes(fd, &header, sizeof(header));
+    for (trace_ring* ring = trace_rings; ring != NULL; ring = ring->next) {
+        // Oldest record first.
+        uint64_t count = ring->head < TRACE_RING_SIZE ? 
+                            ring->head : TRACE_RING_SIZE;
+        uint64_t first = (ring->head - count) % TRACE_RING_SIZE;
+        uint64_t tail = TRACE_RING_SIZE - first < count ? 
+                            TRACE_RING_SIZE - first : count;
+        write_n_bytes(fd, &ring->records[first], 
+                        tail * sizeof(trace_record));
+        write_n_bytes(fd, &ring->records[0], 
+                        (count - tail) * sizeof(trace_record));
+    }
+    pthread_mutex_unlock(&trace_lock);
+    close(fd);
+}
+
+trace_ring* register_ring(void) {
+    local_ring = calloc(1, sizeof(trace_ring));
+    if (local_ring == NULL) {
+        fatal("Malloc failed");
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_rings == NULL) {
+        atexit(dump_trace);
+    }
+    local_ring->thread_id = trace_thread_count++;
+    local_ring->next = trace_rings;
+    trace_rings = local_ring;
+    pthread_mutex_unlock(&trace_lock);
+    return local_ring;
+}
+
+void store_record(uint16_t type, uint64_t start_ns, uint32_t duration_ns,
+                    int64_t arg) {
+    trace_ring* ring = local_ring != NULL ? local_ring : register_ring();
+
+    trace_record* record = &ring->records[ring->head % TRACE_RING_SIZE];
+    record->start_ns = start_ns;
+    record->arg = arg;
+    record->duration_ns = duration_ns;
+    record->type = type;
+    record->thread_id = ring->thread_id;
+    ++ring->head;
+}
+
+void trace_event(uint16_t type, uint64_t start_ns, int64_t arg) {
+    uint64_t duration_ns = monotonic_ns() - start_ns;
+    // Zero duration marks instant events.
+    store_record(type, start_ns, duration_ns == 0 ? 1 : 
+                duration_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_ns,
+                arg);
+}
+
+void trace_instant(uint16_t type, int64_t arg) {
+    store_record(type, monotonic_ns(), 0, arg);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+// Hot path event tracing, compiled in only with -DPPCB_TRACE (make TRACE=1).
+// Every thread logs into its own ring buffer, which is dumped to 
+// $PPCB_TRACE_FILE (ppcb_trace.<pid>.bin by default) at exit.
+// trace2json turns the dump into Chrome trace JSON.
+
+#define TRACE_RECV 1
+#define TRACE_SEND 2
+#define TRACE_OUTPUT 3
+#define TRACE_RETRANSMIT 4
+#define TRACE_TIMEOUT 5
+
+// Records kept per thread, older ones are overwritten.
+#define TRACE_RING_SIZE (1 << 16)
+
+#define TRACE_MAGIC "PPCBTRC1"
+
+// Layout of the dump file: a trace_header followed by records.
+typedef struct __attribute__((__packed__)) {
+    char magic[8];
+    uint32_t pid;
+    uint32_t record_count;
+    char process_name[16];
+} trace_header;
+
+typedef struct __attribute__((__packed__)) {
+    // CLOCK_MONOTONIC, in nanoseconds.
+    uint64_t start_ns;
+    // Result of the call, or the package number for instant events.
+    int64_t arg;
+    uint32_t duration_ns;
+    uint16_t type;
+    uint16_t thread_id;
+} trace_record;
+
+#ifdef PPCB_TRACE
+
+/* Function that stores an event that started at start_ns and ends now. */
+void trace_event(uint16_t type, uint64_t start_ns, int64_t arg);
+
+/* Function that stores an event without duration. */
+void trace_instant(uint16_t type, int64_t arg);
+
+// Evaluates call and records how long it took along with its result.
+#define TRACED(type, call) ({ \
+    uint64_t trace_start_ = monotonic_ns(); \
+    __typeof__(call) trace_result_ = (call); \
+    trace_event((type), trace_start_, (int64_t)trace_result_); \
+    trace_result_; \
+})
+
+// Records an instant event.
+#define TRACE_MARK(type, arg) trace_instant((type), (arg))
+
+#else
+
+#define TRACED(type, call) (call)
+#define TRACE_MARK(type, arg) ((void)0)
+
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include "common.h"
+#include "err.h"
+#include "trace.h"
+
+// Converts a dump written by a PPCB_TRACE build into Chrome trace JSON
+// (chrome://tracing, Perfetto).
+
+const char* event_name(uint16_t type) {
+    switch (type) {
+        case TRACE_RECV:
+            return "recv";
+        case TRACE_SEND:
+            return "send";
+        case TRACE_OUTPUT:
+            return "output";
+        case TRACE_RETRANSMIT:
+            return "retransmit";
+        case TRACE_TIMEOUT:
+            return "timeout";
+        default:
+            return "unknown";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fatal("usage: %s <trace file>", argv[0]);
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        syserr("Failed to open %s", argv[1]);
+    }
+
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || 
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fclose(in);
+        fatal("%s is not a trace file", argv[1]);
+    }
+    header.process_name[sizeof(header.process_name) - 1] = 0;
+
+    printf("{\"traceEvents\":[\n");
+    printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%" PRIu32 
+            ",\"args\":{\"name\":\"%s\"}}", header.pid, header.process_name);
+    trace_record record;
+    uint32_t records_read = 0;
+    while (records_read < header.record_count && 
+            fread(&record, sizeof(record), 1, in) == 1) {
+        // Chrome expects microseconds.
+        printf(",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,", 
+                event_name(record.type), record.duration_ns > 0 ? "X" : "i",
+                record.start_ns / 1000.0);
+        if (record.duration_ns > 0) {
+            printf("\"dur\":%.3f,", record.duration_ns / 1000.0);
+        }
+        else {
+            printf("\"s\":\"t\",");
+        }
+        printf("\"pid\":%" PRIu32 ",\"tid\":%" PRIu16 
+                ",\"args\":{\"arg\":%" PRId64 "}}", 
+                header.pid, record.thread_id, record.arg);
+        ++records_read;
+    }
+    printf("\n]}\n");
+
+    fclose(in);
+    if (records_read != header.record_count) {
+        fatal("Trace file is truncated");
+    }
+    return 0;
+}
\ No newline at end of file
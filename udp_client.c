@@ -1,5 +1,7 @@
 #include "udp_client.h"
 #include "protconst.h"
+#include "latency.h"
+#include "input.h"
 
 bool volatile b_was_udp_cl_interrupted = false;
 
@@ -8,7 +10,8 @@ void udp_cl_handler() {
 }
 
 void run_udp_client(const struct sockaddr_in* server_addr, char* data, 
-                    uint64_t data_length, uint64_t session_id) {
+                    uint64_t data_length, const client_opts* opts) {
+    uint64_t session_id = opts->session_id;
     // Ignore SIGPIPE signals.
     signal(SIGPIPE, SIG_IGN);
     ignore_signal(udp_cl_handler, SIGINT);
@@ -18,60 +21,126 @@ void run_udp_client(const struct sockaddr_in* server_addr, char* data,
     // a local copy of the sockaddr_in structure.
     struct sockaddr_in loc_server_addr = *server_addr;
     int socket_fd = create_socket(UDP_PROT_ID, data);
+    if (opts->b_latency) {
+        enable_timestamping(socket_fd);
+    }
 
     // Set timeouts for the server.
     set_timeouts(-1, socket_fd, data);
 
-    // Send the CONN package.
+    // Send the CONN package, with the first DATA package
+    // right behind it if asked to.
     int flags = 0;
     bool b_connection_closed  = false;
     ssize_t bytes_written = -1;
-    if (!b_was_udp_cl_interrupted) {
+    uint64_t conn_sent_ns = 0;
+    const char* first_chunk = NULL;
+    uint32_t first_len = 0;
+    if (opts->b_first_flight && data_length > 0) {
+        const char* first_ptr = data;
+        first_len = calc_pck_size(data_length, opts->pck_size);
+        first_chunk = input_next(opts->input, &first_ptr, &first_len);
+        b_connection_closed = first_chunk == NULL;
+    }
+    char* conn_pck = malloc(sizeof(CONN) + sizeof(DATA) + first_len);
+    assert_null(conn_pck, socket_fd, -1, NULL, data);
+    if (!b_connection_closed && !b_was_udp_cl_interrupted) {
         socklen_t addr_length = (socklen_t)sizeof(*server_addr);
-        CONN connection_data = {.pkt_type_id = CONN_TYPE, 
-                                .session_id = session_id,
-                                .prot_id = UDP_PROT_ID, 
-                                .data_length = htobe64(data_length)};
-        bytes_written = sendto(socket_fd, &connection_data, 
-                                    sizeof(connection_data),
+        size_t conn_size = init_conn_pck(UDP_PROT_ID, opts, data_length,
+                                        first_chunk, first_len, conn_pck);
+        conn_sent_ns = realtime_ns();
+        bytes_written = sendto(socket_fd, conn_pck, conn_size,
                                     flags, (struct sockaddr*)&loc_server_addr,
                                     addr_length);
         b_connection_closed = assert_write
-                                (bytes_written, sizeof(connection_data), 
+                                (bytes_written, conn_size, 
                                 socket_fd, -1, NULL, data);
+        if (opts->b_latency) {
+            conn_sent_ns = tx_timestamp(socket_fd, conn_sent_ns);
+        }
     }
+    free(conn_pck);
 
     if (!b_connection_closed && !b_was_udp_cl_interrupted) {
         socklen_t addr_length = (socklen_t)sizeof(*server_addr);
-        // Get the CONACC package.
-        CONACC ack_pck;
-        ssize_t bytes_read = recvfrom(socket_fd, &ack_pck,
+        // Get the CONACC (or RESACC) package.
+        char ack_pck[sizeof(RESACC) + sizeof(ACC)];
+        uint64_t conacc_rx_ns = 0;
+        ssize_t bytes_read = recvfrom_ts(socket_fd, ack_pck,
                                         sizeof(ack_pck), flags,
                                         (struct sockaddr*)&loc_server_addr,
-                                        &addr_length);
-        b_connection_closed = assert_read(bytes_read, sizeof(ack_pck), 
-                                            socket_fd, -1, NULL, data);
-        if (!b_connection_closed && !b_connection_closed) {
-            b_connection_closed = get_connac_pck(&ack_pck, session_id);
+                                        &addr_length, opts->b_latency ? 
+                                        &conacc_rx_ns : NULL);
+        if (bytes_read <= 0) {
+            // Will produce error message.
+            b_connection_closed = assert_read(bytes_read, sizeof(CONACC), 
+                                                socket_fd, -1, NULL, data);
         }
-
-        // Send data to the server.
         uint64_t pck_number = 0;
-        const char* data_ptr = data;
-        while(data_length > 0 && !b_connection_closed && 
+        uint64_t data_offset = 0;
+        if (!b_connection_closed) {
+            b_connection_closed = get_conn_resp(ack_pck, bytes_read, opts,
+                                                data, data_length,
+                                                &pck_number, &data_offset);
+            if (!b_connection_closed && opts->b_latency) {
+                record_rtt(&conn_rtt_hist, conn_sent_ns, conacc_rx_ns);
+            }
+            if (!b_connection_closed && first_chunk != NULL && 
+                pck_number > 0) {
+                // The server took the first package, otherwise it's 
+                // sent again below.
+                input_release(opts->input);
+            }
+        }
+
+        // Send data to the server. A stream goes on until the input ends,
+        // and then sends EOS.
+        bool b_stream = data_length == STREAM_LENGTH;
+        const char* data_ptr = data + data_offset;
+        data_length -= data_offset;
+        while((data_length > 0 || b_stream) && !b_connection_closed && 
             !b_was_udp_cl_interrupted) {
             // recvfrom can change the value of the addr_length,
             // so I have to update it here over and over again.
             addr_length = (socklen_t)sizeof(loc_server_addr);
-            uint32_t curr_len = calc_pck_size(data_length);
+            uint32_t curr_len = calc_pck_size(data_length, opts->pck_size);
 
             // Initialize a package.
             ssize_t pck_size = sizeof(DATA) - sizeof(char*) + curr_len;
             char* data_pck = malloc(pck_size);
             assert_null(data_pck, socket_fd, -1, NULL, data);
 
-            init_data_pck(session_id, htobe64(pck_number), 
-                                    htobe32(curr_len), data_pck, data_ptr);
+            const char* chunk = input_next(opts->input, &data_ptr, &curr_len);
+            if (chunk == NULL && b_stream && !input_failed(opts->input)) {
+                pck_size = init_eos_pck(UDP_PROT_ID, opts, pck_number, 
+                                        data_pck);
+                bytes_written = sendto(socket_fd, data_pck, pck_size, flags,
+                                        (struct sockaddr*)&loc_server_addr, 
+                                        addr_length);
+                b_connection_closed = assert_write(bytes_written, pck_size, 
+                                                socket_fd, -1, data_pck, data);
+                if (!b_connection_closed) {
+                    free(data_pck);
+                }
+                break;
+            }
+            if (chunk == NULL) {
+                // The input ended early, the reader reported it.
+                free(data_pck);
+                b_connection_closed = true;
+                break;
+            }
+            pck_size = sizeof(DATA) - sizeof(char*) + curr_len;
+            if (opts->conn_flags & CONN_FLAG_COMPACT) {
+                pck_size = init_cdata_pck(UDP_PROT_ID, session_id, pck_number,
+                                        curr_len, data_pck, chunk) + curr_len;
+            }
+            else {
+                init_data_pck(session_id, htobe64(pck_number), 
+                                htobe32(curr_len), data_pck, chunk);
+            }
+            // The package holds its own copy now.
+            input_release(opts->input);
 
             bytes_written = sendto(socket_fd, data_pck, pck_size, flags,
                                     (struct sockaddr*)&loc_server_addr, 
@@ -82,8 +151,9 @@ void run_udp_client(const struct sockaddr_in* server_addr, char* data,
             if (!b_connection_closed) {
                 free(data_pck);
                 ++pck_number;
-                data_length -= curr_len;
-                data_ptr += curr_len;
+                if (!b_stream) {
+                    data_length -= curr_len;
+                }
             }
         }
         if (!b_connection_closed && !b_was_udp_cl_interrupted) {
@@ -5,6 +5,6 @@
 #include "err.h"
 
 void run_udp_client(const struct sockaddr_in* server_addr, char* data,
-                    uint64_t data_length, uint64_t session_id);
+                    uint64_t data_length, const client_opts* opts);
 
 #endif
\ No newline at end of file
@@ -1,7 +1,21 @@
 #include "udp_server.h"
 #include "protconst.h"
+#include "session_store.h"
+#include "stats.h"
+#include "trace.h"
+#include "net.h"
+#include "output.h"
+#include "mempool.h"
+#include "reorder.h"
+#include "ratelimit.h"
+#include "relay.h"
 
-#define MAX_PACKET_SIZE 65536
+#define MAX_PACKET_SIZE POOL_BUFFER_SIZE
+
+// A NAK covers the packages the sender may send ahead of the receiver, all
+// of them fit in the reorder buffer.
+_Static_assert(REORDER_WINDOW >= MCAST_WINDOW && MCAST_WINDOW <= 64,
+                "The multicast window doesn't fit the reorder buffer");
 
 bool volatile b_was_udp_server_interrupted = false;
 
@@ -9,71 +23,344 @@ void udp_server_handler() {
     b_was_udp_server_interrupted = true;
 }
 
-void run_udp_server(uint16_t port) {
+// Packages the kernel dropped on the server socket for lack of room. Every
+// new drop doubles the receive buffer, up to UDP_RCVBUF_MAX.
+typedef struct {
+    // As last reported by the kernel.
+    uint32_t reported;
+    // Added to the stats already.
+    uint32_t counted;
+    // Receive buffer granted by the kernel.
+    int rcvbuf;
+} drop_watch;
+
+/* Function that counts the packages the kernel dropped since the last call
+and grows the receive buffer after them. */
+void watch_drops(int socket_fd, drop_watch* drops) {
+    if (drops->reported == drops->counted) {
+        return;
+    }
+    stats_add(&stats_current->kernel_drops, 
+                drops->reported - drops->counted);
+    drops->counted = drops->reported;
+    if (drops->rcvbuf < UDP_RCVBUF_MAX) {
+        // The kernel grants twice what it's asked for, the rest is for its
+        // bookkeeping.
+        drops->rcvbuf = set_socket_buffers(socket_fd, drops->rcvbuf, 0);
+    }
+}
+
+ssize_t recv_session_pck(int socket_fd, char* recv_data, bool b_compact,
+                            uint64_t session_id, uint64_t pck_number,
+                            struct sockaddr_in* client_addr, 
+                            socklen_t* addr_length, drop_watch* drops) {
+    ssize_t bytes_read;
+    if (!b_compact) {
+        bytes_read = TRACED(TRACE_RECV,
+                net_recvfrom_drops(socket_fd, recv_data, MAX_PACKET_SIZE, 0,
+                        (struct sockaddr*)client_addr, addr_length,
+                        &drops->reported));
+    }
+    else {
+        // Leave room for expanding the compact header in place.
+        bytes_read = TRACED(TRACE_RECV,
+                net_recvfrom_drops(socket_fd, recv_data + CDATA_OFFSET,
+                                MAX_PACKET_SIZE - CDATA_OFFSET, 0,
+                                (struct sockaddr*)client_addr, addr_length,
+                                &drops->reported));
+        expand_udp_cdata(recv_data, &bytes_read, session_id, pck_number);
+    }
+    watch_drops(socket_fd, drops);
+    return bytes_read;
+}
+
+/* Function that checks if the package belongs to the session but came before
+some of the ones preceding it, and can be held until they arrive. */
+bool is_early_pck(const DATA* dt, ssize_t pck_len, uint64_t session_id, 
+                    uint64_t pck_number, bool b_stream) {
+    if (pck_len < (ssize_t)(sizeof(DATA) - sizeof(char*))) {
+        return false;
+    }
+    uint64_t pkt_nr = be64toh(dt->pkt_nr);
+    if (pkt_nr <= pck_number || pkt_nr - pck_number >= REORDER_WINDOW) {
+        return false;
+    }
+    if (b_stream) {
+        // The EOS may overtake the last packages too.
+        return is_expected_stream_data(dt, pck_len, session_id, pkt_nr) ||
+                is_eos(dt, pck_len, session_id, pkt_nr);
+    }
+    return is_expected_data(dt, pck_len, session_id, pkt_nr);
+}
+
+/* Function that tells the multicast sender which packages are missing: the
+ones from pck_number up to the highest received, except the held ones. 
+Returns true if the connection is closed. */
+bool send_nak(int socket_fd, const reorder_buffer* reorder, 
+                uint64_t session_id, uint64_t pck_number, 
+                uint64_t highest_pck, const struct sockaddr_in* client_addr, 
+                socklen_t addr_length, char* recv_data) {
+    uint64_t missing = 0;
+    for (uint64_t i = 0; i < MCAST_WINDOW && pck_number + i <= highest_pck; 
+            ++i) {
+        if (!reorder_has(reorder, pck_number + i)) {
+            missing |= 1ULL << i;
+        }
+    }
+    NAK nak_pck = {.pkt_type_id = NAK_TYPE, .session_id = session_id,
+                    .pkt_nr = htobe64(pck_number), 
+                    .missing = htobe64(missing)};
+    ssize_t bytes_written = TRACED(TRACE_SEND,
+            net_sendto(socket_fd, &nak_pck, sizeof(nak_pck), 0,
+                        (struct sockaddr*)client_addr, addr_length));
+    return assert_write(bytes_written, sizeof(nak_pck), socket_fd, -1, NULL,
+                        recv_data);
+}
+
+/* Function that answers a PROBE of pck_len bytes in recv_data, if it is one.
+Returns true if it was. */
+bool echo_probe(int socket_fd, char* recv_data, ssize_t pck_len,
+                const struct sockaddr_in* client_addr, socklen_t addr_length) {
+    if (pck_len < (ssize_t)sizeof(PROBE) || 
+        ((PROBE*)recv_data)->pkt_type_id != PROBE_TYPE) {
+        return false;
+    }
+    ssize_t bytes_written = TRACED(TRACE_SEND,
+            net_sendto(socket_fd, recv_data, sizeof(PROBE), 0,
+                        (struct sockaddr*)client_addr, addr_length));
+    if (bytes_written != sizeof(PROBE)) {
+        // The prober will count it as lost.
+        errno = 0;
+    }
+    return true;
+}
+
+void run_udp_server(uint16_t port, const server_opts* opts) {
     // Ignore SIGPIPE signals.
     signal(SIGPIPE, SIG_IGN);
     ignore_signal(udp_server_handler, SIGINT);
+    stats_register_thread();
+
+    // The output is written by a separate thread, so a slow consumer
+    // doesn't hold up the socket.
+    output_queue* output = start_output();
 
     // Buffer for reading datagrams.
-    char* recv_data = malloc(MAX_PACKET_SIZE);
-    assert_null(recv_data, -1, -1, NULL, NULL);
+    char* recv_data = output_buffer(output);
 
     // Create a socket with IPv4 protocol.
     struct sockaddr_in server_addr;
-    int socket_fd = setup_socket(&server_addr, UDP_PROT_ID, port, recv_data);
+    int socket_fd = opts->b_mcast ? 
+            setup_multicast_socket(&server_addr, port, opts->mcast_group,
+                                    opts->mcast_iface) :
+            setup_socket(&server_addr, UDP_PROT_ID, port, recv_data);
+    // Receivers on a host share the port of the group, so multicast ones 
+    // answer from a socket of their own, which tells them apart for the 
+    // sender.
+    int reply_fd = opts->b_mcast ? create_socket(UDP_PROT_ID, recv_data) :
+                                    socket_fd;
 
     // Set timeouts for the client.
     set_timeouts(-1, socket_fd, NULL);
 
+    // The buffer takes the packages a client may send ahead, grown if the
+    // kernel still drops some.
+    drop_watch drops = {.reported = 0, .counted = 0, 
+                        .rcvbuf = set_socket_buffers(socket_fd, 
+                                    REORDER_WINDOW * MAX_PACKET_SIZE, 0)};
+    enable_drop_count(socket_fd);
+    enable_busy_poll(socket_fd);
+    // After the output thread started, so that it doesn't share the core.
+    pin_thread(opts->pin_cpu);
+
     // Communication loop
+    struct sockaddr_in client_addr;
+    CONN connection_data = {0};
+    // Set when a client reconnects to resume the current session, its
+    // CONN is then already in connection_data.
+    bool b_reconnected = false;
+    // Length of the datagram with the CONN, more than a CONN if the first
+    // DATA package came along.
+    ssize_t conn_length = 0;
+    // Packages that came early, held until their turn.
+    reorder_buffer reorder;
+    reorder_init(&reorder);
     while(!b_was_udp_server_interrupted) {
         // Get a CONN package.
-        struct sockaddr_in client_addr;
         socklen_t addr_length = (socklen_t)sizeof(client_addr);
-        CONN connection_data;
         bool b_connection_closed = false;
-        while(!b_connection_closed && !b_was_udp_server_interrupted) {
-            ssize_t bytes_read = recvfrom(socket_fd, &connection_data,
-                                        sizeof(connection_data), 0,
+        while(!b_reconnected && !b_connection_closed && 
+                !b_was_udp_server_interrupted) {
+            ssize_t bytes_read = TRACED(TRACE_RECV,
+                    net_recvfrom_drops(socket_fd, recv_data, 
+                                        MAX_PACKET_SIZE, 0,
                                         (struct sockaddr*)&client_addr,
-                                        &addr_length);
+                                        &addr_length, &drops.reported));
+            watch_drops(socket_fd, &drops);
             if ((bytes_read < 0 && errno != EAGAIN) || bytes_read >= 0) {
+                conn_length = bytes_read;
+                if (bytes_read > (ssize_t)sizeof(connection_data)) {
+                    bytes_read = sizeof(connection_data);
+                }
                 b_connection_closed = assert_read
                                         (bytes_read, sizeof(connection_data),
                                         socket_fd, -1, NULL, recv_data);
+                memcpy(&connection_data, recv_data, sizeof(connection_data));
                 if (!b_connection_closed && 
                     connection_data.pkt_type_id == CONN_TYPE &&
-                    (connection_data.prot_id == UDP_PROT_ID || 
-                    connection_data.prot_id == UDPR_PROT_ID)) {
+                    ((connection_data.prot_id & PROT_ID_MASK) == UDP_PROT_ID ||
+                    (connection_data.prot_id & PROT_ID_MASK) == UDPR_PROT_ID ||
+                    (connection_data.prot_id & PROT_ID_MASK) == UDPM_PROT_ID)) {
                     // We got a valid CONN.
                     break;
                 }
                 else if (bytes_read > 0) {
                     //error("Wanted CONN UDP/UDPR, got something else");
                     b_connection_closed = false;
+                    echo_probe(reply_fd, recv_data, conn_length, 
+                                &client_addr, addr_length);
                 }
             }
             errno = 0; // EAGAIN, clear the error.
         }
 
-        // Send CONACC back to the client.
-        CONACC resp = {.pkt_type_id = CONACC_TYPE, 
-                        .session_id = connection_data.session_id};
-        ssize_t bytes_written = sendto(socket_fd, &resp, sizeof(resp),
-                                    0, (struct sockaddr*)&client_addr, 
-                                    addr_length);
-        b_connection_closed = assert_write(bytes_written, sizeof(resp),
-                                            socket_fd, -1, NULL, recv_data);
+        if (b_was_udp_server_interrupted) {
+            break;
+        }
+        b_reconnected = false;
+        uint8_t prot_id = connection_data.prot_id & PROT_ID_MASK;
+        bool b_resume = connection_data.prot_id & CONN_FLAG_RESUME;
+        bool b_compact = connection_data.prot_id & CONN_FLAG_COMPACT;
+
+        // Sessions that don't fit the memory budget are rejected too. The
+        // held packages and the buffer being received into count besides 
+        // the output queue.
+        session_store store;
+        relay relay = {.b_active = false};
+        bool b_rejected = pool_admit(REORDER_WINDOW + 1);
+        if (!b_rejected && (opts->relay_prot_id != 0 ?
+                open_relay_store(&store, &relay, opts, 
+                                connection_data.session_id,
+                                be64toh(connection_data.data_length),
+                                b_resume) :
+                open_session_store(&store, opts->output_dir, 
+                                connection_data.session_id,
+                                be64toh(connection_data.data_length),
+                                b_resume))) {
+            pool_leave(REORDER_WINDOW + 1);
+            b_rejected = true;
+        }
+        if (b_rejected) {
+            // We can't take this session, reject it.
+            CONRJT conrjt_pck = {.pkt_type_id = CONRJT_TYPE, 
+                                .session_id = connection_data.session_id};
+            ssize_t bytes_written = TRACED(TRACE_SEND,
+                    net_sendto(reply_fd, &conrjt_pck, 
+                                        sizeof(conrjt_pck), 0, 
+                                        (struct sockaddr*)&client_addr,
+                                        addr_length));
+            assert_write(bytes_written, sizeof(conrjt_pck), socket_fd, 
+                            -1, NULL, recv_data);
+            stats_add(&stats_current->rejects, 1);
+            continue;
+        }
+
+        stats_session_begin(connection_data.session_id, prot_id);
+
+        // Resumed sessions start where the saved progress ends. A stream 
+        // goes on until its EOS.
+        bool b_stream = be64toh(connection_data.data_length) == STREAM_LENGTH;
+        uint64_t first_pck_number = store.progress.pkt_nr;
+        uint64_t byte_count = be64toh(connection_data.data_length) - 
+                                store.progress.byte_offset;
+
+        // The first DATA package may have come right behind the CONN. 
+        // It's taken like any other and confirmed together with the CONACC.
+        DATA* first_dt = (DATA*)(recv_data + sizeof(CONN));
+        ssize_t first_length = conn_length - (ssize_t)sizeof(CONN);
+        bool b_first_flight = !b_resume && 
+                is_expected_data(first_dt, first_length, 
+                                    connection_data.session_id, 0) &&
+                first_length == (ssize_t)(sizeof(DATA) - sizeof(char*) + 
+                                        be32toh(first_dt->data_size)) &&
+                be32toh(first_dt->data_size) <= byte_count;
+        conn_length = 0;
+        if (b_first_flight) {
+            // Queued by the rules of the data packages below.
+            uint32_t data_size = be32toh(first_dt->data_size);
+            if (output_push(output, &store, recv_data, 
+                            (char*)first_dt + sizeof(DATA) - sizeof(char*),
+                            data_size, prot_id != UDP_PROT_ID)) {
+                stats_add(&stats_current->drops, 1);
+                error("Output too slow, dropping the session");
+                b_connection_closed = true;
+            }
+            else {
+                recv_data = output_buffer(output);
+                stats_add(&stats_current->bytes, data_size);
+                stats_add(&stats_current->packets, 1);
+                byte_count -= data_size;
+                first_pck_number = 1;
+            }
+        }
+
+        // Send CONACC (or RESACC for resumed sessions) back to the client.
+        CONACC conacc_resp = {.pkt_type_id = CONACC_TYPE, 
+                            .session_id = connection_data.session_id};
+        RESACC resacc_resp = {.pkt_type_id = RESACC_TYPE,
+                        .session_id = connection_data.session_id,
+                        .pkt_nr = htobe64(store.progress.pkt_nr),
+                        .byte_offset = htobe64(store.progress.byte_offset),
+                        .checksum = htobe32(store.progress.checksum)};
+        void* resp = b_resume ? (void*)&resacc_resp : (void*)&conacc_resp;
+        size_t resp_size = b_resume ? sizeof(resacc_resp) : 
+                                        sizeof(conacc_resp);
+        char first_resp[sizeof(CONACC) + sizeof(ACC)];
+        if (b_first_flight) {
+            ACC first_acc = {.pkt_type_id = ACC_TYPE, .pkt_nr = htobe64(0),
+                            .session_id = connection_data.session_id};
+            memcpy(first_resp, &conacc_resp, sizeof(conacc_resp));
+            memcpy(first_resp + sizeof(conacc_resp), &first_acc, 
+                    sizeof(first_acc));
+            resp = first_resp;
+            resp_size = sizeof(first_resp);
+        }
+        ssize_t bytes_written = 0;
+        if (!b_connection_closed) {
+            bytes_written = TRACED(TRACE_SEND,
+                    net_sendto(reply_fd, resp, resp_size,
+                                        0, (struct sockaddr*)&client_addr, 
+                                        addr_length));
+            b_connection_closed = assert_write(bytes_written, resp_size,
+                                                socket_fd, -1, NULL, 
+                                                recv_data);
+        }
 
         // If we managed to send the CONACC, read the data.
-        uint64_t pck_number = 0;
-        uint64_t byte_count = be64toh(connection_data.data_length);
+        uint64_t pck_number = first_pck_number;
+        bool b_end_of_stream = false;
+        // Rate limits hold back the ACCs, so they apply only to UDPR.
+        token_bucket bucket;
+        bucket_init(&bucket, opts->session_rate);
+        // Multicast receivers report the gaps, at most one NAK every 
+        // MCAST_NAK_WAIT for the packages that show them.
+        uint64_t highest_pck = 0;
+        uint64_t last_nak_ns = 0;
         while(byte_count > 0 && !b_connection_closed && !b_was_udp_server_interrupted) {
             addr_length = (socklen_t)sizeof(client_addr);
-            ssize_t bytes_read = recvfrom(socket_fd, recv_data, 
-                                        MAX_PACKET_SIZE, 0,
-                                        (struct sockaddr*)&client_addr, 
-                                        &addr_length);
+            ssize_t bytes_read;
+            char* held = reorder_take(&reorder, pck_number, &bytes_read);
+            if (held != NULL) {
+                // The package came early and waited for its turn.
+                pool_free(recv_data);
+                recv_data = held;
+            }
+            else {
+                bytes_read = recv_session_pck(socket_fd, recv_data, b_compact,
+                                            connection_data.session_id,
+                                            pck_number, &client_addr, 
+                                            &addr_length, &drops);
+            }
             int retransmits_counter = 0;
             // Try to get the data.
             while(!b_connection_closed && !b_was_udp_server_interrupted) {
@@ -87,57 +374,161 @@ void run_udp_server(uint16_t port) {
                     // I can process data further.
                     // We got something.
                     DATA* dt = (DATA*)recv_data;
-                    if (bytes_read >= (int32_t)(sizeof(DATA) - sizeof(char*)) && 
-                        dt->pkt_type_id == DATA_TYPE && 
-                        be64toh(dt->pkt_nr) == pck_number && dt->session_id == 
-                        connection_data.session_id && 
-                        assert_data_size(be32toh(dt->data_size))) {
+                    if (b_stream ? 
+                        is_expected_stream_data(dt, bytes_read, 
+                                        connection_data.session_id, 
+                                        pck_number) :
+                        is_expected_data(dt, bytes_read, 
+                                        connection_data.session_id, 
+                                        pck_number)) {
                         // We got our data package :))))))
                         break;        
                     }
+                    else if (b_stream && is_eos(dt, bytes_read,
+                                        connection_data.session_id, 
+                                        pck_number)) {
+                        // The client sent everything, RCVD confirms it.
+                        b_end_of_stream = true;
+                        break;
+                    }
+                    else if (is_early_pck(dt, bytes_read, 
+                                        connection_data.session_id,
+                                        pck_number, b_stream)) {
+                        uint64_t pkt_nr = be64toh(dt->pkt_nr);
+                        if (reorder_has(&reorder, pkt_nr)) {
+                            // Held already.
+                            stats_add(&stats_current->duplicates, 1);
+                        }
+                        else {
+                            // The network reordered it, keep it for later.
+                            reorder_put(&reorder, pkt_nr, recv_data, 
+                                        bytes_read);
+                            recv_data = output_buffer(output);
+                        }
+                        if (pkt_nr > highest_pck) {
+                            highest_pck = pkt_nr;
+                        }
+                        if (prot_id == UDPM_PROT_ID && 
+                            monotonic_ns() - last_nak_ns >= 
+                                MCAST_NAK_WAIT * 1000000ULL) {
+                            // Some packages before it are missing.
+                            last_nak_ns = monotonic_ns();
+                            b_connection_closed = send_nak(reply_fd, 
+                                        &reorder, connection_data.session_id,
+                                        pck_number, highest_pck, 
+                                        &client_addr, addr_length, 
+                                        recv_data);
+                        }
+                    }
+                    else if (prot_id == UDPM_PROT_ID && 
+                            (size_t)bytes_read >= sizeof(DATA) - sizeof(char*) &&
+                            dt->pkt_type_id == DATA_TYPE &&
+                            (dt->session_id != connection_data.session_id ||
+                            be64toh(dt->pkt_nr) < pck_number)) {
+                        // The group carries other sessions too, and repairs
+                        // asked for by the other receivers.
+                        if (dt->session_id == connection_data.session_id) {
+                            stats_add(&stats_current->duplicates, 1);
+                        }
+                        if (dt->session_id == connection_data.session_id &&
+                            monotonic_ns() - last_nak_ns >= 
+                                MCAST_NAK_WAIT * 1000000ULL) {
+                            // The sender may not know what we have.
+                            last_nak_ns = monotonic_ns();
+                            b_connection_closed = send_nak(reply_fd, 
+                                        &reorder, connection_data.session_id,
+                                        pck_number, highest_pck, 
+                                        &client_addr, addr_length, 
+                                        recv_data);
+                        }
+                    }
                     else if ((size_t)bytes_read >= sizeof(DATA) - sizeof(char*) && 
                             dt->pkt_type_id == DATA_TYPE) {
-                        if (connection_data.prot_id != UDPR_PROT_ID || 
+                        if (prot_id != UDPR_PROT_ID || 
                             be64toh(dt->pkt_nr) >= pck_number || 
                             dt->session_id != connection_data.session_id ||
-                            !assert_data_size(be32toh(dt->data_size))) {
+                            !(assert_data_size(be32toh(dt->data_size)) ||
+                            (b_stream && dt->data_size == 0))) {
                             // Someone send us an invalid package. Send him 
                             // RJT and close the connection if it was our client.
                             RJT rjt_pck = {.pkt_type_id = RJT_TYPE, 
                                             .session_id = dt->session_id, 
                                             .pkt_nr = dt->pkt_nr};
-                            bytes_written = sendto(socket_fd, &rjt_pck, 
+                            bytes_written = TRACED(TRACE_SEND,
+                                    net_sendto(reply_fd, &rjt_pck, 
                                                 sizeof(rjt_pck), 0,
                                                 (struct sockaddr*)&client_addr,
-                                                addr_length);
+                                                addr_length));
                             b_connection_closed = assert_write(bytes_written,
                                                     sizeof(rjt_pck), socket_fd,
                                                     -1, NULL, recv_data);
+                            stats_add(&stats_current->rejects, 1);
+                            if (dt->session_id == connection_data.session_id &&
+                                be64toh(dt->pkt_nr) > pck_number) {
+                                // Packages between were lost on the way.
+                                stats_add(&stats_current->drops, 
+                                        be64toh(dt->pkt_nr) - pck_number);
+                            }
                             if (dt->session_id == connection_data.session_id) {
                                 // It was our client, we have 
                                 // to close the connection.
                                 b_connection_closed = true;
                             }
                         }
+                        else {
+                            // Our client retransmitted an accepted package.
+                            stats_add(&stats_current->duplicates, 1);
+                        }
                     }
-                    else if (bytes_read == sizeof(CONN) && 
+                    else if (bytes_read >= (ssize_t)sizeof(CONN) && 
                             dt->pkt_type_id == CONN_TYPE &&
                             dt->session_id != connection_data.session_id) {
                         // Someone wants to connect with us (UwU UwU). 
                         // REJECT THEM.
                         CONRJT conrjt_pck = {.pkt_type_id = CONRJT_TYPE, 
                                             .session_id = dt->session_id};
-                        bytes_written = sendto(socket_fd, 
+                        bytes_written = TRACED(TRACE_SEND, 
+                                    net_sendto(reply_fd, 
                                             &conrjt_pck, sizeof(conrjt_pck),
                                             0, (struct sockaddr*)&client_addr,
-                                            addr_length);
+                                            addr_length));
                         b_connection_closed = assert_write(bytes_written, 
                                                             sizeof(conrjt_pck),
                                                             socket_fd, -1, 
                                                             NULL, recv_data);
+                        stats_add(&stats_current->rejects, 1);
                     }
-                    else if (!(bytes_read == sizeof(CONN) && 
-                            connection_data.prot_id == UDPR_PROT_ID && 
+                    else if (bytes_read == sizeof(CONN) && 
+                            dt->pkt_type_id == CONN_TYPE &&
+                            dt->session_id == connection_data.session_id &&
+                            (((CONN*)recv_data)->prot_id & CONN_FLAG_RESUME)) {
+                        // The client came back to resume this session. Drop
+                        // the current exchange and answer the new CONN.
+                        memcpy(&connection_data, recv_data, 
+                                sizeof(connection_data));
+                        b_reconnected = true;
+                        b_connection_closed = true;
+                    }
+                    else if (bytes_read >= (ssize_t)sizeof(CONN) && 
+                            prot_id == UDPM_PROT_ID && 
+                            dt->pkt_type_id == CONN_TYPE && 
+                            dt->session_id == connection_data.session_id) {
+                        // The multicast sender is still gathering receivers,
+                        // or our CONACC was lost.
+                        bytes_written = TRACED(TRACE_SEND,
+                                net_sendto(reply_fd, resp, resp_size, 0, 
+                                            (struct sockaddr*)&client_addr,
+                                            addr_length));
+                        b_connection_closed = assert_write(bytes_written, 
+                                                resp_size, socket_fd, -1, 
+                                                NULL, recv_data);
+                    }
+                    else if (echo_probe(reply_fd, recv_data, bytes_read,
+                                        &client_addr, addr_length)) {
+                        // Someone measures the path, the session goes on.
+                    }
+                    else if (!(bytes_read >= (ssize_t)sizeof(CONN) && 
+                            prot_id == UDPR_PROT_ID && 
                             dt->pkt_type_id == CONN_TYPE && 
                             dt->session_id == connection_data.session_id)) {
                         // Garbage we can't ignore.
@@ -146,7 +537,9 @@ void run_udp_server(uint16_t port) {
                     }
                 }  
                 else {// errno == EAGAIN
-                    if (connection_data.prot_id != UDPR_PROT_ID) {
+                    stats_add(&stats_current->timeouts, 1);
+                    TRACE_MARK(TRACE_TIMEOUT, pck_number);
+                    if (prot_id == UDP_PROT_ID) {
                         // Will produce error message
                         b_connection_closed = assert_read(bytes_read, 
                                             MAX_PACKET_SIZE, socket_fd,
@@ -157,15 +550,31 @@ void run_udp_server(uint16_t port) {
                         b_connection_closed = true;
                         error("Failed to receive data because of the timeout");
                     }
-                    else if (pck_number == 0) {
+                    else if (prot_id == UDPM_PROT_ID) {
+                        errno = 0;
+                        // Tell the sender where we are, the last packages 
+                        // or our reports may be lost.
+                        last_nak_ns = monotonic_ns();
+                        b_connection_closed = send_nak(reply_fd, &reorder,
+                                        connection_data.session_id, 
+                                        pck_number, highest_pck, 
+                                        &client_addr, addr_length, recv_data);
+                        stats_add(&stats_current->retransmits, 1);
+                        TRACE_MARK(TRACE_RETRANSMIT, pck_number);
+                        ++retransmits_counter;
+                    }
+                    else if (pck_number == first_pck_number) {
                         errno = 0;
                         // First package, retransmit CONACC.
                         ssize_t bytes_written = 
-                        sendto(socket_fd, &resp, sizeof(resp), 0, 
-                                (struct sockaddr*)&client_addr, addr_length);
+                        TRACED(TRACE_SEND,
+                                net_sendto(reply_fd, resp, resp_size, 0, 
+                                (struct sockaddr*)&client_addr, addr_length));
                         b_connection_closed = 
-                        assert_write(bytes_written, sizeof(resp), socket_fd,
+                        assert_write(bytes_written, resp_size, socket_fd,
                                         -1, NULL, recv_data);
+                        stats_add(&stats_current->retransmits, 1);
+                        TRACE_MARK(TRACE_RETRANSMIT, pck_number);
                         ++retransmits_counter;
                     }
                     else {
@@ -175,43 +584,89 @@ void run_udp_server(uint16_t port) {
                                     .pkt_type_id = ACC_TYPE, 
                                     .session_id = connection_data.session_id};
                         bytes_written = 
-                        sendto(socket_fd, &acc_retr, sizeof(acc_retr), 0, 
-                                (struct sockaddr*)&client_addr, addr_length);
+                        TRACED(TRACE_SEND,
+                                net_sendto(reply_fd, &acc_retr, 
+                                sizeof(acc_retr), 0, 
+                                (struct sockaddr*)&client_addr, 
+                                addr_length));
                         b_connection_closed = 
                         assert_write(bytes_written, sizeof(acc_retr), 
                                     socket_fd, -1, NULL, recv_data);
+                        stats_add(&stats_current->retransmits, 1);
+                        TRACE_MARK(TRACE_RETRANSMIT, pck_number);
                         ++retransmits_counter;
                     }
                 }
 
                 if (!b_connection_closed) {
                     bytes_read = 
-                    recvfrom(socket_fd, recv_data, MAX_PACKET_SIZE, 0,
-                            (struct sockaddr*)&client_addr, &addr_length);
+                    recv_session_pck(socket_fd, recv_data, b_compact,
+                                    connection_data.session_id, pck_number,
+                                    &client_addr, &addr_length, &drops);
                 }
             }
 
-            if (!b_connection_closed && !b_was_udp_server_interrupted) {
+            if (b_end_of_stream) {
+                byte_count = 0;
+            }
+            else if (!b_connection_closed && !b_was_udp_server_interrupted) {
                 // We finally managed to get the package.
-                DATA* dt = (DATA*)recv_data;
-                if (byte_count < byte_count - be32toh(dt->data_size)) {
+                uint32_t data_size = be32toh(((DATA*)recv_data)->data_size);
+                if (byte_count < byte_count - data_size) {
                     byte_count = 0;
                 }
                 else {
-                    byte_count -= be32toh(dt->data_size);
+                    byte_count -= data_size;
                 }
                 ++pck_number;
 
-                print_data(recv_data + sizeof(DATA) - sizeof(char*), be32toh(dt->data_size));
+                // Hand the package to the writer. UDPR and UDPM wait for 
+                // room in the queue, the client resends what the socket 
+                // drops meanwhile. Plain UDP can't wait and can't lose a package 
+                // either, a full queue ends the session. Empty packages of
+                // idle streams have nothing to write.
+                if (data_size > 0 && output_push(output, &store, recv_data,
+                                recv_data + sizeof(DATA) - sizeof(char*),
+                                data_size, prot_id != UDP_PROT_ID)) {
+                    stats_add(&stats_current->drops, 1);
+                    error("Output too slow, dropping the session");
+                    b_connection_closed = true;
+                    break;
+                }
+                if (data_size > 0) {
+                    recv_data = output_buffer(output);
+                }
+                if (output_failed(output)) {
+                    // Failed to save the data, drop the session.
+                    b_connection_closed = true;
+                    break;
+                }
+                stats_add(&stats_current->bytes, data_size);
+                stats_add(&stats_current->packets, 1);
+                if (pck_number - 1 > highest_pck) {
+                    highest_pck = pck_number - 1;
+                }
 
-                if (connection_data.prot_id == UDPR_PROT_ID) {
+                if (prot_id == UDPM_PROT_ID && 
+                    pck_number % MCAST_STATUS_INTERVAL == 0) {
+                    // The sender moves its window by these.
+                    b_connection_closed = send_nak(reply_fd, &reorder,
+                                        connection_data.session_id, 
+                                        pck_number, highest_pck, 
+                                        &client_addr, addr_length, recv_data);
+                }
+                else if (prot_id == UDPR_PROT_ID) {
+                    stats_add(&stats_current->throttled_us,
+                            rate_limit(&bucket, client_addr.sin_addr, 
+                                        opts->address_rate, data_size) / 1000);
                     // Send the ACK package.
                     ACC acc_resp = {.pkt_type_id = ACC_TYPE, 
                                     .pkt_nr = htobe64(pck_number - 1), 
                                     .session_id = connection_data.session_id};
                     bytes_written = 
-                        sendto(socket_fd, &acc_resp, sizeof(acc_resp), 0,
-                        (struct sockaddr*)&client_addr, addr_length);
+                        TRACED(TRACE_SEND, 
+                        net_sendto(reply_fd, &acc_resp, sizeof(acc_resp), 0,
+                        (struct sockaddr*)&client_addr, addr_length));
                     b_connection_closed = 
                         assert_write(bytes_written, sizeof(acc_resp), 
                         socket_fd, -1, NULL, recv_data);
@@ -219,19 +674,39 @@ void run_udp_server(uint16_t port) {
             }
         }
 
+        // RCVD goes out only once all the data is written.
+        if (output_flush(output)) {
+            b_connection_closed = true;
+        }
+        // A relayed session once the downstream server confirmed it too.
+        if (!b_connection_closed && finish_relay(&store, &relay)) {
+            b_connection_closed = true;
+        }
         if(!b_connection_closed && !b_was_udp_server_interrupted) {
+            complete_session_store(&store);
             // We got all the data, now we immediately 
             // send RCVD and end the connection.
             RCVD rcvd_resp = {.pkt_type_id = RCVD_TYPE, 
                                 .session_id = connection_data.session_id};
             bytes_written = 
-            sendto(socket_fd, &rcvd_resp, sizeof(rcvd_resp), 0, 
-                (struct sockaddr*)&client_addr, addr_length);
+            TRACED(TRACE_SEND,
+                    net_sendto(reply_fd, &rcvd_resp, sizeof(rcvd_resp), 0, 
+                (struct sockaddr*)&client_addr, addr_length));
             b_connection_closed = assert_write(bytes_written, 
                 sizeof(rcvd_resp), socket_fd, -1, NULL, recv_data);
         }
+        stats_session_end(!b_connection_closed && 
+                            !b_was_udp_server_interrupted);
+        reorder_clear(&reorder);
+        finish_relay(&store, &relay);
+        close_session_store(&store);
+        pool_leave(REORDER_WINDOW + 1);
     }
 
-    free(recv_data);
+    pool_free(recv_data);
+    close_output(output);
+    if (reply_fd != socket_fd) {
+        assert_socket_close(reply_fd);
+    }
     assert_socket_close(socket_fd);
 }
\ No newline at end of file
@@ -6,6 +6,9 @@
 #include "common.h"
 #include "err.h"
 
-void run_udp_server(uint16_t port);
+// Set by SIGINT, stops the server once the current exchange ends.
+extern bool volatile b_was_udp_server_interrupted;
+
+void run_udp_server(uint16_t port, const server_opts* opts);
 
 #endif
\ No newline at end of file
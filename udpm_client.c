@@ -0,0 +1,299 @@
+#include "udpm_client.h"
+#include "protconst.h"
+#include "trace.h"
+#include "net.h"
+#include "input.h"
+
+#include <arpa/inet.h>
+#include <poll.h>
+
+// In milliseconds, how long every CONN waits for the servers to answer.
+#define JOIN_WAIT (MAX_WAIT * 1000 / MAX_RETRANSMITS)
+
+bool volatile b_was_udpm_cl_interrupted = false;
+
+void udpm_cl_handler() {
+    b_was_udpm_cl_interrupted = true;
+}
+
+// A server that answered the CONN.
+typedef struct {
+    struct sockaddr_in addr;
+    // The first package it lacks, as far as we know.
+    uint64_t pkt_nr;
+    // CLOCK_MONOTONIC of the last package from it, in nanoseconds.
+    uint64_t heard_ns;
+    bool b_done;
+    bool b_failed;
+} mcast_receiver;
+
+// Sent packages the receivers may still ask for. Package pkt_nr lives in 
+// slot pkt_nr % MCAST_WINDOW.
+typedef struct {
+    char* pcks[MCAST_WINDOW];
+    size_t sizes[MCAST_WINDOW];
+    // CLOCK_MONOTONIC of the last send, in nanoseconds.
+    uint64_t sent_ns[MCAST_WINDOW];
+    // Some receiver asked for it since.
+    bool b_repair[MCAST_WINDOW];
+} mcast_window;
+
+/* Function that waits up to timeout milliseconds for a package. */
+bool wait_readable(int socket_fd, int timeout) {
+    struct pollfd pfd = {.fd = socket_fd, .events = POLLIN};
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+/* Function that returns the receiver with the given address, NULL if it's
+not one of ours. */
+mcast_receiver* find_receiver(mcast_receiver* receivers, size_t count, 
+                                const struct sockaddr_in* addr) {
+    for (size_t i = 0; i < count; ++i) {
+        if (receivers[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            receivers[i].addr.sin_port == addr->sin_port) {
+            return &receivers[i];
+        }
+    }
+    return NULL;
+}
+
+/* Function that returns the first package some receiver still waits for,
+pck_total if there is none. */
+uint64_t window_base(const mcast_receiver* receivers, size_t count, 
+                        uint64_t pck_total) {
+    uint64_t base = pck_total;
+    for (size_t i = 0; i < count; ++i) {
+        if (!receivers[i].b_done && !receivers[i].b_failed &&
+            receivers[i].pkt_nr < base) {
+            base = receivers[i].pkt_nr;
+        }
+    }
+    return base;
+}
+
+void run_udpm_client(const struct sockaddr_in* group_addr, char* data,
+                        uint64_t data_length, const client_opts* opts) {
+    uint64_t session_id = opts->session_id;
+    int socket_fd = create_socket(UDPM_PROT_ID, data);
+    set_multicast_sender(socket_fd, opts->mcast_iface);
+    // A whole window may wait in the socket when the sender is faster than 
+    // the interface.
+    set_socket_buffers(socket_fd, 0, MCAST_WINDOW * 
+                        (sizeof(DATA) - sizeof(char*) + opts->pck_size));
+    ignore_signal(udpm_cl_handler, SIGINT);
+    set_timeouts(-1, socket_fd, data);
+    socklen_t addr_length = sizeof(*group_addr);
+
+    // Register the receivers.
+    char conn_pck[sizeof(CONN)];
+    size_t conn_size = init_conn_pck(UDPM_PROT_ID, opts, data_length, NULL,
+                                        0, conn_pck);
+    mcast_receiver receivers[MCAST_MAX_RECEIVERS];
+    size_t receiver_count = 0;
+    bool b_connection_closed = false;
+    for (int attempt = 0; attempt <= MAX_RETRANSMITS && 
+            receiver_count < opts->mcast_receivers && !b_connection_closed &&
+            !b_was_udpm_cl_interrupted; ++attempt) {
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                net_sendto(socket_fd, conn_pck, conn_size, 0,
+                            (struct sockaddr*)group_addr, addr_length));
+        b_connection_closed = assert_write(bytes_written, conn_size,
+                                            socket_fd, -1, NULL, data);
+        uint64_t deadline_ns = monotonic_ns() + JOIN_WAIT * 1000000ULL;
+        while (!b_connection_closed && 
+                receiver_count < opts->mcast_receivers) {
+            uint64_t now_ns = monotonic_ns();
+            if (now_ns >= deadline_ns || 
+                !wait_readable(socket_fd, 
+                                (deadline_ns - now_ns) / 1000000 + 1)) {
+                break;
+            }
+            CONACC resp;
+            struct sockaddr_in from;
+            socklen_t from_length = sizeof(from);
+            ssize_t bytes_read = TRACED(TRACE_RECV,
+                    net_recvfrom(socket_fd, &resp, sizeof(resp), 
+                                MSG_DONTWAIT, (struct sockaddr*)&from,
+                                &from_length));
+            if (bytes_read != sizeof(resp) || 
+                resp.session_id != session_id) {
+                // Not for us.
+                errno = 0;
+            }
+            else if (resp.pkt_type_id == CONRJT_TYPE) {
+                error("Connection rejected by %s", inet_ntoa(from.sin_addr));
+            }
+            else if (resp.pkt_type_id == CONACC_TYPE &&
+                    find_receiver(receivers, receiver_count, &from) == NULL) {
+                receivers[receiver_count++] = (mcast_receiver){
+                        .addr = from, .pkt_nr = 0, 
+                        .heard_ns = monotonic_ns(), .b_done = false,
+                        .b_failed = false};
+            }
+        }
+    }
+    if (!b_connection_closed && receiver_count == 0) {
+        error("Timeout");
+        b_connection_closed = true;
+    }
+    else if (!b_connection_closed && 
+            receiver_count < opts->mcast_receivers) {
+        error("Only %zu of %" PRIu16 " receivers joined", receiver_count, 
+                opts->mcast_receivers);
+    }
+
+    // Multicast the data. Every receiver reports what it has, and the 
+    // packages anyone lacks are sent again, once for all of them.
+    size_t hdr_size = sizeof(DATA) - sizeof(char*);
+    uint64_t pck_total = (data_length + opts->pck_size - 1) / opts->pck_size;
+    mcast_window window;
+    memset(&window, 0, sizeof(window));
+    const char* data_ptr = data;
+    uint64_t data_left = data_length;
+    uint64_t next_pck = 0;
+    uint64_t base = window_base(receivers, receiver_count, pck_total);
+    bool b_pending = !b_connection_closed;
+    while (b_pending && !b_connection_closed && 
+            !b_was_udpm_cl_interrupted) {
+        // New packages, as far as the slowest receiver lets us.
+        while (next_pck < pck_total && next_pck < base + MCAST_WINDOW &&
+                !b_connection_closed) {
+            size_t slot = next_pck % MCAST_WINDOW;
+            if (window.pcks[slot] == NULL) {
+                window.pcks[slot] = malloc(hdr_size + opts->pck_size);
+                assert_null(window.pcks[slot], socket_fd, -1, NULL, data);
+            }
+            uint32_t curr_len = calc_pck_size(data_left, opts->pck_size);
+            const char* chunk = input_next(opts->input, &data_ptr, 
+                                            &curr_len);
+            if (chunk == NULL) {
+                // The input ended early, the reader reported it.
+                b_connection_closed = true;
+                break;
+            }
+            init_data_pck(session_id, htobe64(next_pck), htobe32(curr_len),
+                            window.pcks[slot], chunk);
+            input_release(opts->input);
+            window.sizes[slot] = hdr_size + curr_len;
+            window.b_repair[slot] = false;
+            window.sent_ns[slot] = monotonic_ns();
+            ssize_t bytes_written = TRACED(TRACE_SEND,
+                    net_sendto(socket_fd, window.pcks[slot], 
+                                window.sizes[slot], 0, 
+                                (struct sockaddr*)group_addr, addr_length));
+            b_connection_closed = assert_write(bytes_written, 
+                                                window.sizes[slot], 
+                                                socket_fd, -1, NULL, data);
+            data_left -= curr_len;
+            ++next_pck;
+        }
+
+        // Take in all the reports that came.
+        bool b_heard = !b_connection_closed && 
+                        wait_readable(socket_fd, MCAST_NAK_WAIT);
+        while (b_heard && !b_connection_closed) {
+            NAK report;
+            struct sockaddr_in from;
+            socklen_t from_length = sizeof(from);
+            ssize_t bytes_read = TRACED(TRACE_RECV,
+                    net_recvfrom(socket_fd, &report, sizeof(report), 
+                                MSG_DONTWAIT, (struct sockaddr*)&from,
+                                &from_length));
+            if (bytes_read < 0 && errno == EAGAIN) {
+                errno = 0;
+                break;
+            }
+            else if (bytes_read <= 0) {
+                // Will produce error message.
+                b_connection_closed = assert_read(bytes_read, sizeof(report),
+                                                    socket_fd, -1, NULL, 
+                                                    data);
+                break;
+            }
+            mcast_receiver* receiver = find_receiver(receivers, 
+                                                    receiver_count, &from);
+            if (receiver == NULL || report.session_id != session_id) {
+                continue;
+            }
+            receiver->heard_ns = monotonic_ns();
+            if (bytes_read == sizeof(NAK) && report.pkt_type_id == NAK_TYPE) {
+                uint64_t pkt_nr = be64toh(report.pkt_nr);
+                uint64_t missing = be64toh(report.missing);
+                if (pkt_nr > receiver->pkt_nr) {
+                    receiver->pkt_nr = pkt_nr;
+                }
+                for (uint64_t i = 0; i < MCAST_WINDOW && 
+                                        pkt_nr + i < next_pck; ++i) {
+                    if (missing & (1ULL << i)) {
+                        window.b_repair[(pkt_nr + i) % MCAST_WINDOW] = true;
+                    }
+                }
+            }
+            else if (bytes_read == sizeof(RCVD) && 
+                    report.pkt_type_id == RCVD_TYPE) {
+                receiver->b_done = true;
+            }
+            else if (bytes_read == sizeof(RJT) && 
+                    report.pkt_type_id == RJT_TYPE) {
+                error("Data rejected by %s", inet_ntoa(from.sin_addr));
+                receiver->b_failed = true;
+            }
+            // Anything else, e.g. an answer to a repeated CONN, is skipped.
+        }
+
+        uint64_t now_ns = monotonic_ns();
+        for (size_t i = 0; i < receiver_count; ++i) {
+            mcast_receiver* receiver = &receivers[i];
+            if (!receiver->b_done && !receiver->b_failed &&
+                now_ns - receiver->heard_ns > 
+                    MAX_WAIT * MAX_RETRANSMITS * 1000000000ULL) {
+                error("Receiver %s timed out", 
+                        inet_ntoa(receiver->addr.sin_addr));
+                receiver->b_failed = true;
+            }
+        }
+        base = window_base(receivers, receiver_count, pck_total);
+        b_pending = base < pck_total;
+        for (size_t i = 0; i < receiver_count; ++i) {
+            b_pending = b_pending || 
+                        (!receivers[i].b_done && !receivers[i].b_failed);
+        }
+        if (!b_heard && base < next_pck) {
+            // Silence, the last packages or the reports may be lost.
+            window.b_repair[base % MCAST_WINDOW] = true;
+        }
+
+        // Repairs, one for all the receivers that asked.
+        for (uint64_t pkt_nr = base; pkt_nr < next_pck && 
+                                    !b_connection_closed; ++pkt_nr) {
+            size_t slot = pkt_nr % MCAST_WINDOW;
+            if (!window.b_repair[slot] || 
+                now_ns - window.sent_ns[slot] < MCAST_NAK_WAIT * 1000000ULL) {
+                continue;
+            }
+            TRACE_MARK(TRACE_RETRANSMIT, pkt_nr);
+            window.b_repair[slot] = false;
+            window.sent_ns[slot] = now_ns;
+            ssize_t bytes_written = TRACED(TRACE_SEND,
+                    net_sendto(socket_fd, window.pcks[slot], 
+                                window.sizes[slot], 0, 
+                                (struct sockaddr*)group_addr, addr_length));
+            b_connection_closed = assert_write(bytes_written, 
+                                                window.sizes[slot], 
+                                                socket_fd, -1, NULL, data);
+        }
+    }
+
+    size_t confirmed = 0;
+    for (size_t i = 0; i < receiver_count; ++i) {
+        confirmed += receivers[i].b_done;
+    }
+    if (receiver_count > 0 && confirmed < receiver_count) {
+        error("%zu of %zu receivers confirmed the data", confirmed, 
+                receiver_count);
+    }
+    for (size_t slot = 0; slot < MCAST_WINDOW; ++slot) {
+        free(window.pcks[slot]);
+    }
+    assert_socket_close(socket_fd);
+}
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef UDPM_CLIENT_H
+#define UDPM_CLIENT_H
+
+#include "common.h"
+#include "err.h"
+
+/* Function that sends data_length bytes to every server in the multicast 
+group group_addr. It waits for opts->mcast_receivers servers to answer the 
+CONN, then multicasts the data, repairing what they report missing, until 
+all of them sent RCVD. */
+void run_udpm_client(const struct sockaddr_in* group_addr, char* data,
+                        uint64_t data_length, const client_opts* opts);
+
+#endif
\ No newline at end of file
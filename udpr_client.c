@@ -1,5 +1,9 @@
 #include "udpr_client.h"
 #include "protconst.h"
+#include "trace.h"
+#include "net.h"
+#include "latency.h"
+#include "input.h"
 
 bool volatile b_was_udpr_cl_interrupted = false;
 
@@ -7,55 +11,82 @@ void udpr_cl_handler() {
     b_was_udpr_cl_interrupted = true;
 }
 
-void run_udpr_client(const struct sockaddr_in* server_addr, char* data, 
-                    uint64_t data_length, uint64_t session_id) {
-    // Create a socket.
+bool send_udpr_session(int socket_fd, const struct sockaddr_in* server_addr,
+                        char* data, uint64_t data_length, 
+                        const client_opts* opts) {
+    uint64_t session_id = opts->session_id;
     // Using server_addr directly caused problems, so I'm performing
     // a local copy of the sockaddr_in structure.
     struct sockaddr_in loc_server_addr = *server_addr;
-    int socket_fd = create_socket(UDPR_PROT_ID, data);
-    ignore_signal(udpr_cl_handler, SIGINT);
-
-    // Set timeouts for the server.
-    set_timeouts(-1, socket_fd, data);
+    bool b_delivered = false;
 
     // CONN-CONACK loop
+    uint64_t pck_number = 0;
+    uint64_t data_offset = 0;
     int retransmit_iter = -1;
     bool b_connection_closed = false;
+    // The first DATA package can ride along with the CONN.
+    const char* first_chunk = NULL;
+    uint32_t first_len = 0;
+    if (opts->b_first_flight && data_length > 0) {
+        const char* first_ptr = data;
+        first_len = calc_pck_size(data_length, opts->pck_size);
+        first_chunk = input_next(opts->input, &first_ptr, &first_len);
+        b_connection_closed = first_chunk == NULL;
+    }
+    char* conn_pck = malloc(sizeof(CONN) + sizeof(DATA) + first_len);
+    assert_null(conn_pck, socket_fd, -1, NULL, data);
+    size_t conn_size = init_conn_pck(UDPR_PROT_ID, opts, data_length,
+                                    first_chunk, first_len, conn_pck);
     while (!b_connection_closed && retransmit_iter < MAX_RETRANSMITS &&
             !b_was_udpr_cl_interrupted) {
         socklen_t addr_length = (socklen_t)sizeof(*server_addr);
-        CONN connection_data = {.pkt_type_id = CONN_TYPE, 
-                                .session_id = session_id,
-                                .prot_id = UDPR_PROT_ID, 
-                                .data_length = htobe64(data_length)};
-        ssize_t bytes_written = sendto(socket_fd, &connection_data, 
-                                        sizeof(connection_data), 0,
+        uint64_t conn_sent_ns = realtime_ns();
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                net_sendto(socket_fd, conn_pck, conn_size, 0,
                                         (struct sockaddr*)&loc_server_addr,
-                                        addr_length);
-        b_connection_closed = assert_write(bytes_written, 
-                                            sizeof(connection_data), socket_fd,
-                                            -1, NULL, data);
+                                        addr_length));
+        b_connection_closed = assert_write(bytes_written, conn_size, 
+                                            socket_fd, -1, NULL, data);
+        if (opts->b_latency) {
+            conn_sent_ns = tx_timestamp(socket_fd, conn_sent_ns);
+        }
         if (!b_connection_closed && !b_was_udpr_cl_interrupted) {
-            // Try to get a CONACC package.
-            CONACC conacc_pck;
-            ssize_t bytes_read = recvfrom(socket_fd, &conacc_pck,
+            // Try to get a CONACC (or RESACC) package.
+            char conacc_pck[sizeof(RESACC) + sizeof(ACC)];
+            uint64_t conacc_rx_ns = 0;
+            ssize_t bytes_read = TRACED(TRACE_RECV,
+                    recvfrom_ts(socket_fd, conacc_pck,
                                     sizeof(conacc_pck), 0,
                                     (struct sockaddr*)&loc_server_addr,
-                                    &addr_length);
+                                    &addr_length, opts->b_latency ?
+                                    &conacc_rx_ns : NULL));
             if (bytes_read >= 0 || (bytes_read < 0 && errno != EAGAIN)) {
-                b_connection_closed = assert_read(bytes_read, 
-                                                    sizeof(conacc_pck), 
+                if (bytes_read <= 0) {
+                    // Will produce error message.
+                    b_connection_closed = assert_read(bytes_read, 
+                                                    sizeof(CONACC), 
                                                     socket_fd, -1, NULL, data);
+                }
                 if (!b_connection_closed) {
-                    b_connection_closed = get_connac_pck(&conacc_pck, 
-                                                        session_id);
+                    b_connection_closed = get_conn_resp(conacc_pck, 
+                                                bytes_read, opts, data,
+                                                data_length, &pck_number,
+                                                &data_offset);
                     if (!b_connection_closed) {
-                        // We got CONACC, exit the loop.
+                        // We got CONACC, exit the loop. Answers to 
+                        // retransmitted CONNs are ambiguous, skip them.
+                        if (opts->b_latency && retransmit_iter == -1) {
+                            record_rtt(&conn_rtt_hist, conn_sent_ns, 
+                                        conacc_rx_ns);
+                        }
                         break;
                     }
                 }
             }
+            else {
+                TRACE_MARK(TRACE_TIMEOUT, pck_number);
+            }
             errno = 0;// EAGAIN, repeat the process.
         }
 
@@ -67,40 +98,78 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
         b_connection_closed = true;
     }
     errno = 0; // Clear it from EAGAIN for future purposes.
+    free(conn_pck);
+    if (!b_connection_closed && first_chunk != NULL && pck_number > 0) {
+        // The server took the first package, otherwise it's sent again below.
+        input_release(opts->input);
+    }
 
-    // Connection established. Start data sending loop.
-    uint64_t pck_number = 0;
-    const char* data_ptr = data;
-    while(data_length > 0 && !b_connection_closed && !b_was_udpr_cl_interrupted) {
+    // Connection established. Start data sending loop. A stream goes on
+    // until the input ends, and then sends EOS.
+    bool b_stream = data_length == STREAM_LENGTH;
+    bool b_input_ended = false;
+    const char* data_ptr = data + data_offset;
+    data_length -= data_offset;
+    while((data_length > 0 || b_stream) && !b_connection_closed && 
+            !b_was_udpr_cl_interrupted) {
         // recvfrom can change the value of the addr_length,
         // so I have to update it here over and over again.
         socklen_t addr_length = (socklen_t)sizeof(loc_server_addr);
-        uint32_t curr_len = calc_pck_size(data_length);
+        uint32_t curr_len = calc_pck_size(data_length, opts->pck_size);
 
         // Initialize a package.
         ssize_t pck_size = sizeof(DATA) - sizeof(char*) + curr_len;
         char* data_pck = malloc(pck_size);
         assert_null(data_pck, socket_fd, -1, NULL, data);
         
-        init_data_pck(session_id, htobe64(pck_number), 
-                                htobe32(curr_len), data_pck, data_ptr);
+        const char* chunk = input_next(opts->input, &data_ptr, &curr_len);
+        if (chunk == NULL && b_stream && !input_failed(opts->input)) {
+            free(data_pck);
+            b_input_ended = true;
+            break;
+        }
+        if (chunk == NULL) {
+            // The input ended early, the reader reported it.
+            free(data_pck);
+            b_connection_closed = true;
+            break;
+        }
+        pck_size = sizeof(DATA) - sizeof(char*) + curr_len;
+        if (opts->conn_flags & CONN_FLAG_COMPACT) {
+            pck_size = init_cdata_pck(UDPR_PROT_ID, session_id, pck_number,
+                                    curr_len, data_pck, chunk) + curr_len;
+        }
+        else {
+            init_data_pck(session_id, htobe64(pck_number), 
+                            htobe32(curr_len), data_pck, chunk);
+        }
+        // The package holds its own copy now.
+        input_release(opts->input);
 
         // Send data to the server.
-        ssize_t bytes_written = sendto(socket_fd, data_pck, pck_size, 0,
+        uint64_t data_sent_ns = realtime_ns();
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                net_sendto(socket_fd, data_pck, pck_size, 0,
                                         (struct sockaddr*)&loc_server_addr, 
-                                        addr_length);
+                                        addr_length));
         b_connection_closed = assert_write(bytes_written, pck_size, socket_fd,
                                             -1, data_pck, data);
+        if (opts->b_latency) {
+            data_sent_ns = tx_timestamp(socket_fd, data_sent_ns);
+        }
 
         // Managed to send the data, try to get an ACC.
         ACC acc_pck;
         retransmit_iter = 0;
         // DATA-ACC loop.
         while (!b_connection_closed && !b_was_udpr_cl_interrupted) {
-            ssize_t bytes_read = recvfrom(socket_fd, &acc_pck,
+            uint64_t acc_rx_ns = 0;
+            ssize_t bytes_read = TRACED(TRACE_RECV,
+                    recvfrom_ts(socket_fd, &acc_pck,
                                             sizeof(acc_pck), 0,
                                             (struct sockaddr*)&loc_server_addr,
-                                            &addr_length);
+                                            &addr_length, opts->b_latency ?
+                                            &acc_rx_ns : NULL));
             if ((bytes_read < 0 && errno != EAGAIN) || bytes_read == 0) { 
                 // Will produce error message.
                 b_connection_closed = assert_read(bytes_read, sizeof(acc_pck),
@@ -111,6 +180,10 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
                     ACC_TYPE && acc_pck.session_id == session_id && 
                     be64toh(acc_pck.pkt_nr) == pck_number) {
                     // We received a confirmation, let's proceed.
+                    // Retransmitted packages don't give reliable samples.
+                    if (opts->b_latency && retransmit_iter == 0) {
+                        record_rtt(&data_rtt_hist, data_sent_ns, acc_rx_ns);
+                    }
                     break;
                 }
                 else if (bytes_read == sizeof(RJT) && acc_pck.pkt_type_id ==
@@ -124,8 +197,10 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
                         acc_pck.pkt_type_id == ACC_TYPE && 
                         acc_pck.session_id == session_id && 
                         be64toh(acc_pck.pkt_nr) < pck_number) &&
-                        !(bytes_read == sizeof(CONACC) && 
+                        !(bytes_read >= (ssize_t)sizeof(CONACC) && 
                         acc_pck.pkt_type_id == CONACC_TYPE &&
+                        acc_pck.session_id == session_id) &&
+                        !(acc_pck.pkt_type_id == RESACC_TYPE &&
                         acc_pck.session_id == session_id)) {
                     // Garbage we can't ignore.
                     b_connection_closed = true;
@@ -134,6 +209,7 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
             }
             else { // errno == EAGAIN
                 // Connection timeout. Retransmit the data.
+                TRACE_MARK(TRACE_TIMEOUT, pck_number);
                 if (retransmit_iter >= MAX_RETRANSMITS) {
                     // Or not because we reached the retransmit limit.
                     b_connection_closed = true;
@@ -142,9 +218,11 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
                 }
                 else {
                     errno = 0;
-                    bytes_written = sendto(socket_fd, data_pck, pck_size, 0,
+                    TRACE_MARK(TRACE_RETRANSMIT, pck_number);
+                    bytes_written = TRACED(TRACE_SEND,
+                            net_sendto(socket_fd, data_pck, pck_size, 0,
                                             (struct sockaddr*)&loc_server_addr,
-                                            addr_length);
+                                            addr_length));
                     b_connection_closed = assert_write(bytes_written, pck_size,
                                             socket_fd, -1, data_pck, data);
                     ++retransmit_iter;
@@ -156,22 +234,52 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
         if (!b_connection_closed)  {
             // Update invariants after the data-acc loop.
             ++pck_number;
-            data_length -= curr_len;
-            data_ptr += curr_len;
+            if (!b_stream) {
+                data_length -= curr_len;
+            }
             free(data_pck);
         }
     }
 
+    // The EOS of a stream is confirmed by the RCVD.
+    char eos_pck[sizeof(DATA)];
+    size_t eos_size = 0;
+    if (b_input_ended && !b_connection_closed && 
+        !b_was_udpr_cl_interrupted) {
+        eos_size = init_eos_pck(UDPR_PROT_ID, opts, pck_number, eos_pck);
+        ssize_t bytes_written = TRACED(TRACE_SEND,
+                net_sendto(socket_fd, eos_pck, eos_size, 0,
+                                        (struct sockaddr*)&loc_server_addr,
+                                        sizeof(loc_server_addr)));
+        b_connection_closed = assert_write(bytes_written, eos_size, 
+                                            socket_fd, -1, NULL, data);
+    }
+
     if (!b_connection_closed && !b_was_udpr_cl_interrupted) {
         // Get the RCVD package if we managed to send everything.
         RCVD rcvd_pck;
+        retransmit_iter = 0;
         while (!b_connection_closed) {
             socklen_t addr_length = (socklen_t)sizeof(loc_server_addr);
-            ssize_t bytes_read = recvfrom(socket_fd, &rcvd_pck,
+            ssize_t bytes_read = TRACED(TRACE_RECV,
+                    net_recvfrom(socket_fd, &rcvd_pck,
                                         sizeof(rcvd_pck), 0,
                                         (struct sockaddr*)&loc_server_addr,
-                                        &addr_length);
-            if (bytes_read <= 0) { // Will produce error message.
+                                        &addr_length));
+            if (bytes_read < 0 && errno == EAGAIN && eos_size > 0 &&
+                retransmit_iter < MAX_RETRANSMITS) {
+                // The EOS or the RCVD got lost, send the EOS again.
+                errno = 0;
+                TRACE_MARK(TRACE_RETRANSMIT, pck_number);
+                ssize_t bytes_written = TRACED(TRACE_SEND,
+                        net_sendto(socket_fd, eos_pck, eos_size, 0,
+                                        (struct sockaddr*)&loc_server_addr,
+                                        addr_length));
+                b_connection_closed = assert_write(bytes_written, eos_size,
+                                            socket_fd, -1, NULL, data);
+                ++retransmit_iter;
+            }
+            else if (bytes_read <= 0) { // Will produce error message.
                 b_connection_closed = assert_read(bytes_read, sizeof(rcvd_pck),
                                                     socket_fd, -1, NULL, data);
             }
@@ -180,6 +288,7 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
                     rcvd_pck.session_id == session_id) {
                 // We received a confirmation, exit the loop.
                 b_connection_closed = true;
+                b_delivered = true;
             }
             else if (bytes_read != sizeof(ACC) ||
                     rcvd_pck.session_id != session_id || 
@@ -192,6 +301,25 @@ void run_udpr_client(const struct sockaddr_in* server_addr, char* data,
         }
     }
 
+    return !b_delivered;
+}
+
+void run_udpr_client(const struct sockaddr_in* server_addr, char* data, 
+                    uint64_t data_length, const client_opts* opts) {
+    // Create a socket.
+    int socket_fd = create_socket(UDPR_PROT_ID, data);
+    if (opts->b_latency) {
+        enable_timestamping(socket_fd);
+    }
+    ignore_signal(udpr_cl_handler, SIGINT);
+
+    // Set timeouts for the server.
+    set_timeouts(-1, socket_fd, data);
+    enable_busy_poll(socket_fd);
+    pin_thread(opts->pin_cpu);
+
+    send_udpr_session(socket_fd, server_addr, data, data_length, opts);
+
     // End the connection.
     assert_socket_close(socket_fd);
 }
\ No newline at end of file
@@ -1,10 +1,17 @@
-#ifndef UDP_SERVER_H
-#define UDP_SERVER_H
+#ifndef UDPR_CLIENT_H
+#define UDPR_CLIENT_H
 
 #include "common.h"
 #include "err.h"
 
+/* Function that sends data_length bytes as a single session from socket_fd
+to server_addr and waits for RCVD. Returns true if the server didn't 
+confirm the data. */
+bool send_udpr_session(int socket_fd, const struct sockaddr_in* server_addr,
+                        char* data, uint64_t data_length, 
+                        const client_opts* opts);
+
 void run_udpr_client(const struct sockaddr_in* server_addr, char* data, 
-                        uint64_t data_length, uint64_t session_id);
+                        uint64_t data_length, const client_opts* opts);
 
 #endif
\ No newline at end of file
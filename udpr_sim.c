@@ -0,0 +1,383 @@
+#include "common.h"
+#include "protconst.h"
+#include "err.h"
+#include "net.h"
+#include "stats.h"
+#include "udp_server.h"
+#include "udpr_client.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+
+// Deterministic simulation of a UDPR transfer. The real run_udpr_client and
+// run_udp_server run in two threads, but only one of them runs at a time: a
+// thread hands the turn over whenever it would block in recvfrom. Time is
+// virtual and jumps straight to the next delivery or receive timeout, so a
+// MAX_WAIT timeout costs no wall time. A seed fixes the lost datagrams.
+
+#define USAGE "usage: %s [-n bytes] [-k pck_size] [-l loss] [-d delay_us] "\
+                "[-b rate_Bps] [-s seed] [-c]"
+
+#define EP_CLIENT 0
+#define EP_SERVER 1
+#define EP_COUNT 2
+
+#define EP_READY 0 // Waiting for its first turn.
+#define EP_BLOCKED 1 // Waiting in recvfrom.
+#define EP_RUNNING 2
+#define EP_DONE 3
+
+#define NS_PER_US 1000ULL
+#define NS_PER_SEC 1000000000ULL
+
+typedef struct sim_pck {
+    uint64_t deliver_ns;
+    size_t len;
+    struct sim_pck* next;
+    char data[];
+} sim_pck;
+
+typedef struct {
+    int state;
+    uint64_t deadline_ns;
+    // Datagrams on the way to this endpoint, in delivery order.
+    sim_pck* head;
+    sim_pck* tail;
+    // When the link towards the peer finishes sending its backlog.
+    uint64_t busy_until_ns;
+    uint64_t sent;
+    uint64_t sent_bytes;
+    uint64_t lost;
+} sim_endpoint;
+
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sim_cond = PTHREAD_COND_INITIALIZER;
+// Endpoint allowed to run, -1 once both are done.
+int sim_turn = EP_SERVER;
+uint64_t sim_now_ns = 0;
+uint64_t client_end_ns = 0;
+sim_endpoint endpoints[EP_COUNT];
+_Thread_local int sim_self;
+
+double sim_loss = 0;
+uint64_t sim_delay_ns = 100 * NS_PER_US;
+uint64_t sim_rate_Bps = 0;
+uint64_t rng_state = 1;
+
+// xorshift64*, so a given seed replays the same losses.
+uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+bool rng_chance(double probability) {
+    return probability > 0 &&
+            (rng_next() >> 11) * (1.0 / (1ULL << 53)) < probability;
+}
+
+// Gives the turn to the endpoint whose next event comes first and moves the
+// clock there. Called with sim_lock held by the thread giving up its turn.
+void sim_schedule(void) {
+    int next = -1;
+    uint64_t next_ns = UINT64_MAX;
+    for (int ep = 0; ep < EP_COUNT; ++ep) {
+        sim_endpoint* endpoint = &endpoints[ep];
+        uint64_t event_ns;
+        if (endpoint->state == EP_READY) {
+            event_ns = sim_now_ns;
+        }
+        else if (endpoint->state == EP_BLOCKED) {
+            event_ns = endpoint->deadline_ns;
+            if (endpoint->head != NULL &&
+                endpoint->head->deliver_ns < event_ns) {
+                event_ns = endpoint->head->deliver_ns;
+            }
+            if (ep == EP_SERVER && endpoint->head == NULL &&
+                endpoints[EP_CLIENT].state == EP_DONE) {
+                // Nothing will ever arrive, stop the server like SIGINT.
+                b_was_udp_server_interrupted = true;
+                event_ns = sim_now_ns;
+            }
+        }
+        else {
+            continue;
+        }
+
+        if (event_ns < next_ns) {
+            next = ep;
+            next_ns = event_ns;
+        }
+    }
+
+    if (next >= 0 && next_ns > sim_now_ns) {
+        sim_now_ns = next_ns;
+    }
+    sim_turn = next;
+    pthread_cond_broadcast(&sim_cond);
+}
+
+void sim_wait_turn(int ep) {
+    while (sim_turn != ep) {
+        pthread_cond_wait(&sim_cond, &sim_lock);
+    }
+    endpoints[ep].state = EP_RUNNING;
+}
+
+ssize_t sim_sendto(int socket_fd, const void* buf, size_t len, int flags,
+                    const struct sockaddr* addr, socklen_t addr_length) {
+    (void)socket_fd;
+    (void)flags;
+    (void)addr;
+    (void)addr_length;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_endpoint* self = &endpoints[sim_self];
+    sim_endpoint* peer = &endpoints[EP_COUNT - 1 - sim_self];
+    self->sent++;
+    self->sent_bytes += len;
+
+    // The link serializes datagrams, lost ones included.
+    uint64_t start_ns = self->busy_until_ns > sim_now_ns ?
+                            self->busy_until_ns : sim_now_ns;
+    self->busy_until_ns = start_ns +
+                    (sim_rate_Bps ? len * NS_PER_SEC / sim_rate_Bps : 0);
+
+    if (rng_chance(sim_loss)) {
+        self->lost++;
+    }
+    else if (peer->state != EP_DONE) {
+        sim_pck* pck = malloc(sizeof(sim_pck) + len);
+        if (pck == NULL) {
+            syserr("Failed to queue a datagram");
+        }
+        pck->deliver_ns = self->busy_until_ns + sim_delay_ns;
+        pck->len = len;
+        pck->next = NULL;
+        memcpy(pck->data, buf, len);
+        if (peer->tail == NULL) {
+            peer->head = pck;
+        }
+        else {
+            peer->tail->next = pck;
+        }
+        peer->tail = pck;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return len;
+}
+
+ssize_t sim_recvfrom(int socket_fd, void* buf, size_t len, int flags,
+                        struct sockaddr* addr, socklen_t* addr_length) {
+    (void)socket_fd;
+    (void)flags;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_endpoint* self = &endpoints[sim_self];
+    self->deadline_ns = sim_now_ns + MAX_WAIT * NS_PER_SEC;
+    while (true) {
+        sim_pck* pck = self->head;
+        // A datagram arriving exactly at the deadline loses to the timeout.
+        // Both sides use the same MAX_WAIT, so a retransmission lands right
+        // when the peer's own timer fires; the kernel breaks that tie either
+        // way, and always delivering would hide the peer's retransmission.
+        if (pck != NULL && pck->deliver_ns <= sim_now_ns &&
+            pck->deliver_ns < self->deadline_ns) {
+            self->head = pck->next;
+            if (self->head == NULL) {
+                self->tail = NULL;
+            }
+            pthread_mutex_unlock(&sim_lock);
+
+            // Like recvfrom, the rest of a too long datagram is dropped.
+            size_t copied = pck->len < len ? pck->len : len;
+            memcpy(buf, pck->data, copied);
+            free(pck);
+            if (addr != NULL) {
+                struct sockaddr_in peer_addr = {.sin_family = AF_INET};
+                peer_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                memcpy(addr, &peer_addr, sizeof(peer_addr));
+                *addr_length = sizeof(peer_addr);
+            }
+            return copied;
+        }
+
+        if (sim_now_ns >= self->deadline_ns ||
+            (sim_self == EP_SERVER && b_was_udp_server_interrupted)) {
+            pthread_mutex_unlock(&sim_lock);
+            errno = EAGAIN;
+            return -1;
+        }
+
+        self->state = EP_BLOCKED;
+        sim_schedule();
+        sim_wait_turn(sim_self);
+    }
+}
+
+const net_ops sim_ops = {.sendto = sim_sendto, .recvfrom = sim_recvfrom};
+
+typedef struct {
+    char* data;
+    uint64_t data_length;
+    client_opts opts;
+} client_args;
+
+void finish_endpoint(int ep) {
+    pthread_mutex_lock(&sim_lock);
+    endpoints[ep].state = EP_DONE;
+    // Whatever was still on the way is gone.
+    while (endpoints[ep].head != NULL) {
+        sim_pck* pck = endpoints[ep].head;
+        endpoints[ep].head = pck->next;
+        free(pck);
+    }
+    endpoints[ep].tail = NULL;
+    if (ep == EP_CLIENT) {
+        client_end_ns = sim_now_ns;
+    }
+    sim_schedule();
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void* client_thread(void* arg) {
+    client_args* args = arg;
+    sim_self = EP_CLIENT;
+    pthread_mutex_lock(&sim_lock);
+    sim_wait_turn(EP_CLIENT);
+    pthread_mutex_unlock(&sim_lock);
+
+    struct sockaddr_in server_addr = {.sin_family = AF_INET};
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    run_udpr_client(&server_addr, args->data, args->data_length,
+                    &args->opts);
+    finish_endpoint(EP_CLIENT);
+    return NULL;
+}
+
+void* server_thread(void* arg) {
+    (void)arg;
+    sim_self = EP_SERVER;
+    pthread_mutex_lock(&sim_lock);
+    sim_wait_turn(EP_SERVER);
+    pthread_mutex_unlock(&sim_lock);
+
+    // Port 0, the real socket is never used.
+    server_opts opts = {.output_dir = NULL, .stats_file = NULL,
+                        .stats_socket = NULL, .pin_cpu = -1};
+    run_udp_server(0, &opts);
+    finish_endpoint(EP_SERVER);
+    return NULL;
+}
+
+double read_double(const char* string) {
+    char* endptr;
+    double value = strtod(string, &endptr);
+    if (*endptr != 0 || *string == 0 || value < 0) {
+        fatal("%s is not a valid number.", string);
+    }
+    return value;
+}
+
+uint64_t read_u64(const char* string) {
+    char* endptr;
+    errno = 0;
+    unsigned long long value = strtoull(string, &endptr, 10);
+    if (errno == ERANGE || *endptr != 0 || *string == 0) {
+        fatal("%s is not a valid number.", string);
+    }
+    return value;
+}
+
+int main(int argc, char* argv[]) {
+    client_args args = {.data_length = 100000000,
+                        .opts = {.session_id = 0, .conn_flags = 0,
+                                .b_latency = false, .pck_size = PCK_SIZE,
+                                .input = NULL, .pin_cpu = -1}};
+    uint64_t seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:l:d:b:s:c")) != -1) {
+        switch (opt) {
+            case 'n':
+                args.data_length = read_u64(optarg);
+                break;
+            case 'k':
+                args.opts.pck_size = read_pck_size(optarg);
+                break;
+            case 'l':
+                sim_loss = read_double(optarg);
+                if (sim_loss > 1) {
+                    fatal("%s is not a valid probability.", optarg);
+                }
+                break;
+            case 'd':
+                sim_delay_ns = read_u64(optarg) * NS_PER_US;
+                break;
+            case 'b':
+                sim_rate_Bps = read_u64(optarg);
+                break;
+            case 's':
+                seed = read_u64(optarg);
+                break;
+            case 'c':
+                args.opts.conn_flags |= CONN_FLAG_COMPACT;
+                break;
+            default:
+                fatal(USAGE, argv[0]);
+        }
+    }
+    if (optind != argc) {
+        fatal(USAGE, argv[0]);
+    }
+    // xorshift never leaves zero.
+    rng_state = seed ? seed : 1;
+    args.opts.session_id = seed;
+
+    // The client owns the buffer, it frees it on errors.
+    args.data = malloc(args.data_length ? args.data_length : 1);
+    assert_null(args.data, -1, -1, NULL, NULL);
+    memset(args.data, 'x', args.data_length);
+
+    // The server prints the received data, keep it off the report.
+    int report_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (report_fd < 0 || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        syserr("Failed to redirect the output");
+    }
+    close(null_fd);
+
+    net_current = &sim_ops;
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    pthread_t server_tid, client_tid;
+    if (pthread_create(&server_tid, NULL, server_thread, NULL) != 0 ||
+        pthread_create(&client_tid, NULL, client_thread, &args) != 0) {
+        fatal("Failed to start the simulation threads");
+    }
+    pthread_join(client_tid, NULL);
+    pthread_join(server_tid, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall_s = (wall_end.tv_sec - wall_start.tv_sec) +
+                    (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+    double virtual_s = (double)client_end_ns / NS_PER_SEC;
+    sim_endpoint* client = &endpoints[EP_CLIENT];
+    sim_endpoint* server = &endpoints[EP_SERVER];
+
+    dprintf(report_fd, "sim bytes=%" PRIu64 " pck_size=%" PRIu32
+            " loss=%g delay_us=%" PRIu64 " rate_Bps=%" PRIu64 " seed=%"
+            PRIu64 " virtual_s=%.6f wall_s=%.6f goodput_Bps=%.0f"
+            " client_sent=%" PRIu64 " client_lost=%" PRIu64
+            " server_sent=%" PRIu64 " server_lost=%" PRIu64 "\n",
+            args.data_length, args.opts.pck_size, sim_loss,
+            (uint64_t)(sim_delay_ns / NS_PER_US), sim_rate_Bps, seed, virtual_s, wall_s,
+            virtual_s > 0 ? args.data_length / virtual_s : 0,
+            client->sent, client->lost, server->sent, server->lost);
+    // Server side view, the session state tells whether it completed.
+    write_stats(report_fd);
+    close(report_fd);
+    return 0;
+}
\ No newline at end of file